@@ -0,0 +1,65 @@
+//@ts-check
+
+/**
+ * Compares transcodeCompressed with transcode followed by zlib/brotli. Invoke
+ * with:
+ *
+ *     node ./benchmark/compressed.mjs [--docs=<int>] [--level=<int>]
+ *
+ * The default of 20000 documents makes ~10 MB of JSON, well beyond L2 cache.
+ */
+
+import benchmark from "benchmark";
+import benchmarks from "beautify-benchmark";
+import {createRequire} from "node:module";
+import zlib from "node:zlib";
+import * as bson from "bson";
+const require = createRequire(import.meta.url);
+const CPP = require("../build/Release/bsonToJson.node");
+
+function arg(name, def) {
+	const a = process.argv.find(s => s.startsWith(`--${name}=`));
+	return a ? Number(a.slice(name.length + 3)) : def;
+}
+
+const nDocs = arg("docs", 20000);
+const level = arg("level", 1);
+const statuses = ["active", "pending", "closed", "archived"];
+const items = Array.from({length: nDocs}, (_, i) => ({
+	_id: new bson.ObjectId(),
+	status: statuses[i % statuses.length],
+	n: i,
+	score: i / 7,
+	createdAt: new Date(1600000000000 + i * 60000),
+	name: `item ${i}`,
+	description: "Lorem ipsum dolor sit amet, \"consectetur\" adipiscing elit.\n".repeat(1 + i % 4)
+}));
+const buf = bson.serialize({items});
+
+const t = new CPP.Transcoder();
+console.log(`${(buf.length / 1e6).toFixed(1)} MB BSON, ${(t.transcode(buf).length / 1e6).toFixed(1)} MB JSON, level ${level}`);
+
+function run(name, fns) {
+	const suite = new benchmark.Suite(name, {
+		onCycle: e => benchmarks.add(e.target),
+		onComplete: () => benchmarks.log()
+	});
+	console.log(name);
+	for (const [k, fn] of Object.entries(fns))
+		suite.add(k, fn);
+	suite.run();
+}
+
+run("gzip", {
+	"transcode + zlib.gzipSync": () => zlib.gzipSync(t.transcode(buf), {level}),
+	"transcodeCompressed": () => t.transcodeCompressed(buf, {level})
+});
+
+const brParams = {
+	[zlib.constants.BROTLI_PARAM_QUALITY]: level,
+	[zlib.constants.BROTLI_PARAM_MODE]: zlib.constants.BROTLI_MODE_TEXT
+};
+run("brotli", {
+	"transcode + zlib.brotliCompressSync": () => zlib.brotliCompressSync(t.transcode(buf), {params: brParams}),
+	"transcodeCompressed": () => t.transcodeCompressed(buf, {format: "br", level})
+});
@@ -10,6 +10,8 @@
         "deps/double_conversion/bignum-dtoa.cc",
         "deps/double_conversion/fast-dtoa.cc",
         "deps/double_conversion/fixed-dtoa.cc",
+        "deps/double_conversion/string-to-double.cc",
+        "deps/double_conversion/strtod.cc",
       ],
       "include_dirs": [
         "<!@(node -p \"require('node-addon-api').include\")"
@@ -50,7 +52,35 @@
           "-Wno-unused-function", # CPU feature detection only used on Win
           "-Wno-unused-const-variable"
         ]
-      }
+      },
+      "conditions": [
+        # dlsym, for brotli's encoder.
+        ["OS=='linux'", {
+          "libraries": ["-ldl"]
+        }],
+        # WebAssembly build via emnapi (`npm run build:wasm`).
+        ["OS=='emscripten'", {
+          "product_extension": "js",
+          "cflags!": [
+            "-march=native",
+            "-falign-loops=32"
+          ],
+          "cflags": [
+            "-O3",
+            "-msimd128",
+            "-sUSE_ZLIB=1"
+          ],
+          "ldflags": [
+            "-O3",
+            "-msimd128",
+            "-sMODULARIZE=1",
+            "-sEXPORT_NAME=bsonToJson",
+            "-sALLOW_MEMORY_GROWTH=1",
+            "-sWASM_BIGINT=1",
+            "-sUSE_ZLIB=1"
+          ]
+        }]
+      ]
     }
   ]
 }
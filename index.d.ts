@@ -1,25 +1,247 @@
+export interface TranscoderOptions {
+	/**
+	 * What to do with invalid UTF-8 in strings and keys: copy it as-is
+	 * (default, fastest), throw an error, or replace each invalid sequence with
+	 * U+FFFD.
+	 */
+	invalidUtf8?: "copy" | "error" | "replace";
+
+	/**
+	 * Write non-ASCII characters in strings and keys as `\uXXXX` escapes
+	 * (surrogate pairs for code points above U+FFFF) so that the output is pure
+	 * ASCII. Invalid UTF-8 becomes `\ufffd` unless `invalidUtf8` is `"error"`.
+	 */
+	asciiOnly?: boolean;
+	/**
+	 * Also escapes `<`, `>`, `&`, U+2028 and U+2029 so the JSON can be inlined
+	 * in an HTML `<script>` element.
+	 */
+	htmlSafe?: boolean;
+	/**
+	 * Maximum nesting depth of documents and arrays, counting the top-level
+	 * document. Defaults to 200.
+	 */
+	maxDepth?: number;
+	/**
+	 * Capacity in bytes (input plus output) of a least-recently-used cache of
+	 * transcoded documents, keyed by their content. Defaults to 0 (disabled).
+	 */
+	cacheBytes?: number;
+	/**
+	 * Number of slots (rounded up to a power of two, at most 65536) in a cache
+	 * of short string values and their escaped output. Speeds up result sets
+	 * where enum-like values repeat. Defaults to 0 (disabled).
+	 */
+	stringCache?: number;
+	/**
+	 * Output envelope for `transcodeChangeEvents()`, mapping output keys to
+	 * dotted paths in the change event. Defaults to `operationType`,
+	 * `documentKey`, `fullDocument` and `updateDescription` as-is.
+	 */
+	changeEnvelope?: Record<string, string>;
+	/**
+	 * Write the keys of each object in byte order of their UTF-8, so that
+	 * documents whose fields are in a different order give the same JSON.
+	 * Array elements keep their order.
+	 */
+	canonical?: boolean;
+	/**
+	 * Compute the XXH64 of each output, returned by `outputHash()`.
+	 */
+	hash?: boolean;
+	/**
+	 * Elements to write of the arrays at each dotted path. See
+	 * `setArraySlices()`.
+	 */
+	arraySlices?: Record<string, ArraySlice>;
+}
+
+export interface ArraySlice {
+	/** Number of leading elements to leave out. Defaults to 0. */
+	skip?: number;
+	/** Maximum number of elements to write after those. Defaults to all. */
+	limit?: number;
+	/**
+	 * Write the array's full length as a sibling after it, keyed by the last
+	 * path segment plus "Count", or by this string.
+	 */
+	count?: boolean | string;
+}
+
+export interface FieldsResult {
+	json: Buffer;
+	/** Opaque map of the top-level fields in the input and `json`. */
+	fields: Uint32Array;
+}
+
+export interface CacheStats {
+	hits: number;
+	misses: number;
+	entries: number;
+	/** Bytes of input plus output held. */
+	bytes: number;
+}
+
+export interface StringCacheStats {
+	hits: number;
+	misses: number;
+	slots: number;
+}
+
+export interface CompressStats {
+	/** Pieces of JSON handed to the compressor. */
+	chunks: number;
+	/** Bytes in the largest piece. */
+	peakBytes: number;
+}
+
 export class Transcoder {
 	/**
 	 * @param p Instance of PopulateInfo if populating paths.
 	 */
-	constructor(p?: PopulateInfo);
+	constructor(p?: PopulateInfo | FrozenPopulateInfo, options?: TranscoderOptions);
 
 	/**
 	 * Transcodes the BSON buffer `b` into a JSON string stored in a Buffer.
+	 * @param b BSON buffer, or an index of one.
+	 */
+	transcode(b: Uint8Array | BsonIndex): Buffer;
+
+	/**
+	 * Deserializes the BSON buffer `b` to the JS values that
+	 * `JSON.parse(transcode(b).toString())` returns, without the JSON in
+	 * between.
+	 * @param b BSON buffer, or an index of one.
+	 */
+	toObject(b: Uint8Array | BsonIndex): any;
+
+	/**
+	 * Transcodes the BSON buffer `b` into a JSON string. Pure-ASCII JSON is
+	 * given to V8 without being copied or decoded. Doesn't use the response
+	 * cache.
+	 * @param b BSON buffer, or an index of one.
+	 */
+	transcodeToString(b: Uint8Array | BsonIndex): string;
+
+	/**
+	 * Transcodes the BSON buffer `b` into `target` at `offset` (default 0).
+	 * Returns the number of bytes written, or the exact number of bytes that
+	 * are needed if the JSON doesn't fit, in which case the contents of
+	 * `target` are unspecified. Doesn't use the response cache.
+	 * @param b BSON buffer, or an index of one.
+	 */
+	transcodeInto(b: Uint8Array | BsonIndex, target: Uint8Array | ArrayBuffer, offset?: number): number | {needed: number};
+
+	/**
+	 * Transcodes the BSON buffer `b` into gzip-, zlib-, raw deflate- or
+	 * brotli-compressed JSON. The JSON is compressed as it's written.
+	 * @param options.format Defaults to `"gzip"`.
+	 * @param options.level zlib compression level (-1 to 9) or brotli quality
+	 * (0 to 11), or `"fast"` for 1. Defaults to zlib's default (6) or 5 for
+	 * brotli. Throws if brotli isn't available.
+	 */
+	transcodeCompressed(b: Uint8Array, options?: {format?: "gzip" | "deflate" | "raw" | "br", level?: number | "fast"}): Buffer;
+
+	/**
+	 * Transcodes the element at `path` in an indexed document, e.g. `"a.0.b"`
+	 * (array elements are addressed by index). `""` is the whole document.
+	 * Returns undefined if there's no such element.
+	 */
+	transcodePath(index: BsonIndex, path: string): Buffer | undefined;
+
+	/**
+	 * Transcodes a change stream event into the `changeEnvelope` from the
+	 * options. An array of events is written as newline-delimited JSON.
+	 * @param b BSON change event, or an array of them.
+	 */
+	transcodeChangeEvents(b: Uint8Array | Uint8Array[]): Buffer;
+
+	/**
+	 * Transcodes `b` like `transcode()`, and also returns the position of each
+	 * top-level field in `b` and `json`, for `retranscode()`.
 	 * @param b BSON buffer
 	 */
-	transcode(b: Uint8Array): Buffer;
+	transcodeFields(b: Uint8Array): FieldsResult;
+
+	/**
+	 * Transcodes `b`, a new version of `prevBson`, copying the JSON of
+	 * top-level fields whose BSON is unchanged from `prevJson`.
+	 * @param prevFields `fields` from the call that returned `prevJson`.
+	 */
+	retranscode(prevBson: Uint8Array, prevJson: Uint8Array, prevFields: Uint32Array, b: Uint8Array): FieldsResult;
 
 	/**
 	 * Finds all ObjectIds in `b` that don't have a corresponding object in `p`.
-	 * @param b BSON buffer.
+	 * Throws if `p` is a FrozenPopulateInfo.
+	 * @param b BSON buffer, or an index of one.
+	 */
+	getMissingIds(b: Uint8Array | BsonIndex); void;
+
+	/**
+	 * Returns statistics for the cache enabled by the `cacheBytes` option.
+	 */
+	cacheStats(): CacheStats;
+
+	/**
+	 * Returns statistics for the cache enabled by the `stringCache` option.
+	 * Strings too long to be cached aren't counted.
+	 */
+	stringCacheStats(): StringCacheStats;
+
+	/**
+	 * Returns statistics for the last `transcodeCompressed` call.
+	 */
+	compressStats(): CompressStats;
+
+	/**
+	 * Returns the XXH64 of the last JSON output (before compression, for
+	 * `transcodeCompressed`) as 16 hex digits, or undefined if the `hash`
+	 * option isn't set, nothing was output yet, or the last call threw or was
+	 * `toObject`.
+	 */
+	outputHash(): string | undefined;
+
+	/**
+	 * Replaces the `arraySlices` option, e.g. for the next page of an array.
+	 * Empties the response cache.
+	 */
+	setArraySlices(slices: Record<string, ArraySlice>): void;
+}
+
+export class BsonIndex {
+	/**
+	 * Validates the structure of `b` and records the position of every
+	 * element, for reuse by Transcoder methods. `b` shouldn't be modified
+	 * afterwards.
+	 * @param b BSON buffer
 	 */
-	getMissingIds(b: Uint8Array); void;
+	constructor(b: Uint8Array);
+
+	/** The number of elements, including the document itself. */
+	readonly length: number;
 }
 
+export interface JsonToBsonOptions {
+	/**
+	 * Dotted paths of fields whose 24-hex-digit string values should be
+	 * encoded as ObjectIds. Elements of an array share the array's path.
+	 */
+	objectIds?: string[];
+	/** Maximum nesting depth of objects and arrays. Default 200. */
+	maxDepth?: number;
+}
+
+/**
+ * Encodes UTF-8 JSON text of an object as BSON. Integral numbers that fit in
+ * an int32 become Ints; other numbers become Doubles.
+ * @param json UTF-8 JSON text.
+ */
+export function jsonToBson(json: Uint8Array, options?: JsonToBsonOptions): Buffer;
+
 export class PopulateInfo {
 	/**
-	 * Adds objects for a path.
+	 * Adds objects for a path. Throws if an item doesn't have a top-level
+	 * ObjectId `_id`, which it's looked up by.
 	 * @param path The path to populate. Can be dotted.
 	 * @param items BSON buffers to populate the path with.
 	 */
@@ -38,3 +260,59 @@ export class PopulateInfo {
 	 */
 	getMissingIdsForPath(path: string): Buffer[];
 }
+
+export class FrozenPopulateInfo {
+	/**
+	 * @param source A PopulateInfo to copy, or the `handle` of an existing
+	 * FrozenPopulateInfo (possibly from another thread) to share.
+	 */
+	constructor(source: PopulateInfo | FrozenPopulateInfo | unknown);
+
+	/**
+	 * Opaque value that can be posted to a worker thread and passed to the
+	 * constructor there. Only valid while a FrozenPopulateInfo or Transcoder
+	 * using the snapshot is alive.
+	 */
+	readonly handle: unknown;
+}
+
+export class TranscoderPool {
+	/**
+	 * @param options.size Number of worker threads. Defaults to
+	 * `os.availableParallelism()`.
+	 * @param options.slabSize Initial size in bytes of the shared buffers used
+	 * to pass documents to and from the workers. Defaults to 1 MiB.
+	 * @param options.populateInfo Items for the workers to populate paths with.
+	 * @param options.transcoder Options for the workers' Transcoders.
+	 */
+	constructor(options?: {
+		size?: number,
+		slabSize?: number,
+		populateInfo?: FrozenPopulateInfo,
+		transcoder?: TranscoderOptions
+	});
+
+	/**
+	 * Transcodes the BSON buffer `b` into a JSON string stored in a Buffer on
+	 * a worker thread.
+	 * @param b BSON buffer
+	 */
+	transcode(b: Uint8Array): Promise<Buffer>;
+
+	/**
+	 * Terminates the worker threads. Pending transcodes are rejected.
+	 */
+	close(): Promise<void>;
+}
+
+/**
+ * The instruction set extension in use, e.g. `"AVX2"`, `"WASM-SIMD128"` or
+ * `"JavaScript"`.
+ */
+export const ISE: string;
+
+/**
+ * Bytes of the input's ArrayBuffer past the end of the input that let the
+ * transcoder skip end-of-input checks in its vector loads.
+ */
+export const INPUT_PADDING: number;
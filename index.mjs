@@ -1,15 +1,28 @@
 import {createRequire} from "node:module";
 
+import loadWasm from "./src/load-wasm.mjs";
+
+// Native addon, then the WebAssembly build of the same C++, then pure JS.
 let imports;
 try {
 	const require = createRequire(import.meta.url);
 	imports = require("./build/Release/bsonToJson.node");
 } catch {
-	imports = await import("./src/bson-to-json.mjs");
+	try {
+		imports = await loadWasm();
+	} catch {
+		imports = await import("./src/bson-to-json.mjs");
+	}
 }
 
 export const Transcoder = imports.Transcoder;
 export const PopulateInfo = imports.PopulateInfo;
+export const FrozenPopulateInfo = imports.FrozenPopulateInfo;
+export const BsonIndex = imports.BsonIndex;
+export const jsonToBson = imports.jsonToBson;
+export const ISE = imports.ISE;
+export const INPUT_PADDING = imports.INPUT_PADDING;
+export {TranscoderPool} from "./src/pool.mjs";
 
 const C_OPEN_SQ = Buffer.from("[");
 const C_COMMA = Buffer.from(",");
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "process-symbol.h"
+
+// Node.js bundles brotli, but doesn't ship its headers, and doesn't export its
+// encoder on every platform and version. These are the parts of
+// brotli/encode.h (v1.x) that are used; the functions are only declared for
+// their types and are looked up at runtime by brotliEncoder() rather than
+// linked against.
+
+extern "C" {
+
+typedef struct BrotliEncoderStateStruct BrotliEncoderState;
+typedef void* (*brotli_alloc_func)(void* opaque, size_t size);
+typedef void (*brotli_free_func)(void* opaque, void* address);
+
+typedef enum BrotliEncoderMode {
+	BROTLI_MODE_GENERIC = 0,
+	BROTLI_MODE_TEXT = 1,
+	BROTLI_MODE_FONT = 2
+} BrotliEncoderMode;
+
+typedef enum BrotliEncoderOperation {
+	BROTLI_OPERATION_PROCESS = 0,
+	BROTLI_OPERATION_FLUSH = 1,
+	BROTLI_OPERATION_FINISH = 2,
+	BROTLI_OPERATION_EMIT_METADATA = 3
+} BrotliEncoderOperation;
+
+typedef enum BrotliEncoderParameter {
+	BROTLI_PARAM_MODE = 0,
+	BROTLI_PARAM_QUALITY = 1,
+	BROTLI_PARAM_LGWIN = 2,
+	BROTLI_PARAM_LGBLOCK = 3,
+	BROTLI_PARAM_DISABLE_LITERAL_CONTEXT_MODELING = 4,
+	BROTLI_PARAM_SIZE_HINT = 5
+} BrotliEncoderParameter;
+
+#define BROTLI_MIN_QUALITY 0
+#define BROTLI_MAX_QUALITY 11
+
+// BROTLI_BOOL is int.
+BrotliEncoderState* BrotliEncoderCreateInstance(brotli_alloc_func alloc_func, brotli_free_func free_func, void* opaque);
+void BrotliEncoderDestroyInstance(BrotliEncoderState* state);
+int BrotliEncoderSetParameter(BrotliEncoderState* state, BrotliEncoderParameter param, uint32_t value);
+int BrotliEncoderCompressStream(BrotliEncoderState* state, BrotliEncoderOperation op,
+	size_t* available_in, const uint8_t** next_in, size_t* available_out, uint8_t** next_out, size_t* total_out);
+int BrotliEncoderIsFinished(BrotliEncoderState* state);
+
+} // extern "C"
+
+struct BrotliEncoderApi {
+	decltype(&BrotliEncoderCreateInstance) createInstance;
+	decltype(&BrotliEncoderDestroyInstance) destroyInstance;
+	decltype(&BrotliEncoderSetParameter) setParameter;
+	decltype(&BrotliEncoderCompressStream) compressStream;
+	decltype(&BrotliEncoderIsFinished) isFinished;
+};
+
+// Returns the encoder exported by the host process, or nullptr if it doesn't
+// export all of the functions.
+inline const BrotliEncoderApi* brotliEncoder() {
+	static const BrotliEncoderApi api = {
+		reinterpret_cast<decltype(&BrotliEncoderCreateInstance)>(findProcessSymbol("BrotliEncoderCreateInstance")),
+		reinterpret_cast<decltype(&BrotliEncoderDestroyInstance)>(findProcessSymbol("BrotliEncoderDestroyInstance")),
+		reinterpret_cast<decltype(&BrotliEncoderSetParameter)>(findProcessSymbol("BrotliEncoderSetParameter")),
+		reinterpret_cast<decltype(&BrotliEncoderCompressStream)>(findProcessSymbol("BrotliEncoderCompressStream")),
+		reinterpret_cast<decltype(&BrotliEncoderIsFinished)>(findProcessSymbol("BrotliEncoderIsFinished"))
+	};
+	static const bool complete = api.createInstance && api.destroyInstance &&
+		api.setParameter && api.compressStream && api.isFinished;
+	return complete ? &api : nullptr;
+}
@@ -1,3 +1,4 @@
+#include <algorithm> // stable_sort
 #include <cstdint>
 #include <cstdlib>
 #include <cstring> // memcpy
@@ -6,16 +7,46 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
+#include <string_view>
 #include <array>
+#include <list>
+#include <memory> // shared_ptr
+#include <mutex>
+#include <vector>
+#include <zlib.h> // bundled with Node.js
 #include "napi.h"
 #include "../deps/double_conversion/double-to-string.h"
+#include "../deps/double_conversion/string-to-double.h"
 #include "cpu-detection.h"
+#include "brotli-encoder.h"
+#ifndef __EMSCRIPTEN__
+// Emscripten's dlsym can't find anything; the WebAssembly build has no brotli.
+#define B2J_BROTLI
+#endif
 #include "fast_itoa.h"
 
-#ifdef _MSC_VER
-# include <intrin.h>
-#elif defined(__GNUC__)
-# include <x86intrin.h>
+#ifndef __EMSCRIPTEN__
+#define B2J_EXTERNAL_STRINGS
+#include "process-symbol.h"
+// node_api_create_external_string_latin1 is exported since Node.js 18.18/20.4
+// (and only declared with NAPI_EXPERIMENTAL), so it's looked up at runtime.
+using CreateExternalLatin1 = napi_status (NAPI_CDECL*)(napi_env env,
+	char* str, size_t length, napi_finalize finalize_callback, void* finalize_hint,
+	napi_value* result, bool* copied);
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+# define B2J_X86
+#endif
+
+#ifdef B2J_X86
+# ifdef _MSC_VER
+#  include <intrin.h>
+# elif defined(__GNUC__)
+#  include <x86intrin.h>
+# endif
+#elif defined(__wasm_simd128__)
+# include <wasm_simd128.h>
 #endif
 
 #if defined(__AVX512F__) && defined(__GNUC__) && defined(B2J_USE_AVX512)
@@ -85,8 +116,111 @@ inline static uint8_t getEscape(uint8_t c) {
 	}
 }
 
+// Checks the multibyte UTF-8 sequence starting at p, of which avail bytes are
+// in the string. Returns its length if it's well-formed. Otherwise returns the
+// negated length of the maximal subpart that the WHATWG Encoding Standard (and
+// so TextDecoder and Buffer#toString) replaces with one U+FFFD.
+inline static int utf8Sequence(const uint8_t* p, size_t avail) {
+	const uint8_t c = p[0];
+	int need;
+	uint8_t lower = 0x80;
+	uint8_t upper = 0xbf;
+	if (c >= 0xc2 && c <= 0xdf) {
+		need = 1;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		need = 2;
+		if (c == 0xe0) lower = 0xa0; // overlong
+		else if (c == 0xed) upper = 0x9f; // surrogate
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		need = 3;
+		if (c == 0xf0) lower = 0x90; // overlong
+		else if (c == 0xf4) upper = 0x8f; // > U+10FFFF
+	} else {
+		return -1;
+	}
+	for (int i = 1; i <= need; i++) {
+		if (static_cast<size_t>(i) >= avail || p[i] < lower || p[i] > upper)
+			return -i;
+		lower = 0x80;
+		upper = 0xbf;
+	}
+	return need + 1;
+}
+
+// Whether the n bytes at p are valid UTF-8. Skips ASCII 8 bytes at a time.
+static bool validUtf8(const uint8_t* p, size_t n) {
+	size_t i = 0;
+	while (i < n) {
+		if (i + 8 <= n) {
+			uint64_t w;
+			memcpy(&w, p + i, 8);
+			if (!(w & 0x8080808080808080ULL)) {
+				i += 8;
+				continue;
+			}
+		}
+		if (p[i] < 0x80) {
+			i++;
+			continue;
+		}
+		const int len = utf8Sequence(p + i, n - i);
+		if (len <= 0)
+			return false;
+		i += len;
+	}
+	return true;
+}
+
+// Decodes the well-formed UTF-8 sequence of length len at p.
+inline static uint32_t decodeUtf8(const uint8_t* p, int len) {
+	switch (len) {
+	case 2: return (p[0] & 0x1f) << 6 | (p[1] & 0x3f);
+	case 3: return (p[0] & 0x0f) << 12 | (p[1] & 0x3f) << 6 | (p[2] & 0x3f);
+	default: return (p[0] & 0x07) << 18 | (p[1] & 0x3f) << 12 | (p[2] & 0x3f) << 6 | (p[3] & 0x3f);
+	}
+}
+
 constexpr const char HEX_DIGITS[] = "0123456789abcdef";
 
+// Loading 16 or 32 bytes from TAIL_MASK + 32 - n gives a vector with n 0xff
+// bytes followed by 0x00 bytes.
+alignas(64) static const uint8_t TAIL_MASK[64] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+// Shuffling a vector by SHIFT_DOWN + s (0 < s < 16) moves byte s to byte 0
+// and zero-fills the top s bytes.
+alignas(32) static const uint8_t SHIFT_DOWN[32] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+// Whether a w-byte load from p crosses into the next page. Loads that don't
+// can't fault even if they read past the end of the buffer. 4 KiB is the
+// smallest x86 page size and divides WebAssembly's 64 KiB page size.
+inline static bool crossesPage(const void* p, size_t w) {
+	return (reinterpret_cast<uintptr_t>(p) & 4095) > 4096 - w;
+}
+
+// Vector loads and stores touch up to this many bytes past the ones they
+// need. Output buffers are allocated with this much slack so stores never
+// check for the end. Loads don't check either when the input's ArrayBuffer
+// extends this far past the input.
+constexpr size_t PADDING = 64;
+// Bytes of JSON handed to the compressor at a time, so they're compressed while
+// still in cache.
+constexpr size_t COMPRESS_CHUNK = 1 << 15;
+// Default brotli quality. brotli's own default, 11, is meant for static
+// assets and is several times slower than 5 for little gain on JSON.
+constexpr int BROTLI_RESPONSE_QUALITY = 5;
+// Outputs up to this size are copied into a Buffer that V8 allocates, and the
+// output buffer is kept for the next call. Larger ones are handed to V8 as
+// external Buffers, which need a finalizer and count as external memory.
+constexpr size_t COPY_OUTPUT_MAX = 1 << 15;
+// Largest output buffer that's kept between calls.
+constexpr size_t SCRATCH_MAX = 1 << 18;
+
 inline static constexpr uint8_t hexNib(uint8_t nib) {
 	// These appear equally fast.
 	return HEX_DIGITS[nib];
@@ -120,6 +254,7 @@ template<> struct Enabler<0> {};
 #define ENSURE_SPACE_OR_RETURN(n) if (UNLIKELY(ensureSpace(n))) return true
 #define RETURN_ERR(msg) return err = (msg), true
 
+#ifdef B2J_X86
 [[gnu::target("sse2")]]
 inline static __m128i _mm_set1_epu8(uint8_t v) {
 	union {
@@ -149,6 +284,156 @@ inline static __m512i _mm512_set1_epu8(uint8_t v) {
 	val.u = v;
 	return _mm512_set1_epi8(val.i);
 }
+#endif // B2J_X86
+
+// Vectorized UTF-8 validation from Keiser & Lemire, "Validating UTF-8 In Less
+// Than One Instruction Per Byte" (https://arxiv.org/abs/2010.03090), as in
+// simdjson. Each byte is classified by three 16-entry tables indexed by the
+// high and low nibbles of the byte before it and its own high nibble. The pair
+// is invalid if all three lookups share a bit. Missing 3rd and 4th
+// continuation bytes are checked separately.
+namespace utf8 {
+	constexpr uint8_t TOO_SHORT = 1 << 0; // 11______ 0_______ or 11______ 11______
+	constexpr uint8_t TOO_LONG = 1 << 1; // 0_______ 10______
+	constexpr uint8_t OVERLONG_3 = 1 << 2; // 11100000 100_____
+	constexpr uint8_t TOO_LARGE = 1 << 3; // 11110100 1001____ etc.
+	constexpr uint8_t SURROGATE = 1 << 4; // 11101101 101_____
+	constexpr uint8_t OVERLONG_2 = 1 << 5; // 1100000_ 10______
+	constexpr uint8_t TOO_LARGE_1000 = 1 << 6; // 11110101 1000____ etc.
+	constexpr uint8_t OVERLONG_4 = 1 << 6; // 11110000 1000____
+	constexpr uint8_t TWO_CONTS = 1 << 7; // 10______ 10______
+	constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+	alignas(16) static const uint8_t BYTE_1_HIGH[16] = {
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		TOO_SHORT | OVERLONG_2,
+		TOO_SHORT,
+		TOO_SHORT | OVERLONG_3 | SURROGATE,
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+	};
+	alignas(16) static const uint8_t BYTE_1_LOW[16] = {
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		CARRY | OVERLONG_2,
+		CARRY,
+		CARRY,
+		CARRY | TOO_LARGE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000
+	};
+	alignas(16) static const uint8_t BYTE_2_HIGH[16] = {
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+	};
+	// Saturating-subtracting the last 16 or 32 bytes of this from a block is
+	// non-zero if the block ends with an incomplete sequence.
+	alignas(32) static const uint8_t INCOMPLETE[32] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+	};
+
+#ifdef B2J_X86
+	// Returns non-zero if input, preceded by prev, contains invalid UTF-8.
+	[[gnu::target("sse4.2")]]
+	inline static __m128i errors(__m128i input, __m128i prev) {
+		const __m128i nib = _mm_set1_epi8(0x0f);
+		const __m128i prev1 = _mm_alignr_epi8(input, prev, 16 - 1);
+		const __m128i byte1High = _mm_shuffle_epi8(
+			_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_1_HIGH)),
+			_mm_and_si128(_mm_srli_epi16(prev1, 4), nib));
+		const __m128i byte1Low = _mm_shuffle_epi8(
+			_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_1_LOW)),
+			_mm_and_si128(prev1, nib));
+		const __m128i byte2High = _mm_shuffle_epi8(
+			_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_2_HIGH)),
+			_mm_and_si128(_mm_srli_epi16(input, 4), nib));
+		const __m128i special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+		const __m128i prev2 = _mm_alignr_epi8(input, prev, 16 - 2);
+		const __m128i prev3 = _mm_alignr_epi8(input, prev, 16 - 3);
+		const __m128i must23 = _mm_or_si128(
+			_mm_subs_epu8(prev2, _mm_set1_epu8(0xe0 - 0x80)), // only 111_____ >= 0x80
+			_mm_subs_epu8(prev3, _mm_set1_epu8(0xf0 - 0x80))); // only 1111____ >= 0x80
+		return _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epu8(0x80)), special);
+	}
+
+	[[gnu::target("sse4.2")]]
+	inline static __m128i incomplete(__m128i input) {
+		return _mm_subs_epu8(input, _mm_load_si128(reinterpret_cast<const __m128i*>(INCOMPLETE + 16)));
+	}
+
+	// Returns non-zero if input, preceded by prev, contains invalid UTF-8.
+	[[gnu::target("avx2")]]
+	inline static __m256i errors(__m256i input, __m256i prev) {
+		const __m256i nib = _mm256_set1_epi8(0x0f);
+		// Bytes 16-31 of prev then 0-15 of input, for the cross-lane shifts.
+		const __m256i carried = _mm256_permute2x128_si256(prev, input, 0x21);
+		const __m256i prev1 = _mm256_alignr_epi8(input, carried, 16 - 1);
+		const __m256i byte1High = _mm256_shuffle_epi8(
+			_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_1_HIGH))),
+			_mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib));
+		const __m256i byte1Low = _mm256_shuffle_epi8(
+			_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_1_LOW))),
+			_mm256_and_si256(prev1, nib));
+		const __m256i byte2High = _mm256_shuffle_epi8(
+			_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(BYTE_2_HIGH))),
+			_mm256_and_si256(_mm256_srli_epi16(input, 4), nib));
+		const __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+		const __m256i prev2 = _mm256_alignr_epi8(input, carried, 16 - 2);
+		const __m256i prev3 = _mm256_alignr_epi8(input, carried, 16 - 3);
+		const __m256i must23 = _mm256_or_si256(
+			_mm256_subs_epu8(prev2, _mm256_set1_epu8(0xe0 - 0x80)),
+			_mm256_subs_epu8(prev3, _mm256_set1_epu8(0xf0 - 0x80)));
+		return _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epu8(0x80)), special);
+	}
+
+	[[gnu::target("avx2")]]
+	inline static __m256i incomplete(__m256i input) {
+		return _mm256_subs_epu8(input, _mm256_load_si256(reinterpret_cast<const __m256i*>(INCOMPLETE)));
+	}
+#endif // B2J_X86
+
+#ifdef __wasm_simd128__
+	// Returns non-zero if input, preceded by prev, contains invalid UTF-8.
+	inline static v128_t errors(v128_t input, v128_t prev) {
+		const v128_t nib = wasm_u8x16_splat(0x0f);
+		const v128_t prev1 = wasm_i8x16_shuffle(prev, input,
+			15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30);
+		const v128_t byte1High = wasm_i8x16_swizzle(wasm_v128_load(BYTE_1_HIGH), wasm_u8x16_shr(prev1, 4));
+		const v128_t byte1Low = wasm_i8x16_swizzle(wasm_v128_load(BYTE_1_LOW), wasm_v128_and(prev1, nib));
+		const v128_t byte2High = wasm_i8x16_swizzle(wasm_v128_load(BYTE_2_HIGH), wasm_u8x16_shr(input, 4));
+		const v128_t special = wasm_v128_and(wasm_v128_and(byte1High, byte1Low), byte2High);
+
+		const v128_t prev2 = wasm_i8x16_shuffle(prev, input,
+			14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29);
+		const v128_t prev3 = wasm_i8x16_shuffle(prev, input,
+			13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28);
+		const v128_t must23 = wasm_v128_or(
+			wasm_u8x16_sub_sat(prev2, wasm_u8x16_splat(0xe0 - 0x80)),
+			wasm_u8x16_sub_sat(prev3, wasm_u8x16_splat(0xf0 - 0x80)));
+		return wasm_v128_xor(wasm_v128_and(must23, wasm_u8x16_splat(0x80)), special);
+	}
+
+	inline static v128_t incomplete(v128_t input) {
+		return wasm_u8x16_sub_sat(input, wasm_v128_load(INCOMPLETE + 16));
+	}
+#endif // __wasm_simd128__
+} // namespace utf8
 
 using ObjectId = std::array<uint8_t, 12>;
 
@@ -178,6 +463,86 @@ struct SizedBuffer {
 
 using ObjectIdMap = std::unordered_map<ObjectId, SizedBuffer, ObjectIdHasher, ObjectIdEquals>;
 using ObjectIdSet = std::unordered_set<ObjectId, ObjectIdHasher, ObjectIdEquals>;
+// TODO(perf) can this use string_view?
+using PathMap = std::unordered_map<std::string, ObjectIdMap>;
+
+/**
+ * Immutable copy of a PopulateInfo's items. Nothing writes to it after
+ * create() returns, so any number of Transcoders on any threads can read it
+ * without locking. Owners hold shared_ptrs; the registry holds weak_ptrs so
+ * that another thread can look a snapshot up by its handle while it's alive.
+ */
+class FrozenPaths {
+public:
+	PathMap paths;
+	uint32_t handle = 0;
+
+	FrozenPaths() = default;
+	FrozenPaths(const FrozenPaths&) = delete;
+	FrozenPaths& operator=(const FrozenPaths&) = delete;
+
+	~FrozenPaths() {
+		if (handle) {
+			std::lock_guard<std::mutex> lock(registryMutex);
+			registry.erase(handle);
+		}
+		for (uint8_t* data : buffers)
+			std::free(data);
+	}
+
+	/**
+	 * Copies `src`, including the JSON buffers, and registers the copy.
+	 * Returns nullptr on allocation failure.
+	 */
+	static std::shared_ptr<const FrozenPaths> create(const PathMap& src) {
+		auto frozen = std::make_shared<FrozenPaths>();
+		// RepeatPath shares buffers between paths; keep sharing them.
+		std::unordered_map<const uint8_t*, uint8_t*> copies;
+		for (auto const& [path, map] : src) {
+			ObjectIdMap& dst = frozen->paths[path];
+			dst.reserve(map.size());
+			for (auto const& [oid, sb] : map) {
+				uint8_t*& copy = copies[sb.data];
+				if (copy == nullptr) {
+					copy = static_cast<uint8_t*>(std::malloc(sb.size));
+					if (copy == nullptr)
+						return nullptr;
+					std::memcpy(copy, sb.data, sb.size);
+					frozen->buffers.push_back(copy);
+				}
+				dst[oid] = SizedBuffer{sb.size, copy};
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(registryMutex);
+		frozen->handle = nextHandle++;
+		registry[frozen->handle] = frozen;
+		return frozen;
+	}
+
+	/** Returns the snapshot for `handle`, or nullptr if it's been freed. */
+	static std::shared_ptr<const FrozenPaths> find(uint32_t handle) {
+		std::lock_guard<std::mutex> lock(registryMutex);
+		auto it = registry.find(handle);
+		return it == registry.end() ? nullptr : it->second.lock();
+	}
+
+private:
+	std::vector<uint8_t*> buffers;
+
+	// Shared by every instance of the addon in the process.
+	inline static std::mutex registryMutex;
+	inline static std::unordered_map<uint32_t, std::weak_ptr<const FrozenPaths>> registry;
+	inline static uint32_t nextHandle = 1;
+};
+
+static const napi_type_tag FROZEN_POPULATE_INFO_TAG = {
+	0x6b5a3e1fd1c04a27ULL, 0x9d3b7c8e2f614e05ULL
+};
+
+static const napi_type_tag POPULATE_INFO_TAG = {
+	0x2e7f4c91a85b4d3eULL, 0xb4061d9e7c3a4f18ULL
+};
 
 template <ISA isa>
 class PopulateInfo : public Napi::ObjectWrap<PopulateInfo<isa> > {
@@ -189,38 +554,24 @@ public:
 			Napi::ObjectWrap<PopulateInfo<isa>>::template InstanceMethod<&PopulateInfo<isa>::GetMissingIdsForPath>("getMissingIdsForPath")
 		});
 
-		Napi::FunctionReference* constructor = new Napi::FunctionReference();
-
-		// Create a persistent reference to the class constructor. This will
-		// allow a function called on a class prototype and a function called on
-		// an instance of a class to be distinguished from each other.
-		*constructor = Napi::Persistent(func);
 		exports.Set("PopulateInfo", func);
 
-		// Store the constructor as the add-on instance data. This will allow
-		// this add-on to support multiple instances of itself running on
-		// multiple worker threads, as well as multiple instances of itself
-		// running in different contexts on the same thread.
-		//
-		// By default, the value set on the environment here will be destroyed
-		// when the add-on is unloaded using the `delete` operator, but it is
-		// also possible to supply a custom deleter.
-		env.SetInstanceData<Napi::FunctionReference>(constructor);
-
 		return exports;
 	}
 
-	PopulateInfo(const Napi::CallbackInfo& info) : Napi::ObjectWrap<PopulateInfo>(info) {}
+	PopulateInfo(const Napi::CallbackInfo& info) : Napi::ObjectWrap<PopulateInfo>(info) {
+		info.This().As<Napi::Object>().TypeTag(&POPULATE_INFO_TAG);
+	}
 
 	~PopulateInfo() {
+		// RepeatPath shares buffers between paths, so free each one once.
+		std::unordered_set<uint8_t*> buffers;
 		for (auto& [path, map] : paths) {
-			for (auto& [oid, sb] : map) {
-				if (sb.data != nullptr) {
-					std::free(sb.data);
-					sb.data = nullptr;
-				}
-			}
+			for (auto& [oid, sb] : map)
+				buffers.insert(sb.data);
 		}
+		for (uint8_t* data : buffers)
+			std::free(data);
 	}
 
 	/**
@@ -253,6 +604,7 @@ public:
 		}
 
 		paths[path2] = it->second;
+		version++;
 	}
 
 	Napi::Value GetMissingIdsForPath(const Napi::CallbackInfo& info) {
@@ -273,54 +625,712 @@ public:
 		return arr;
 	}
 
-	// TODO(perf) can this use string_view?
-	std::unordered_map<std::string, ObjectIdMap> paths;
+	PathMap paths;
 	std::unordered_map<std::string, ObjectIdSet> missingIds;
+	// Incremented when paths changes, so Transcoders can drop cached output.
+	uint64_t version = 0;
+};
+
+/**
+ * Read-only snapshot of a PopulateInfo that can be shared across threads.
+ *
+ * new FrozenPopulateInfo(populateInfo) copies the PopulateInfo.
+ * new FrozenPopulateInfo(handle) attaches to the snapshot that another
+ * FrozenPopulateInfo's `handle` refers to, e.g. in a worker thread. The
+ * snapshot is freed when the last FrozenPopulateInfo and Transcoder using it
+ * are garbage collected.
+ */
+template <ISA isa>
+class FrozenPopulateInfo : public Napi::ObjectWrap<FrozenPopulateInfo<isa> > {
+public:
+	std::shared_ptr<const FrozenPaths> snapshot;
+
+	static Napi::Object Init(Napi::Env env, Napi::Object exports) {
+		Napi::Function func = Napi::ObjectWrap<FrozenPopulateInfo<isa>>::DefineClass(env, "FrozenPopulateInfo", {
+			Napi::ObjectWrap<FrozenPopulateInfo<isa>>::template InstanceAccessor<&FrozenPopulateInfo<isa>::GetHandle>("handle")
+		});
+		exports.Set("FrozenPopulateInfo", func);
+		return exports;
+	}
+
+	/**
+	 * 0. PopulateInfo|FrozenPopulateInfo|Number  Source or handle
+	 */
+	FrozenPopulateInfo(const Napi::CallbackInfo& info) : Napi::ObjectWrap<FrozenPopulateInfo>(info) {
+		Napi::Env env = info.Env();
+
+		if (info[0].IsNumber()) {
+			snapshot = FrozenPaths::find(info[0].As<Napi::Number>().Uint32Value());
+			if (!snapshot) {
+				Napi::Error::New(env, "FrozenPopulateInfo handle not found").ThrowAsJavaScriptException();
+				return;
+			}
+		} else if (info[0].IsObject()) {
+			Napi::Object obj = info[0].As<Napi::Object>();
+			if (obj.CheckTypeTag(&FROZEN_POPULATE_INFO_TAG)) {
+				snapshot = Napi::ObjectWrap<FrozenPopulateInfo<isa> >::Unwrap(obj)->snapshot;
+			} else if (obj.CheckTypeTag(&POPULATE_INFO_TAG)) {
+				PopulateInfo<isa>* p = Napi::ObjectWrap<PopulateInfo<isa> >::Unwrap(obj);
+				snapshot = FrozenPaths::create(p->paths);
+				if (!snapshot) {
+					Napi::Error::New(env, "Allocation failure").ThrowAsJavaScriptException();
+					return;
+				}
+			} else {
+				Napi::TypeError::New(env, "Expected a PopulateInfo or FrozenPopulateInfo").ThrowAsJavaScriptException();
+				return;
+			}
+		} else {
+			Napi::TypeError::New(env, "Expected a PopulateInfo or a handle").ThrowAsJavaScriptException();
+			return;
+		}
+
+		info.This().As<Napi::Object>().TypeTag(&FROZEN_POPULATE_INFO_TAG);
+	}
+
+	Napi::Value GetHandle(const Napi::CallbackInfo& info) {
+		return Napi::Number::New(info.Env(), snapshot->handle);
+	}
+};
+
+// Sets size to the size of the value of type `type` at p, which has to fit in
+// avail bytes. Returns an error message or nullptr.
+static const char* valueSize(uint8_t type, const uint8_t* p, size_t avail, size_t& size) {
+	switch (type) {
+	case BSON_DATA_STRING:
+	case BSON_DATA_OBJECT:
+	case BSON_DATA_ARRAY: {
+		if (UNLIKELY(avail < 4))
+			return "Truncated BSON";
+		int32_t len;
+		memcpy(&len, p, 4);
+		if (type == BSON_DATA_STRING) {
+			if (UNLIKELY(len <= 0 || static_cast<size_t>(len) > avail - 4))
+				return "Bad string length";
+			size = 4 + len;
+		} else {
+			if (UNLIKELY(len < 5))
+				return "BSON size must be >= 5";
+			if (UNLIKELY(static_cast<size_t>(len) > avail))
+				return "BSON size exceeds input length";
+			size = len;
+		}
+		return nullptr;
+	}
+	case BSON_DATA_OID: size = 12; break;
+	case BSON_DATA_INT: size = 4; break;
+	case BSON_DATA_NUMBER:
+	case BSON_DATA_DATE:
+	case BSON_DATA_LONG: size = 8; break;
+	case BSON_DATA_BOOLEAN: size = 1; break;
+	case BSON_DATA_NULL:
+	case BSON_DATA_UNDEFINED: size = 0; break;
+	case BSON_DATA_DECIMAL128:
+	case BSON_DATA_BINARY:
+	case BSON_DATA_REGEXP:
+	case BSON_DATA_SYMBOL:
+	case BSON_DATA_TIMESTAMP:
+	case BSON_DATA_MIN_KEY:
+	case BSON_DATA_MAX_KEY:
+	case BSON_DATA_CODE:
+	case BSON_DATA_CODE_W_SCOPE:
+	case BSON_DATA_DBPOINTER:
+		return "BSON type incompatible with JSON";
+	default:
+		return "Unknown BSON type";
+	}
+	if (UNLIKELY(size > avail))
+		return "Truncated BSON";
+	return nullptr;
+}
+
+// Like valueSize, but also sizes the types that aren't written as JSON, for
+// skipping over elements that won't be output.
+static const char* anyValueSize(uint8_t type, const uint8_t* p, size_t avail, size_t& size) {
+	auto lengthPrefixed = [&](size_t extra) -> const char* {
+		if (UNLIKELY(avail < 4))
+			return "Truncated BSON";
+		int32_t len;
+		memcpy(&len, p, 4);
+		if (UNLIKELY(len < 0))
+			return "Bad length";
+		size = 4 + extra + static_cast<size_t>(len);
+		return nullptr;
+	};
+	const char* err = nullptr;
+	switch (type) {
+	case BSON_DATA_DECIMAL128: size = 16; break;
+	case BSON_DATA_TIMESTAMP: size = 8; break;
+	case BSON_DATA_MIN_KEY:
+	case BSON_DATA_MAX_KEY: size = 0; break;
+	case BSON_DATA_BINARY: err = lengthPrefixed(1); break; // subtype
+	case BSON_DATA_SYMBOL:
+	case BSON_DATA_CODE: err = lengthPrefixed(0); break;
+	case BSON_DATA_DBPOINTER: err = lengthPrefixed(12); break;
+	case BSON_DATA_CODE_W_SCOPE: // The length includes itself.
+		err = lengthPrefixed(0);
+		size -= 4;
+		break;
+	case BSON_DATA_REGEXP: { // Pattern and flags cstrings.
+		const void* patternEnd = memchr(p, 0, avail);
+		const void* flagsEnd = patternEnd ? memchr(static_cast<const uint8_t*>(patternEnd) + 1, 0,
+			avail - (static_cast<const uint8_t*>(patternEnd) + 1 - p)) : nullptr;
+		if (UNLIKELY(flagsEnd == nullptr))
+			return "Truncated BSON";
+		size = static_cast<const uint8_t*>(flagsEnd) + 1 - p;
+		break;
+	}
+	default:
+		return valueSize(type, p, avail, size);
+	}
+	if (UNLIKELY(err != nullptr))
+		return err;
+	if (UNLIKELY(size > avail))
+		return "Truncated BSON";
+	return nullptr;
+}
+
+static const napi_type_tag BSON_INDEX_TAG = {
+	0x3c0e95b7a2d84f61ULL, 0x8f1a6d2c4b7e4093ULL
+};
+
+// One element of an indexed document, in document order. Entry 0 is the
+// document itself.
+struct TapeEntry {
+	uint32_t keyOffset; // first byte of the key; the type byte precedes it
+	uint32_t valueOffset; // the key's null terminator precedes it
+	uint32_t size; // of the value, including any length prefix and terminator
+	uint32_t next; // index of the entry after this one's descendants
+	uint8_t type;
+};
+
+/**
+ * Structural index of a BSON document, built once and reused by
+ * Transcoder#getMissingIds, which walks it, and #transcodePath, which finds
+ * elements with it.
+ *
+ * new BsonIndex(bson) validates the document's structure and records the
+ * position of every element. Holds a reference to bson, which shouldn't be
+ * modified afterwards.
+ */
+class BsonIndex : public Napi::ObjectWrap<BsonIndex> {
+public:
+	std::vector<TapeEntry> tape;
+	Napi::Reference<Napi::Uint8Array> bufferRef;
+	size_t length = 0;
+
+	static Napi::Object Init(Napi::Env env, Napi::Object exports) {
+		Napi::Function func = DefineClass(env, "BsonIndex", {
+			InstanceAccessor<&BsonIndex::GetLength>("length")
+		});
+		exports.Set("BsonIndex", func);
+		return exports;
+	}
+
+	/**
+	 * 0. Uint8Array  BSON document
+	 */
+	BsonIndex(const Napi::CallbackInfo& info) : Napi::ObjectWrap<BsonIndex>(info) {
+		Napi::Env env = info.Env();
+
+		if (!info[0].IsTypedArray() || info[0].As<Napi::TypedArray>().TypedArrayType() != napi_uint8_array) {
+			Napi::Error::New(env, "Input must be a buffer").ThrowAsJavaScriptException();
+			return;
+		}
+
+		Napi::Uint8Array arr = info[0].As<Napi::Uint8Array>();
+		length = arr.ByteLength();
+		if (UNLIKELY(length < 5)) {
+			Napi::Error::New(env, "Input buffer must have length >= 5").ThrowAsJavaScriptException();
+			return;
+		}
+		if (UNLIKELY(length > INT32_MAX)) {
+			Napi::Error::New(env, "BSON size exceeds input length").ThrowAsJavaScriptException();
+			return;
+		}
+
+		if (const char* err = build(arr.Data())) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return;
+		}
+
+		bufferRef = Napi::Reference<Napi::Uint8Array>::New(arr, 1);
+		info.This().As<Napi::Object>().TypeTag(&BSON_INDEX_TAG);
+	}
+
+	// The number of elements, including the document itself.
+	Napi::Value GetLength(const Napi::CallbackInfo& info) {
+		return Napi::Number::New(info.Env(), static_cast<double>(tape.size()));
+	}
+
+	// Finds the element at a dotted path like "a.0.b", where array elements
+	// are addressed by index. Returns tape.size() if there isn't one. Sets
+	// keyPath to the path without array indices, as populate paths are
+	// written.
+	size_t find(const uint8_t* in, const std::string& path, std::string& keyPath) const {
+		keyPath.clear();
+		size_t entry = 0;
+		size_t pos = 0;
+		while (pos < path.size()) {
+			size_t dot = path.find('.', pos);
+			if (dot == std::string::npos)
+				dot = path.size();
+			const char* seg = path.data() + pos;
+			const size_t segLen = dot - pos;
+			pos = dot + 1;
+
+			const TapeEntry& parent = tape[entry];
+			if (parent.type != BSON_DATA_OBJECT && parent.type != BSON_DATA_ARRAY)
+				return tape.size();
+
+			size_t child = entry + 1;
+			if (parent.type == BSON_DATA_ARRAY) {
+				// Array keys are always "0", "1", ..., so skip rather than compare.
+				if (segLen == 0 || segLen > 9 || (seg[0] == '0' && segLen > 1))
+					return tape.size();
+				uint32_t idx = 0;
+				for (size_t i = 0; i < segLen; i++) {
+					if (seg[i] < '0' || seg[i] > '9')
+						return tape.size();
+					idx = idx * 10 + (seg[i] - '0');
+				}
+				for (; idx && child < parent.next; idx--)
+					child = tape[child].next;
+			} else {
+				for (; child < parent.next; child = tape[child].next) {
+					const TapeEntry& e = tape[child];
+					if (e.valueOffset - e.keyOffset - 1 == segLen &&
+						memcmp(in + e.keyOffset, seg, segLen) == 0)
+						break;
+				}
+				if (!keyPath.empty())
+					keyPath += '.';
+				keyPath.append(seg, segLen);
+			}
+			if (child >= parent.next)
+				return tape.size();
+			entry = child;
+		}
+		return entry;
+	}
+
+private:
+	// Fills tape, checking sizes the same way Transcoder does. Returns an
+	// error message or nullptr.
+	const char* build(const uint8_t* in) {
+		struct Open {
+			size_t entry;
+			size_t end; // offset after the terminator
+		};
+		std::vector<Open> open;
+		size_t i = 0;
+
+		// Opens the document at i, which has to end before limit.
+		auto openDocument = [&](uint8_t type, size_t keyOffset, size_t limit) -> const char* {
+			if (UNLIKELY(i + 4 > limit))
+				return "Truncated BSON";
+			int32_t size;
+			memcpy(&size, in + i, 4);
+			if (UNLIKELY(size < 5))
+				return "BSON size must be >= 5";
+			if (UNLIKELY(static_cast<size_t>(size) > limit - i))
+				return "BSON size exceeds input length";
+			if (UNLIKELY(in[i + size - 1] != 0))
+				return "BSON document must end with a null byte";
+			open.push_back({tape.size(), i + size});
+			tape.push_back({static_cast<uint32_t>(keyOffset), static_cast<uint32_t>(i),
+				static_cast<uint32_t>(size), 0, type});
+			i += 4;
+			return nullptr;
+		};
+
+		if (const char* err = openDocument(BSON_DATA_OBJECT, 0, length))
+			return err;
+
+		while (!open.empty()) {
+			const size_t end = open.back().end;
+			const uint8_t type = in[i++];
+			if (type == 0) {
+				if (UNLIKELY(i != end))
+					return "BSON size doesn't match document";
+				tape[open.back().entry].next = static_cast<uint32_t>(tape.size());
+				open.pop_back();
+				continue;
+			}
+
+			// The document's terminator bounds the key.
+			const size_t keyOffset = i;
+			i = static_cast<const uint8_t*>(memchr(in + i, 0, end - i)) - in + 1;
+			if (UNLIKELY(i == end))
+				return "Truncated BSON (in key)";
+			// Bytes left before the document's terminator.
+			const size_t avail = end - 1 - i;
+
+			if (type == BSON_DATA_OBJECT || type == BSON_DATA_ARRAY) {
+				if (const char* err = openDocument(type, keyOffset, end - 1))
+					return err;
+				continue;
+			}
+
+			size_t size;
+			if (const char* err = valueSize(type, in + i, avail, size))
+				return err;
+			tape.push_back({static_cast<uint32_t>(keyOffset), static_cast<uint32_t>(i),
+				static_cast<uint32_t>(size), static_cast<uint32_t>(tape.size() + 1), type});
+			i += size;
+		}
+		return nullptr;
+	}
+};
+
+// 64-bit hash of n bytes, for the response cache. Mixes four 8-byte lanes
+// independently like xxHash64 so the loop isn't bound by multiply latency.
+// Not collision-resistant; cache hits are verified by comparing the input.
+static uint64_t hashBytes(const uint8_t* p, size_t n) {
+	constexpr uint64_t P1 = 0x9e3779b185ebca87ULL;
+	constexpr uint64_t P2 = 0xc2b2ae3d27d4eb4fULL;
+	constexpr uint64_t P3 = 0x165667b19e3779f9ULL;
+	auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+	auto mix = [&](uint64_t acc, uint64_t lane) { return rotl(acc + lane * P2, 31) * P1; };
+	auto read64 = [](const uint8_t* q) { uint64_t v; memcpy(&v, q, 8); return v; };
+
+	uint64_t h = P3 + n;
+	size_t i = 0;
+	if (n >= 32) {
+		uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+		for (; i + 32 <= n; i += 32) {
+			v1 = mix(v1, read64(p + i));
+			v2 = mix(v2, read64(p + i + 8));
+			v3 = mix(v3, read64(p + i + 16));
+			v4 = mix(v4, read64(p + i + 24));
+		}
+		h += rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = (h ^ mix(0, v1)) * P1;
+		h = (h ^ mix(0, v2)) * P1;
+		h = (h ^ mix(0, v3)) * P1;
+		h = (h ^ mix(0, v4)) * P1;
+	}
+	for (; i + 8 <= n; i += 8)
+		h = rotl(h ^ mix(0, read64(p + i)), 27) * P1 + P3;
+	for (; i < n; i++)
+		h = rotl(h ^ (p[i] * P3), 11) * P1;
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	return h ^ (h >> 32);
+}
+
+// Streaming XXH64 (seed 0), for the hash option. Unlike hashBytes() it's a
+// published algorithm, so clients can check the hash of a response.
+class Xxh64 {
+public:
+	void reset() {
+		v[0] = P1 + P2;
+		v[1] = P2;
+		v[2] = 0;
+		v[3] = 0 - P1;
+		total = 0;
+		bufLen = 0;
+	}
+
+	void update(const uint8_t* p, size_t n) {
+		total += n;
+		if (bufLen) {
+			const size_t take = std::min(n, sizeof(buf) - bufLen);
+			memcpy(buf + bufLen, p, take);
+			bufLen += take;
+			p += take;
+			n -= take;
+			if (bufLen < sizeof(buf))
+				return;
+			stripe(buf);
+			bufLen = 0;
+		}
+		for (; n >= 32; p += 32, n -= 32)
+			stripe(p);
+		memcpy(buf, p, n);
+		bufLen = n;
+	}
+
+	uint64_t digest() const {
+		uint64_t h;
+		if (total >= 32) {
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+			for (uint64_t lane : v)
+				h = (h ^ round(0, lane)) * P1 + P4;
+		} else {
+			h = P5;
+		}
+		h += total;
+
+		size_t i = 0;
+		for (; i + 8 <= bufLen; i += 8)
+			h = rotl(h ^ round(0, read64(buf + i)), 27) * P1 + P4;
+		if (i + 4 <= bufLen) {
+			uint32_t w;
+			memcpy(&w, buf + i, 4);
+			h = rotl(h ^ (w * P1), 23) * P2 + P3;
+			i += 4;
+		}
+		for (; i < bufLen; i++)
+			h = rotl(h ^ (buf[i] * P5), 11) * P1;
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		return h ^ (h >> 32);
+	}
+
+private:
+	static constexpr uint64_t P1 = 0x9e3779b185ebca87ULL;
+	static constexpr uint64_t P2 = 0xc2b2ae3d27d4eb4fULL;
+	static constexpr uint64_t P3 = 0x165667b19e3779f9ULL;
+	static constexpr uint64_t P4 = 0x85ebca77c2b2ae63ULL;
+	static constexpr uint64_t P5 = 0x27d4eb2f165667c5ULL;
+
+	static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static uint64_t round(uint64_t acc, uint64_t lane) { return rotl(acc + lane * P2, 31) * P1; }
+	static uint64_t read64(const uint8_t* q) { uint64_t w; memcpy(&w, q, 8); return w; }
+
+	void stripe(const uint8_t* p) {
+		for (int j = 0; j < 4; j++)
+			v[j] = round(v[j], read64(p + j * 8));
+	}
+
+	uint64_t v[4];
+	uint64_t total = 0;
+	uint8_t buf[32];
+	size_t bufLen = 0;
+};
+
+// What to do with invalid UTF-8 in strings and keys.
+enum class InvalidUtf8 {
+	COPY, // copy it to the output as-is (fastest)
+	THROW,
+	REPLACE // with U+FFFD
+};
+
+// Escaping beyond what JSON requires, for strings and keys. Can be combined.
+enum EscapeFlags : uint8_t {
+	ESCAPE_NON_ASCII = 1 << 0, // \uXXXX for everything from U+0080 up
+	ESCAPE_HTML = 1 << 1 // \u003c, \u003e, \u0026, \u2028, \u2029
 };
 
 template<ISA isa>
 class Transcoder : public Napi::ObjectWrap<Transcoder<isa> > {
 public:
+	InvalidUtf8 invalidUtf8 = InvalidUtf8::COPY;
+	uint8_t escapeFlags = 0;
 	uint8_t* out = nullptr;
 	size_t outIdx = 0;
 	size_t outLen = 0;
 	const char* err = nullptr;
 	std::string currentPath;
+	uint32_t maxDepth = 200;
+	// Capacity of the response cache, in bytes of input and output. 0
+	// disables it.
+	size_t cacheBytes = 0;
+	// Short string values and their escaped output, for the stringCache
+	// option. Direct-mapped by hashBytes(); the size is a power of two. Empty
+	// if disabled.
+	static constexpr size_t STRING_CACHE_MAX = 32; // input bytes
+	static constexpr size_t STRING_CACHE_MAX_ESCAPED = 64;
+	struct StringSlot {
+		uint8_t len = 0; // 0 if empty
+		uint8_t escLen = 0;
+		uint8_t raw[STRING_CACHE_MAX];
+		uint8_t esc[STRING_CACHE_MAX_ESCAPED];
+	};
+	std::vector<StringSlot> stringCache;
+	uint64_t stringHits = 0;
+	uint64_t stringMisses = 0;
+	// Set by the canonical option: object keys are written in byte order.
+	bool canonical = false;
+	// Set by the hash option: lastHash is the XXH64 of the last output.
+	// hashed is cleared at the start of every call that outputs, so that
+	// outputHash() never returns an earlier call's hash after one that threw
+	// or (like toObject) didn't write JSON.
+	bool hashing = false;
+	bool hashed = false;
+	uint64_t lastHash = 0;
+	Xxh64 outHash;
 	ObjectId docId;
+	// Set when docId is written, for PopulateInfo::AddItems to check.
+	bool hasDocId = false;
+	// Null when populating from a FrozenPopulateInfo.
 	PopulateInfo<isa>* populateInfo = nullptr;
-	inline static Napi::FunctionReference* ctor;
+	const PathMap* populatePaths = nullptr;
 	Napi::Reference<Napi::Object> populateInfoRef;
+	std::shared_ptr<const FrozenPaths> frozen;
+
+	// A field of the change event output envelope.
+	struct EnvelopeField {
+		std::string key; // JSON-encoded, with the colon
+		std::vector<std::string> path; // in the event
+	};
+	// Empty until a change event is transcoded, unless set by options.
+	std::vector<EnvelopeField> envelope;
+
+	// Elements of the arrays at a path to write, for the arraySlices option.
+	struct ArraySlice {
+		int32_t skip = 0;
+		int32_t limit = INT32_MAX;
+		// JSON-encoded with the colon, or empty for no count sibling.
+		std::string countKey;
+		// The same key unencoded, for toObject.
+		std::string countName;
+	};
+	std::unordered_map<std::string, ArraySlice> arraySlices;
+	// Incremented by setArraySlices(), so that retranscode() doesn't copy
+	// fields sliced differently.
+	uint32_t sliceGeneration = 0;
 
 	static Napi::Object Init(Napi::Env env, Napi::Object exports) {
 		Napi::Function func = Napi::ObjectWrap<Transcoder<isa> >::DefineClass(env, "Transcoder", {
 			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::transcodeNodeFn>("transcode"),
-			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::getMissingIdsNodeFn>("getMissingIds")
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::transcodeIntoNodeFn>("transcodeInto"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::transcodeToStringNodeFn>("transcodeToString"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::toObjectNodeFn>("toObject"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::transcodeCompressedNodeFn>("transcodeCompressed"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::transcodePathNodeFn>("transcodePath"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::transcodeFieldsNodeFn>("transcodeFields"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::retranscodeNodeFn>("retranscode"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::transcodeChangeEventsNodeFn>("transcodeChangeEvents"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::getMissingIdsNodeFn>("getMissingIds"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::cacheStatsNodeFn>("cacheStats"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::stringCacheStatsNodeFn>("stringCacheStats"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::compressStatsNodeFn>("compressStats"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::outputHashNodeFn>("outputHash"),
+			Napi::ObjectWrap<Transcoder<isa> >::template InstanceMethod<&Transcoder<isa>::setArraySlicesNodeFn>("setArraySlices")
 		});
 
-		ctor = new Napi::FunctionReference();
+		Napi::FunctionReference* ctor = new Napi::FunctionReference();
 		*ctor = Napi::Persistent(func);
 
 		exports.Set("Transcoder", func);
 
+		// Store the constructor as the add-on instance data (used by
+		// PopulateInfo#addItems). This will allow this add-on to support
+		// multiple instances of itself running on multiple worker threads, as
+		// well as multiple instances of itself running in different contexts on
+		// the same thread.
+		//
+		// By default, the value set on the environment here will be destroyed
+		// when the add-on is unloaded using the `delete` operator, but it is
+		// also possible to supply a custom deleter.
+		env.SetInstanceData<Napi::FunctionReference>(ctor);
+
 		return exports;
 	}
 
+	/**
+	 * 0. PopulateInfo|FrozenPopulateInfo|undefined
+	 * 1. Object|undefined  Options
+	 */
 	Transcoder(const Napi::CallbackInfo& info) : Napi::ObjectWrap<Transcoder>(info) {
-		if (info.Length() == 1) {
+		if (info[1].IsObject()) {
+			Napi::Env env = info.Env();
+			Napi::Value mode = info[1].As<Napi::Object>().Get("invalidUtf8");
+			std::string modeStr = mode.IsString() ? mode.As<Napi::String>().Utf8Value() : "";
+			if (modeStr == "error") {
+				invalidUtf8 = InvalidUtf8::THROW;
+			} else if (modeStr == "replace") {
+				invalidUtf8 = InvalidUtf8::REPLACE;
+			} else if (modeStr != "copy" && !mode.IsUndefined()) {
+				Napi::TypeError::New(env, "invalidUtf8 must be \"copy\", \"error\" or \"replace\"").ThrowAsJavaScriptException();
+				return;
+			}
+
+			if (info[1].As<Napi::Object>().Get("asciiOnly").ToBoolean())
+				escapeFlags |= ESCAPE_NON_ASCII;
+			if (info[1].As<Napi::Object>().Get("htmlSafe").ToBoolean())
+				escapeFlags |= ESCAPE_HTML;
+			canonical = info[1].As<Napi::Object>().Get("canonical").ToBoolean();
+			hashing = info[1].As<Napi::Object>().Get("hash").ToBoolean();
+
+			Napi::Value depth = info[1].As<Napi::Object>().Get("maxDepth");
+			if (!depth.IsUndefined()) {
+				const double d = depth.IsNumber() ? depth.As<Napi::Number>().DoubleValue() : 0;
+				if (!(d >= 1 && d <= UINT32_MAX && d == std::floor(d))) {
+					Napi::TypeError::New(env, "maxDepth must be a positive integer").ThrowAsJavaScriptException();
+					return;
+				}
+				maxDepth = static_cast<uint32_t>(d);
+			}
+
+			Napi::Value cache = info[1].As<Napi::Object>().Get("cacheBytes");
+			if (!cache.IsUndefined()) {
+				const double c = cache.IsNumber() ? cache.As<Napi::Number>().DoubleValue() : -1;
+				if (!(c >= 0 && c <= 9007199254740991.0 && c == std::floor(c))) {
+					Napi::TypeError::New(env, "cacheBytes must be a non-negative integer").ThrowAsJavaScriptException();
+					return;
+				}
+				cacheBytes = static_cast<size_t>(c);
+			}
+
+			Napi::Value strCache = info[1].As<Napi::Object>().Get("stringCache");
+			if (!strCache.IsUndefined()) {
+				const double c = strCache.IsNumber() ? strCache.As<Napi::Number>().DoubleValue() : -1;
+				if (!(c >= 0 && c <= 65536 && c == std::floor(c))) {
+					Napi::TypeError::New(env, "stringCache must be an integer from 0 to 65536").ThrowAsJavaScriptException();
+					return;
+				}
+				size_t slots = c ? 1 : 0;
+				while (slots && slots < c)
+					slots <<= 1;
+				stringCache.resize(slots);
+			}
+
+			Napi::Value changeEnvelope = info[1].As<Napi::Object>().Get("changeEnvelope");
+			if (!changeEnvelope.IsUndefined() && setEnvelope(changeEnvelope))
+				return;
+
+			Napi::Value slices = info[1].As<Napi::Object>().Get("arraySlices");
+			if (!slices.IsUndefined() && setArraySlices(slices))
+				return;
+		}
+
+		if (info[0].IsObject()) {
 			Napi::Object obj = info[0].As<Napi::Object>();
-			// TODO instanceof check
+			if (obj.CheckTypeTag(&FROZEN_POPULATE_INFO_TAG)) {
+				frozen = Napi::ObjectWrap<FrozenPopulateInfo<isa> >::Unwrap(obj)->snapshot;
+				populatePaths = &frozen->paths;
+				return;
+			}
+			if (!obj.CheckTypeTag(&POPULATE_INFO_TAG)) {
+				Napi::TypeError::New(info.Env(), "Expected a PopulateInfo or FrozenPopulateInfo").ThrowAsJavaScriptException();
+				return;
+			}
 			populateInfo = Napi::ObjectWrap<PopulateInfo<isa> >::Unwrap(obj);
+			populatePaths = &populateInfo->paths;
 			populateInfoRef = Napi::Reference<Napi::Object>::New(obj, 1);
 		}
 	}
 
+	~Transcoder() {
+		std::free(scratch);
+	}
+
 	/**
 	 * Finds missing IDs for paths in the populateInfo object.
-	 * @param in_ BSON document.
+	 * @param in_ BSON document or BsonIndex.
 	 */
 	void getMissingIdsNodeFn(const Napi::CallbackInfo& info) {
 		Napi::Env env = info.Env();
 
+		if (BsonIndex* index = toIndex(info[0])) {
+			if (frozen) {
+				Napi::Error::New(env, "Can't record missing IDs in a FrozenPopulateInfo").ThrowAsJavaScriptException();
+				return;
+			}
+			if (setInput(*index) || getMissingIds(*index))
+				Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return;
+		}
+
 		if (!info[0].IsTypedArray()) {
 			Napi::Error::New(env, "Input must be a buffer").ThrowAsJavaScriptException();
 			return;
@@ -331,10 +1341,16 @@ public:
 			return;
 		}
 
+		if (frozen) {
+			Napi::Error::New(env, "Can't record missing IDs in a FrozenPopulateInfo").ThrowAsJavaScriptException();
+			return;
+		}
+
 		Napi::Uint8Array arr = info[0].As<Napi::Uint8Array>();
 
 		in = arr.Data();
 		inLen = arr.ByteLength();
+		inReadable = readableLength(arr);
 		inIdx = 0;
 
 		if (UNLIKELY(inLen < 5)) {
@@ -350,10 +1366,20 @@ public:
 
 	/**
 	 * Transcodes the BSON document to JSON.
-	 * @param in_ BSON document.
+	 * @param in_ BSON document or BsonIndex.
 	 */
 	Napi::Value transcodeNodeFn(const Napi::CallbackInfo& info) {
 		Napi::Env env = info.Env();
+		hashed = false;
+
+		if (BsonIndex* index = toIndex(info[0])) {
+			if (setInput(*index)) {
+				Napi::Error::New(env, err).ThrowAsJavaScriptException();
+				return env.Undefined();
+			}
+			currentPath.clear();
+			return finishOutput(env, transcodeEntry(index->tape[0]));
+		}
 
 		if (!info[0].IsTypedArray()) {
 			Napi::Error::New(env, "Input must be a buffer").ThrowAsJavaScriptException();
@@ -369,6 +1395,7 @@ public:
 
 		in = arr.Data();
 		inLen = arr.ByteLength();
+		inReadable = readableLength(arr);
 		inIdx = 0;
 
 		if (UNLIKELY(inLen < 5)) {
@@ -376,6 +1403,18 @@ public:
 			return env.Undefined();
 		}
 
+		uint64_t hash = 0;
+		if (cacheBytes) {
+			hash = hashBytes(in, inLen);
+			if (CacheEntry* entry = cacheFind(hash)) {
+				cacheHits++;
+				Napi::Buffer<uint8_t> output = entry->output.Value();
+				hashOutput(output.Data(), output.Length());
+				return output;
+			}
+			cacheMisses++;
+		}
+
 		size_t chunkSize = 0;
 		if (chunkSize == 0) {
 			// Estimate outLen at 2.5x inLen. Expansion rates for values:
@@ -392,34 +1431,478 @@ public:
 			chunkSize = (inLen * 10) >> 2;
 		}
 
-		out = nullptr;
-		outLen = 0;
-		outIdx = 0;
-		resize(chunkSize);
-
-		bool status = transcodeObject(false);
-		if (status) {
-			std::free(out);
+		if (startOutput(chunkSize)) {
 			Napi::Error::New(env, err).ThrowAsJavaScriptException();
 			return env.Undefined();
 		}
 
-		Napi::Buffer<uint8_t> buf = Napi::Buffer<uint8_t>::New(env, out, outIdx, [](Napi::Env, uint8_t* data) {
-			std::free(data);
-		});
-
-		out = nullptr;
-		outLen = 0;
-		outIdx = 0;
-
+		const bool status = transcodeObject(false);
+		const size_t outSize = outIdx;
+		Napi::Value buf = finishOutput(env, status);
+		if (cacheBytes && !status)
+			cacheInsert(hash, outSize, buf.As<Napi::Buffer<uint8_t> >());
 		return buf;
 	}
 
-	bool transcode(
-		const uint8_t* in_,
-		size_t inLen_,
-		bool isArray = false,
-		size_t chunkSize = 0
+	/**
+	 * Transcodes the BSON document to a JSON string.
+	 * 0. Uint8Array|BsonIndex  BSON document
+	 */
+	Napi::Value transcodeToStringNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		hashed = false;
+
+		BsonIndex* index = toIndex(info[0]);
+		if (index ? setInput(*index) : setInput(info[0])) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		if (index) {
+			currentPath.clear();
+			return finishString(env, transcodeEntry(index->tape[0]));
+		}
+		if (startOutput((inLen * 10) >> 2)) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		return finishString(env, transcodeObject(false));
+	}
+
+	/**
+	 * Transcodes the BSON document into caller-provided memory. Returns the
+	 * number of bytes written, or {needed} (the exact number of bytes that
+	 * are required) if the JSON doesn't fit, in which case the contents of
+	 * the target are unspecified.
+	 * 0. Uint8Array|BsonIndex   BSON document
+	 * 1. Uint8Array|ArrayBuffer Target
+	 * 2. number|undefined       Offset into the target
+	 */
+	Napi::Value transcodeIntoNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		hashed = false;
+
+		uint8_t* target;
+		size_t targetLen;
+		if (info[1].IsTypedArray() && info[1].As<Napi::TypedArray>().TypedArrayType() == napi_uint8_array) {
+			Napi::Uint8Array arr = info[1].As<Napi::Uint8Array>();
+			target = arr.Data();
+			targetLen = arr.ByteLength();
+		} else if (info[1].IsArrayBuffer()) {
+			Napi::ArrayBuffer ab = info[1].As<Napi::ArrayBuffer>();
+			target = static_cast<uint8_t*>(ab.Data());
+			targetLen = ab.ByteLength();
+		} else {
+			Napi::TypeError::New(env, "Target must be a Uint8Array or ArrayBuffer").ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		size_t offset = 0;
+		if (!info[2].IsUndefined()) {
+			const double o = info[2].IsNumber() ? info[2].As<Napi::Number>().DoubleValue() : -1;
+			if (!(o >= 0 && o <= targetLen && o == std::floor(o))) {
+				Napi::RangeError::New(env, "offset is out of range").ThrowAsJavaScriptException();
+				return env.Undefined();
+			}
+			offset = static_cast<size_t>(o);
+		}
+
+		BsonIndex* index = toIndex(info[0]);
+		if (index ? setInput(*index) : setInput(info[0])) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		// Vector stores can write up to PADDING bytes past outLen, so that
+		// much of the target is left for resize() to take over.
+		const size_t avail = targetLen - offset;
+		callerOut = target + offset;
+		out = callerOut;
+		outLen = avail > PADDING ? avail - PADDING : 0;
+		outIdx = 0;
+
+		const bool status = transcodeObject(false);
+		if (!status)
+			hashOutput(out, outIdx);
+		const bool inPlace = out == callerOut;
+		callerOut = nullptr;
+		const size_t written = outIdx;
+		if (!status && !inPlace && written <= avail)
+			memcpy(target + offset, out, written);
+		if (!inPlace)
+			std::free(out);
+		out = nullptr;
+		outLen = 0;
+		outIdx = 0;
+
+		if (status) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		if (written <= avail)
+			return Napi::Number::New(env, static_cast<double>(written));
+		Napi::Object needed = Napi::Object::New(env);
+		needed.Set("needed", static_cast<double>(written));
+		return needed;
+	}
+
+	/**
+	 * Deserializes the BSON document to JS values: the same ones that
+	 * JSON.parse(transcode(b)) returns, without the JSON in between.
+	 * 0. Uint8Array|BsonIndex  BSON document
+	 */
+	Napi::Value toObjectNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		hashed = false;
+
+		BsonIndex* index = toIndex(info[0]);
+		// out holds the JSON of ObjectIds, dates and populated documents.
+		if ((index ? setInput(*index) : setInput(info[0])) || startOutput(64)) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		napi_value result;
+		const bool status = buildObject(env, result);
+		keyCache.clear();
+		props.clear();
+		keepOutput();
+		if (status) {
+			if (!env.IsExceptionPending())
+				Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		return Napi::Value(env, result);
+	}
+
+	/**
+	 * Transcodes the BSON document to compressed JSON. The JSON is compressed
+	 * COMPRESS_CHUNK bytes at a time as it's written, rather than after.
+	 * 0. Uint8Array        BSON document
+	 * 1. Object|undefined  {format: "gzip"|"deflate"|"raw"|"br", level}
+	 */
+	Napi::Value transcodeCompressedNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		hashed = false;
+		if (setInput(info[0])) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		int windowBits = 15 + 16; // gzip
+		bool brotli = false;
+		Napi::Value lvl = env.Undefined();
+		if (info[1].IsObject()) {
+			Napi::Value format = info[1].As<Napi::Object>().Get("format");
+			std::string formatStr = format.IsString() ? format.As<Napi::String>().Utf8Value() : "";
+			if (formatStr == "deflate") {
+				windowBits = 15;
+			} else if (formatStr == "raw") {
+				windowBits = -15;
+			} else if (formatStr == "br") {
+				brotli = true;
+			} else if (formatStr != "gzip" && !format.IsUndefined()) {
+				Napi::TypeError::New(env, "format must be \"gzip\", \"deflate\", \"raw\" or \"br\"").ThrowAsJavaScriptException();
+				return env.Undefined();
+			}
+			lvl = info[1].As<Napi::Object>().Get("level");
+		}
+
+		int level;
+		const int minLevel = brotli ? BROTLI_MIN_QUALITY : -1;
+		const int maxLevel = brotli ? BROTLI_MAX_QUALITY : 9;
+		if (lvl.IsUndefined()) {
+			level = brotli ? BROTLI_RESPONSE_QUALITY : Z_DEFAULT_COMPRESSION;
+		} else if (lvl.IsString() && lvl.As<Napi::String>().Utf8Value() == "fast") {
+			level = 1;
+		} else {
+			const double l = lvl.IsNumber() ? lvl.As<Napi::Number>().DoubleValue() : -2;
+			if (!(l >= minLevel && l <= maxLevel && l == std::floor(l))) {
+				std::string msg = "level must be \"fast\" or an integer from " +
+					std::to_string(minLevel) + " to " + std::to_string(maxLevel);
+				Napi::TypeError::New(env, msg).ThrowAsJavaScriptException();
+				return env.Undefined();
+			}
+			level = static_cast<int>(l);
+		}
+
+		z_stream stream = {};
+		if (brotli) {
+#ifdef B2J_BROTLI
+			brApi = brotliEncoder();
+#endif
+			if (brApi == nullptr) {
+				Napi::Error::New(env, "Brotli isn't available").ThrowAsJavaScriptException();
+				return env.Undefined();
+			}
+			br = brApi->createInstance(nullptr, nullptr, nullptr);
+			if (br == nullptr ||
+				!brApi->setParameter(br, BROTLI_PARAM_QUALITY, level) ||
+				!brApi->setParameter(br, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT) ||
+				!brApi->setParameter(br, BROTLI_PARAM_SIZE_HINT, static_cast<uint32_t>(std::min<size_t>((inLen * 10) >> 2, 1 << 30)))) {
+				endCompression();
+				Napi::Error::New(env, "Compression failure").ThrowAsJavaScriptException();
+				return env.Undefined();
+			}
+		} else {
+			if (deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				Napi::Error::New(env, "Compression failure").ThrowAsJavaScriptException();
+				return env.Undefined();
+			}
+			zs = &stream;
+		}
+		zout = nullptr;
+		zoutLen = 0;
+		zoutIdx = 0;
+		flushAt = COMPRESS_CHUNK;
+		compressChunks = 0;
+		compressPeak = 0;
+		if (hashing)
+			outHash.reset();
+
+		out = nullptr;
+		outLen = 0;
+		outIdx = 0;
+		const bool status = resize(std::min((inLen * 10) >> 2, 2 * COMPRESS_CHUNK)) ||
+			transcodeObject(false) || compressOutput(true);
+
+		endCompression();
+		std::free(out);
+		out = nullptr;
+		outLen = 0;
+		outIdx = 0;
+
+		if (status) {
+			std::free(zout);
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		if (hashing) {
+			lastHash = outHash.digest();
+			hashed = true;
+		}
+		return Napi::Buffer<uint8_t>::New(env, zout, zoutIdx, [](Napi::Env, uint8_t* data) {
+			std::free(data);
+		});
+	}
+
+	/**
+	 * Transcodes the BSON document to JSON, and returns {json, fields} where
+	 * fields locates each top-level field in the input and output, for
+	 * retranscode().
+	 * @param in_ BSON document.
+	 */
+	Napi::Value transcodeFieldsNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		hashed = false;
+		if (setInput(info[0])) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		return finishFields(env, nullptr);
+	}
+
+	/**
+	 * Transcodes a new version of a document, copying the JSON of top-level
+	 * fields that are byte-for-byte unchanged from the previous version.
+	 * Returns {json, fields} like transcodeFields().
+	 * 0. Uint8Array   Previous BSON document
+	 * 1. Uint8Array   Its JSON
+	 * 2. Uint32Array  Its fields
+	 * 3. Uint8Array   New BSON document
+	 */
+	Napi::Value retranscodeNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		hashed = false;
+
+		if (!info[0].IsTypedArray() || !info[1].IsTypedArray() || !info[2].IsTypedArray() ||
+			info[0].As<Napi::TypedArray>().TypedArrayType() != napi_uint8_array ||
+			info[1].As<Napi::TypedArray>().TypedArrayType() != napi_uint8_array ||
+			info[2].As<Napi::TypedArray>().TypedArrayType() != napi_uint32_array) {
+			Napi::TypeError::New(env, "Expected the previous BSON, JSON and fields").ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		Napi::Uint8Array prevBson = info[0].As<Napi::Uint8Array>();
+		Napi::Uint8Array prevJson = info[1].As<Napi::Uint8Array>();
+		Napi::Uint32Array prevFields = info[2].As<Napi::Uint32Array>();
+		const PrevFields prev{prevBson.Data(), prevBson.ByteLength(), prevJson.Data(),
+			prevJson.ByteLength(), prevFields.Data(), prevFields.ElementLength()};
+		if (!prev.valid()) {
+			Napi::Error::New(env, "Invalid fields").ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		if (setInput(info[3])) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		// Populated output or array slices may have changed.
+		const bool reuse = prev.fields[0] == populateVersion() && prev.fields[1] == sliceGeneration;
+		return finishFields(env, reuse ? &prev : nullptr);
+	}
+
+	/**
+	 * Returns the response cache's hit and miss counts and size.
+	 */
+	Napi::Value cacheStatsNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		Napi::Object stats = Napi::Object::New(env);
+		stats.Set("hits", static_cast<double>(cacheHits));
+		stats.Set("misses", static_cast<double>(cacheMisses));
+		stats.Set("entries", static_cast<double>(cache.size()));
+		stats.Set("bytes", static_cast<double>(cacheUsed));
+		return stats;
+	}
+
+	/**
+	 * Returns the XXH64 of the last JSON output as 16 hex digits, or
+	 * undefined if the hash option isn't set or nothing was output yet.
+	 */
+	Napi::Value outputHashNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		if (!hashed)
+			return env.Undefined();
+		char hex[16];
+		for (int i = 0; i < 16; i++)
+			hex[i] = "0123456789abcdef"[(lastHash >> (60 - i * 4)) & 0xf];
+		return Napi::String::New(env, hex, 16);
+	}
+
+	/**
+	 * Replaces the arraySlices option, e.g. for the next page. Empties the
+	 * response cache.
+	 * 0. Object  {[path]: {skip, limit, count}}
+	 */
+	void setArraySlicesNodeFn(const Napi::CallbackInfo& info) {
+		if (setArraySlices(info[0]))
+			return;
+		sliceGeneration++;
+		cache.clear();
+		cacheIndex.clear();
+		cacheUsed = 0;
+	}
+
+	/**
+	 * Returns the string cache's hit and miss counts. Strings too long to be
+	 * cached aren't counted.
+	 */
+	Napi::Value stringCacheStatsNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		Napi::Object stats = Napi::Object::New(env);
+		stats.Set("hits", static_cast<double>(stringHits));
+		stats.Set("misses", static_cast<double>(stringMisses));
+		stats.Set("slots", static_cast<double>(stringCache.size()));
+		return stats;
+	}
+
+	/**
+	 * Returns the number of pieces the last transcodeCompressed call handed
+	 * to the compressor and the size of the largest.
+	 */
+	Napi::Value compressStatsNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		Napi::Object stats = Napi::Object::New(env);
+		stats.Set("chunks", static_cast<double>(compressChunks));
+		stats.Set("peakBytes", static_cast<double>(compressPeak));
+		return stats;
+	}
+
+	/**
+	 * Transcodes a change stream event into the envelope set by the
+	 * changeEnvelope option. An array of events is written as NDJSON.
+	 * @param in_ BSON event, or an array of them.
+	 */
+	Napi::Value transcodeChangeEventsNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		hashed = false;
+
+		if (envelope.empty()) {
+			Napi::Object defaults = Napi::Object::New(env);
+			for (const char* name : {"operationType", "documentKey", "fullDocument", "updateDescription"})
+				defaults.Set(name, name);
+			setEnvelope(defaults);
+		}
+
+		const bool ndjson = info[0].IsArray();
+		std::vector<Napi::Uint8Array> events;
+		if (ndjson) {
+			Napi::Array arr = info[0].As<Napi::Array>();
+			const uint32_t n = arr.Length();
+			events.reserve(n);
+			for (uint32_t i = 0; i < n; i++) {
+				Napi::Value v = arr.Get(i);
+				if (!v.IsTypedArray() || v.As<Napi::TypedArray>().TypedArrayType() != napi_uint8_array) {
+					Napi::Error::New(env, "Input must be a buffer").ThrowAsJavaScriptException();
+					return env.Undefined();
+				}
+				events.push_back(v.As<Napi::Uint8Array>());
+			}
+		} else if (info[0].IsTypedArray() && info[0].As<Napi::TypedArray>().TypedArrayType() == napi_uint8_array) {
+			events.push_back(info[0].As<Napi::Uint8Array>());
+		} else {
+			Napi::Error::New(env, "Input must be a buffer").ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		size_t total = 0;
+		for (const Napi::Uint8Array& event : events)
+			total += event.ByteLength();
+
+		if (startOutput((total * 10) >> 2))
+			return finishOutput(env, true);
+
+		for (const Napi::Uint8Array& event : events) {
+			if (setInput(event) || transcodeChangeEvent())
+				return finishOutput(env, true);
+			if (ndjson) {
+				if (ensureSpace(1))
+					return finishOutput(env, true);
+				out[outIdx++] = '\n';
+			}
+		}
+
+		return finishOutput(env, false);
+	}
+
+	/**
+	 * Transcodes one element of an indexed document to JSON.
+	 * @param index BsonIndex.
+	 * @param path Dotted path to the element, e.g. "a.0.b". "" is the whole
+	 * document.
+	 * @returns undefined if there's no element at path.
+	 */
+	Napi::Value transcodePathNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		hashed = false;
+
+		BsonIndex* index = toIndex(info[0]);
+		if (index == nullptr) {
+			Napi::TypeError::New(env, "Expected a BsonIndex").ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		if (!info[1].IsString()) {
+			Napi::TypeError::New(env, "Path must be a string").ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		if (setInput(*index)) {
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		const size_t entry = index->find(in, info[1].As<Napi::String>().Utf8Value(), currentPath);
+		// JSON.stringify(undefined) is undefined too.
+		if (entry == index->tape.size() || index->tape[entry].type == BSON_DATA_UNDEFINED)
+			return env.Undefined();
+
+		return finishOutput(env, transcodeEntry(index->tape[entry]));
+	}
+
+	bool transcode(
+		const uint8_t* in_,
+		size_t inLen_,
+		bool isArray = false,
+		size_t chunkSize = 0
 	) {
 
 		if (UNLIKELY(inLen_ < 5))
@@ -427,6 +1910,7 @@ public:
 
 		in = in_;
 		inLen = inLen_;
+		inReadable = inLen_;
 		inIdx = 0;
 
 		if (chunkSize == 0) {
@@ -446,6 +1930,712 @@ private:
 	size_t inIdx = 0;
 	size_t inLen = 0;
 
+	static constexpr uint32_t UNSORTED = UINT32_MAX;
+
+	// A document or array being walked.
+	struct Frame {
+		size_t end; // inIdx after its terminator
+		size_t pathLen; // length of its key path in currentPath
+		int32_t arrIdx; // index of the next element
+		bool isArray;
+		// Set for sorted objects and sliced arrays, whose next element to
+		// write isn't necessarily at inIdx (see seek()).
+		bool seeks = false;
+		// Start of its elements in sortedElems if canonical, else UNSORTED.
+		uint32_t sortedStart = UNSORTED;
+		// Index of the first element written, if it's a sliced array.
+		int32_t firstIdx = 0;
+		const ArraySlice* slice = nullptr;
+	};
+	// Reused between calls; holds at most maxDepth frames.
+	std::vector<Frame> frames;
+
+	// An element of an object, for sorting by key.
+	struct SortedElem {
+		uint32_t offset; // of its type byte; the key follows
+		uint32_t keyLen;
+		// Set for the count sibling of the sliced array at offset, which
+		// sorts by slice->countName instead.
+		const ArraySlice* count = nullptr;
+	};
+	// The elements of the open sorted objects in key order, those of each
+	// starting at its frame's sortedStart.
+	std::vector<SortedElem> sortedElems;
+
+	// Response cache, most recently used first. Entries keep a copy of their
+	// input to rule out hash collisions, and a reference to the Buffer that
+	// was returned for it, which is returned again on a hit.
+	struct CacheEntry {
+		uint64_t hash;
+		std::vector<uint8_t> input;
+		Napi::Reference<Napi::Buffer<uint8_t> > output;
+		size_t bytes; // input plus output
+	};
+	std::list<CacheEntry> cache;
+	std::unordered_map<uint64_t, typename std::list<CacheEntry>::iterator> cacheIndex;
+	size_t cacheUsed = 0;
+	uint64_t cacheHits = 0;
+	uint64_t cacheMisses = 0;
+	// populateInfo->version that the cached output was populated with.
+	uint64_t cacheVersion = 0;
+	// Bytes that can be read from in, including any padding after inLen.
+	size_t inReadable = 0;
+
+	// toObject's state: the properties of the open documents, those of each
+	// starting at propsStart (parallel to frames), and the key strings
+	// created so far.
+	std::vector<napi_property_descriptor> props;
+	std::vector<size_t> propsStart;
+	std::unordered_map<std::string_view, napi_value> keyCache;
+
+	// Output buffer kept from the last call whose output was copied, or null.
+	uint8_t* scratch = nullptr;
+	size_t scratchLen = 0;
+
+	// Set by transcodeInto while out points into the caller's memory, which
+	// resize() doesn't realloc.
+	uint8_t* callerOut = nullptr;
+
+	// Set by transcodeCompressed. Once outIdx reaches flushAt, the output is
+	// compressed into zout between elements (not within one, as string
+	// writers can rewind outIdx) and outIdx is reset.
+	z_stream* zs = nullptr;
+	// Null if the host doesn't export brotli's encoder.
+	const BrotliEncoderApi* brApi = nullptr;
+	BrotliEncoderState* br = nullptr;
+	uint8_t* zout = nullptr;
+	size_t zoutLen = 0;
+	size_t zoutIdx = 0;
+	size_t flushAt = SIZE_MAX;
+	// For compressStats.
+	size_t compressChunks = 0;
+	size_t compressPeak = 0;
+
+	// The number of bytes that can be read from arr.Data(), through the end of
+	// its ArrayBuffer.
+	static size_t readableLength(const Napi::Uint8Array& arr) {
+#ifdef __EMSCRIPTEN__
+		// emnapi only copies the view into the WebAssembly heap.
+		return arr.ByteLength();
+#else
+		napi_value ab;
+		size_t offset, abLen;
+		if (napi_get_typedarray_info(arr.Env(), arr, nullptr, nullptr, nullptr, &ab, &offset) != napi_ok ||
+			napi_get_arraybuffer_info(arr.Env(), ab, nullptr, &abLen) != napi_ok) {
+			return arr.ByteLength(); // e.g. a SharedArrayBuffer
+		}
+		return abLen - offset;
+#endif
+	}
+
+	static BsonIndex* toIndex(const Napi::Value& v) {
+		if (!v.IsObject() || !v.As<Napi::Object>().CheckTypeTag(&BSON_INDEX_TAG))
+			return nullptr;
+		return BsonIndex::Unwrap(v.As<Napi::Object>());
+	}
+
+	// Reads from the buffer that index was built from.
+	bool setInput(const BsonIndex& index) {
+		Napi::Uint8Array arr = index.bufferRef.Value();
+		if (UNLIKELY(arr.ByteLength() != index.length))
+			RETURN_ERR("BsonIndex's buffer was resized or detached");
+		in = arr.Data();
+		inLen = index.length;
+		inReadable = readableLength(arr);
+		inIdx = 0;
+		return false;
+	}
+
+	// Transcodes the element at entry, whose key path is currentPath, into a
+	// new output buffer.
+	bool transcodeEntry(const TapeEntry& entry) {
+		if (startOutput((static_cast<size_t>(entry.size) * 10) >> 2))
+			return true;
+
+		inIdx = entry.valueOffset;
+		if (entry.type == BSON_DATA_OBJECT || entry.type == BSON_DATA_ARRAY)
+			return transcodeDocument(entry.type == BSON_DATA_ARRAY);
+		// Frames left from the last call would make writeValue take a
+		// top-level "_id" for the document's.
+		frames.clear();
+		return writeValue(entry.type);
+	}
+
+	// Reads a Uint8Array BSON document into in.
+	bool setInput(const Napi::Value& v) {
+		if (!v.IsTypedArray() || v.As<Napi::TypedArray>().TypedArrayType() != napi_uint8_array)
+			RETURN_ERR("Input must be a buffer");
+		Napi::Uint8Array arr = v.As<Napi::Uint8Array>();
+		in = arr.Data();
+		inLen = arr.ByteLength();
+		inReadable = readableLength(arr);
+		inIdx = 0;
+		if (UNLIKELY(inLen < 5))
+			RETURN_ERR("Input buffer must have length >= 5");
+		return false;
+	}
+
+	// Calls parse(name, value, encode) for each property of v, the value of
+	// an option that maps keys to settings, and returns false. encode(key)
+	// returns a key JSON-encoded with the colon; JSON.stringify encodes it
+	// once, here, rather than for each output. Returns true and throws a
+	// TypeError with message if v isn't a non-array object, if it's empty
+	// and allowEmpty is false, or if parse returns false.
+	template <typename F>
+	bool parseKeyedOption(const Napi::Value& v, const char* message, bool allowEmpty, F parse) {
+		Napi::Env env = v.Env();
+		if (v.IsObject() && !v.IsArray()) {
+			Napi::Object obj = v.As<Napi::Object>();
+			Napi::Array names = obj.GetPropertyNames();
+			Napi::Function stringify = env.Global().Get("JSON").As<Napi::Object>().Get("stringify").As<Napi::Function>();
+			auto encode = [&](const Napi::Value& key) {
+				return stringify.Call({key}).As<Napi::String>().Utf8Value() + ':';
+			};
+			bool valid = allowEmpty || names.Length() != 0;
+			for (uint32_t i = 0; valid && i < names.Length(); i++) {
+				Napi::Value name = names.Get(i);
+				valid = parse(name, obj.Get(name), encode);
+			}
+			if (valid)
+				return false;
+		}
+		Napi::TypeError::New(env, message).ThrowAsJavaScriptException();
+		return true;
+	}
+
+	// Parses the changeEnvelope option, an object mapping output keys to
+	// dotted paths in the event. Returns true and throws if it's invalid.
+	bool setEnvelope(const Napi::Value& v) {
+		envelope.clear();
+		return parseKeyedOption(v, "changeEnvelope must map output keys to event paths", false,
+			[&](const Napi::Value& name, const Napi::Value& path, auto& encode) {
+				if (!path.IsString() || path.As<Napi::String>().Utf8Value().empty())
+					return false;
+				EnvelopeField field;
+				field.key = encode(name);
+				const std::string p = path.As<Napi::String>().Utf8Value();
+				for (size_t pos = 0; pos <= p.size();) {
+					size_t dot = p.find('.', pos);
+					if (dot == std::string::npos)
+						dot = p.size();
+					field.path.push_back(p.substr(pos, dot - pos));
+					pos = dot + 1;
+				}
+				envelope.push_back(std::move(field));
+				return true;
+			});
+	}
+
+	// Parses the arraySlices option, an object mapping dotted paths to
+	// {skip, limit, count}. Returns true and throws if it's invalid.
+	bool setArraySlices(const Napi::Value& v) {
+		auto toInt = [](const Napi::Value& n, int32_t& i) {
+			if (n.IsUndefined())
+				return true;
+			const double d = n.IsNumber() ? n.As<Napi::Number>().DoubleValue() : -1;
+			if (!(d >= 0 && d <= INT32_MAX && d == std::floor(d)))
+				return false;
+			i = static_cast<int32_t>(d);
+			return true;
+		};
+		std::unordered_map<std::string, ArraySlice> parsed;
+		if (parseKeyedOption(v, "arraySlices must map paths to {skip, limit, count}", true,
+			[&](const Napi::Value& name, const Napi::Value& spec, auto& encode) {
+				const std::string path = name.As<Napi::String>().Utf8Value();
+				if (path.empty() || !spec.IsObject())
+					return false;
+				ArraySlice slice;
+				Napi::Object specObj = spec.As<Napi::Object>();
+				if (!toInt(specObj.Get("skip"), slice.skip) || !toInt(specObj.Get("limit"), slice.limit))
+					return false;
+				Napi::Value count = specObj.Get("count");
+				Napi::Value countKey;
+				if (count.IsString() && !count.As<Napi::String>().Utf8Value().empty()) {
+					countKey = count;
+				} else if (count.IsBoolean()) {
+					// The last segment of the path, plus "Count".
+					if (count.As<Napi::Boolean>().Value())
+						countKey = Napi::String::New(v.Env(), path.substr(path.rfind('.') + 1) + "Count");
+				} else if (!count.IsUndefined()) {
+					return false;
+				}
+				if (!countKey.IsEmpty()) {
+					slice.countKey = encode(countKey);
+					slice.countName = countKey.As<Napi::String>().Utf8Value();
+				}
+				parsed[path] = std::move(slice);
+				return true;
+			}))
+			return true;
+		arraySlices = std::move(parsed);
+		return false;
+	}
+
+	// Sets inIdx to the type byte of the element with the given key in the
+	// document at inIdx, or to inLen if there isn't one.
+	bool findElement(const std::string& key) {
+		if (UNLIKELY(inLen - inIdx < 5))
+			RETURN_ERR("Truncated BSON");
+		const int32_t size = readLE<int32_t>();
+		if (UNLIKELY(size < 5))
+			RETURN_ERR("BSON size must be >= 5");
+		if (UNLIKELY(size + inIdx - 4 > inLen))
+			RETURN_ERR("BSON size exceeds input length");
+		const size_t end = inIdx + size - 4;
+		if (UNLIKELY(in[end - 1] != 0))
+			RETURN_ERR("BSON document must end with a null byte");
+
+		while (in[inIdx] != 0) {
+			const size_t start = inIdx;
+			const uint8_t type = in[inIdx++];
+			// The document's terminator bounds the key.
+			const size_t keyLen = static_cast<const uint8_t*>(memchr(in + inIdx, 0, end - inIdx)) - (in + inIdx);
+			const size_t valueStart = inIdx + keyLen + 1;
+			if (UNLIKELY(valueStart >= end))
+				RETURN_ERR("Truncated BSON (in key)");
+			if (keyLen == key.size() && memcmp(in + inIdx, key.data(), keyLen) == 0) {
+				inIdx = start;
+				return false;
+			}
+			// Events have siblings like clusterTime (a Timestamp) that aren't
+			// output, so skip any type.
+			size_t vsize;
+			if (const char* e = anyValueSize(type, in + valueStart, end - 1 - valueStart, vsize))
+				RETURN_ERR(e);
+			inIdx = valueStart + vsize;
+		}
+		inIdx = inLen;
+		return false;
+	}
+
+	// Writes the envelope for the change event in in. Paths that aren't in
+	// the event are left out. Populate paths are relative to each value, so
+	// fullDocument is populated like a top-level document.
+	bool transcodeChangeEvent() {
+		ENSURE_SPACE_OR_RETURN(1);
+		out[outIdx++] = '{';
+		bool first = true;
+		for (const EnvelopeField& field : envelope) {
+			inIdx = 0;
+			uint8_t type = BSON_DATA_OBJECT;
+			for (const std::string& seg : field.path) {
+				if (type != BSON_DATA_OBJECT && type != BSON_DATA_ARRAY) {
+					inIdx = inLen;
+					break;
+				}
+				if (findElement(seg))
+					return true;
+				if (inIdx == inLen)
+					break;
+				type = in[inIdx];
+				// Skip the type and key.
+				inIdx += 1 + seg.size() + 1;
+			}
+			// JSON.stringify leaves undefined values out too.
+			if (inIdx == inLen || type == BSON_DATA_UNDEFINED)
+				continue;
+
+			ENSURE_SPACE_OR_RETURN(field.key.size() + 1);
+			if (!first)
+				out[outIdx++] = ',';
+			first = false;
+			memcpy(out + outIdx, field.key.data(), field.key.size());
+			outIdx += field.key.size();
+
+			currentPath.clear();
+			frames.clear();
+			if (type == BSON_DATA_OBJECT || type == BSON_DATA_ARRAY) {
+				if (transcodeDocument(type == BSON_DATA_ARRAY))
+					return true;
+			} else if (writeValue(type)) {
+				return true;
+			}
+		}
+		ENSURE_SPACE_OR_RETURN(1);
+		out[outIdx++] = '}';
+		return false;
+	}
+
+	// Output of transcodeFields() for a previous version of a document.
+	// fields is populateVersion() and sliceGeneration, then the input start
+	// and end and output start and end of each top-level field.
+	struct PrevFields {
+		static constexpr size_t HEADER = 2;
+
+		const uint8_t* bson;
+		size_t bsonLen;
+		const uint8_t* json;
+		size_t jsonLen;
+		const uint32_t* fields;
+		size_t fieldsLen;
+
+		bool valid() const {
+			if (fieldsLen % 4 != HEADER)
+				return false;
+			for (size_t i = HEADER; i < fieldsLen; i += 4) {
+				if (fields[i] >= fields[i + 1] || fields[i + 1] > bsonLen ||
+					fields[i + 2] > fields[i + 3] || fields[i + 3] > jsonLen)
+					return false;
+			}
+			return true;
+		}
+
+		size_t size() const {
+			return fieldsLen / 4;
+		}
+
+		const uint32_t* at(size_t i) const {
+			return fields + HEADER + i * 4;
+		}
+
+		// Returns the field whose input is the len bytes at elem, or nullptr.
+		// next is the field expected to come next, which is checked first.
+		const uint32_t* find(size_t& next, const uint8_t* elem, size_t len, size_t keyLen) const {
+			const size_t n = size();
+			auto equals = [&](size_t i) {
+				const uint32_t* f = at(i);
+				return f[1] - f[0] == len && memcmp(bson + f[0], elem, len) == 0;
+			};
+			if (next < n) {
+				if (equals(next))
+					return at(next++);
+				// Same key, so this field changed.
+				const uint32_t* f = at(next);
+				if (f[1] - f[0] > keyLen + 1 && memcmp(bson + f[0] + 1, elem + 1, keyLen + 1) == 0) {
+					next++;
+					return nullptr;
+				}
+			}
+			// Fields were added, removed or reordered.
+			for (size_t i = 0; i < n; i++) {
+				if (equals(i)) {
+					next = i + 1;
+					return at(i);
+				}
+			}
+			return nullptr;
+		}
+	};
+
+	uint32_t populateVersion() const {
+		return populateInfo ? static_cast<uint32_t>(populateInfo->version) : 0;
+	}
+
+	// Like transcodeObject(false), but also fills fields with the input and
+	// output span of each top-level field (see PrevFields). Fields whose
+	// input is unchanged from prev, if set, are copied from its output.
+	bool transcodeFields(std::vector<uint32_t>& fields, const PrevFields* prev) {
+		fields.clear();
+		fields.push_back(populateVersion());
+		fields.push_back(sliceGeneration);
+		currentPath.clear();
+		frames.clear();
+		sortedElems.clear();
+		if (pushFrame(false) || (canonical && sortFrame()))
+			return true;
+		ENSURE_SPACE_OR_RETURN(1);
+		out[outIdx++] = '{';
+
+		size_t next = 0;
+		while (true) {
+			Frame& frame = frames.back();
+			// A count sibling's input span is its array's type byte, which no
+			// element matches, so it's rewritten every time.
+			while (const SortedElem* count = frame.seeks ? countAt(frame) : nullptr) {
+				const uint32_t offset = count->offset;
+				if (frame.arrIdx) {
+					ENSURE_SPACE_OR_RETURN(1);
+					out[outIdx++] = ',';
+				}
+				const size_t jsonStart = outIdx;
+				if (writeSortedCount(*count, false))
+					return true;
+				frame.arrIdx++;
+				if (prev && next < prev->size() && prev->at(next)[1] - prev->at(next)[0] == 1)
+					next++;
+				fields.insert(fields.end(), {offset, offset + 1,
+					static_cast<uint32_t>(jsonStart), static_cast<uint32_t>(outIdx)});
+			}
+			if (frame.seeks && seek(frame))
+				return true;
+			const size_t start = inIdx;
+			const uint8_t elementType = in[inIdx++];
+			if (elementType == 0) {
+				ENSURE_SPACE_OR_RETURN(1);
+				out[outIdx++] = '}';
+				return popFrame();
+			}
+
+			if (frame.arrIdx) {
+				ENSURE_SPACE_OR_RETURN(1);
+				out[outIdx++] = ',';
+			}
+			frame.arrIdx++;
+			const size_t jsonStart = outIdx;
+
+			const uint32_t* same = nullptr;
+			if (prev) {
+				// The document's terminator bounds the key.
+				const size_t keyLen = static_cast<const uint8_t*>(memchr(in + inIdx, 0, frame.end - inIdx)) - (in + inIdx);
+				const size_t valueStart = inIdx + keyLen + 1;
+				size_t size;
+				if (UNLIKELY(valueStart >= frame.end))
+					RETURN_ERR("Truncated BSON (in key)");
+				if (const char* e = valueSize(elementType, in + valueStart, frame.end - 1 - valueStart, size))
+					RETURN_ERR(e);
+				same = prev->find(next, in + start, valueStart + size - start, keyLen);
+				if (same) {
+					const size_t n = same[3] - same[2];
+					ENSURE_SPACE_OR_RETURN(n);
+					memcpy(out + outIdx, prev->json + same[2], n);
+					outIdx += n;
+					if (elementType == BSON_DATA_OID && keyLen == 3 && memcmp(in + inIdx, "_id", 3) == 0) {
+						memcpy(docId.data(), in + valueStart, 12);
+						hasDocId = true;
+					}
+					inIdx = valueStart + size;
+				}
+			}
+			if (!same) {
+				if (writeKey(frame) || writeValue(elementType))
+					return true;
+				if (frames.size() > 1 && transcodeFrames(1))
+					return true;
+			}
+
+			fields.insert(fields.end(), {static_cast<uint32_t>(start), static_cast<uint32_t>(inIdx),
+				static_cast<uint32_t>(jsonStart), static_cast<uint32_t>(outIdx)});
+		}
+	}
+
+	// Runs transcodeFields on in and returns {json, fields}.
+	Napi::Value finishFields(Napi::Env env, const PrevFields* prev) {
+		std::vector<uint32_t> fields;
+		if (startOutput((inLen * 10) >> 2) || transcodeFields(fields, prev))
+			return finishOutput(env, true);
+
+		Napi::Uint32Array arr = Napi::Uint32Array::New(env, fields.size());
+		memcpy(arr.Data(), fields.data(), fields.size() * sizeof(uint32_t));
+		Napi::Object result = Napi::Object::New(env);
+		result.Set("json", finishOutput(env, false));
+		result.Set("fields", arr);
+		return result;
+	}
+
+	// Returns the entry for the input in in, or nullptr.
+	CacheEntry* cacheFind(uint64_t hash) {
+		if (populateInfo && populateInfo->version != cacheVersion) {
+			// Populated output may have changed.
+			cache.clear();
+			cacheIndex.clear();
+			cacheUsed = 0;
+			cacheVersion = populateInfo->version;
+			return nullptr;
+		}
+		auto it = cacheIndex.find(hash);
+		if (it == cacheIndex.end())
+			return nullptr;
+		CacheEntry& entry = *it->second;
+		if (entry.input.size() != inLen || memcmp(entry.input.data(), in, inLen) != 0)
+			return nullptr;
+		cache.splice(cache.begin(), cache, it->second);
+		return &entry;
+	}
+
+	void cacheInsert(uint64_t hash, size_t outSize, Napi::Buffer<uint8_t> output) {
+		const size_t bytes = inLen + outSize;
+		if (bytes > cacheBytes)
+			return;
+
+		// A colliding input replaces the entry with the same hash.
+		auto it = cacheIndex.find(hash);
+		if (it != cacheIndex.end())
+			cacheErase(it->second);
+		while (cacheUsed + bytes > cacheBytes)
+			cacheErase(std::prev(cache.end()));
+
+		cache.push_front({hash, std::vector<uint8_t>(in, in + inLen),
+			Napi::Reference<Napi::Buffer<uint8_t> >::New(output, 1), bytes});
+		cacheIndex[hash] = cache.begin();
+		cacheUsed += bytes;
+	}
+
+	void cacheErase(typename std::list<CacheEntry>::iterator it) {
+		cacheUsed -= it->bytes;
+		cacheIndex.erase(it->hash);
+		cache.erase(it);
+	}
+
+	// Compresses out[0, outIdx) into zout, hashing it first if hashing, and
+	// rewinds outIdx. Ends the stream if finish is true.
+	NOINLINE(bool compressOutput(bool finish)) {
+		compressChunks++;
+		compressPeak = std::max(compressPeak, outIdx);
+		if (hashing)
+			outHash.update(out, outIdx);
+		const uint8_t* next = out;
+		size_t avail = outIdx;
+		bool done = false;
+		while (!done) {
+			if (zoutIdx == zoutLen) {
+				const size_t to = zoutLen ? (zoutLen * 3) >> 1 : (inLen >> 2) + 64;
+				uint8_t* grown = static_cast<uint8_t*>(std::realloc(zout, to));
+				if (grown == nullptr)
+					RETURN_ERR("Allocation failure");
+				zout = grown;
+				zoutLen = to;
+			}
+			size_t room = zoutLen - zoutIdx;
+			if (br) {
+				uint8_t* nextOut = zout + zoutIdx;
+				const BrotliEncoderOperation op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+				if (UNLIKELY(!brApi->compressStream(br, op, &avail, &next, &room, &nextOut, nullptr)))
+					RETURN_ERR("Compression failure");
+				done = finish ? brApi->isFinished(br) : avail == 0;
+			} else {
+				// avail is at most COMPRESS_CHUNK plus one element.
+				zs->next_in = const_cast<uint8_t*>(next);
+				zs->avail_in = static_cast<uInt>(avail);
+				zs->next_out = zout + zoutIdx;
+				zs->avail_out = static_cast<uInt>(std::min<size_t>(room, UINT32_MAX));
+				const int r = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+				if (UNLIKELY(r == Z_STREAM_ERROR))
+					RETURN_ERR("Compression failure");
+				room -= std::min<size_t>(room, UINT32_MAX) - zs->avail_out;
+				next = zs->next_in;
+				avail = zs->avail_in;
+				done = finish ? r == Z_STREAM_END : avail == 0;
+			}
+			zoutIdx = zoutLen - room;
+		}
+		outIdx = 0;
+		return false;
+	}
+
+	void endCompression() {
+		if (zs)
+			deflateEnd(zs);
+		zs = nullptr;
+		if (br)
+			brApi->destroyInstance(br);
+		br = nullptr;
+		flushAt = SIZE_MAX;
+	}
+
+	// Sets out to a buffer of at least size bytes, reusing scratch if it was
+	// kept from a previous call.
+	bool startOutput(size_t size) {
+		out = scratch;
+		outLen = scratchLen;
+		outIdx = 0;
+		scratch = nullptr;
+		scratchLen = 0;
+		if (out && outLen >= size)
+			return false;
+		return resize(size);
+	}
+
+	// Sets lastHash to the hash of the output p[0, n) if hashing.
+	void hashOutput(const uint8_t* p, size_t n) {
+		if (!hashing)
+			return;
+		outHash.reset();
+		outHash.update(p, n);
+		lastHash = outHash.digest();
+		hashed = true;
+	}
+
+	// Returns out as a Buffer, or throws err if status is true. Small outputs
+	// are copied into memory from V8's ArrayBuffer allocator so that they
+	// don't need a finalizer, and out is kept for reuse.
+	Napi::Value finishOutput(Napi::Env env, bool status) {
+		if (status) {
+			std::free(out);
+			out = nullptr;
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		hashOutput(out, outIdx);
+
+		if (outIdx <= COPY_OUTPUT_MAX) {
+			Napi::Buffer<uint8_t> buf = Napi::Buffer<uint8_t>::Copy(env, out, outIdx);
+			keepOutput();
+			return buf;
+		}
+
+		Napi::Buffer<uint8_t> buf = Napi::Buffer<uint8_t>::New(env, out, outIdx, [](Napi::Env, uint8_t* data) {
+			std::free(data);
+		});
+
+		out = nullptr;
+		outLen = 0;
+		outIdx = 0;
+
+		return buf;
+	}
+
+	// Returns out as a string, or throws err if status is true. Pure-ASCII
+	// output is handed to V8 as an external one-byte string, so it's neither
+	// copied nor decoded; small outputs are copied like in finishOutput.
+	Napi::Value finishString(Napi::Env env, bool status) {
+		if (status) {
+			std::free(out);
+			out = nullptr;
+			Napi::Error::New(env, err).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		hashOutput(out, outIdx);
+		const char* data = reinterpret_cast<const char*>(out);
+		napi_value str;
+		napi_status s;
+		if (asciiPrefix(out, outIdx, Enabler<isa>{}) != outIdx) {
+			// Replaces invalid sequences with U+FFFD like Buffer#toString.
+			s = napi_create_string_utf8(env, data, outIdx, &str);
+		} else if (outIdx <= COPY_OUTPUT_MAX) {
+			s = napi_create_string_latin1(env, data, outIdx, &str);
+		} else {
+#ifdef B2J_EXTERNAL_STRINGS
+			static const auto createExternal = reinterpret_cast<CreateExternalLatin1>(
+				findProcessSymbol("node_api_create_external_string_latin1"));
+			if (createExternal) {
+				bool copied;
+				s = createExternal(env, reinterpret_cast<char*>(out), outIdx,
+					[](napi_env, void* p, void*) { std::free(p); }, nullptr, &str, &copied);
+				// If V8 copied the string, the finalizer has already freed out.
+				if (s == napi_ok) {
+					out = nullptr;
+					outLen = 0;
+					outIdx = 0;
+					return Napi::Value(env, str);
+				}
+			} else
+#endif
+			s = napi_create_string_latin1(env, data, outIdx, &str);
+		}
+		keepOutput();
+		if (s != napi_ok) {
+			Napi::Error::New(env, "Failed to create string").ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		return Napi::Value(env, str);
+	}
+
+	// Keeps out as scratch for the next call if it isn't too big, or else
+	// frees it.
+	void keepOutput() {
+		if (outLen <= SCRATCH_MAX) {
+			std::free(scratch);
+			scratch = out;
+			scratchLen = outLen;
+		} else {
+			std::free(out);
+		}
+		out = nullptr;
+		outLen = 0;
+		outIdx = 0;
+	}
+
 	template<typename T>
 	inline T readLE() {
 		T v;
@@ -455,8 +2645,21 @@ private:
 	}
 
 	bool resize(size_t to) {
+		if (UNLIKELY(out != nullptr && out == callerOut)) {
+			// Out of room in the caller's memory. Continues in our own to find
+			// the size that's needed.
+			uint8_t* own = static_cast<uint8_t*>(std::malloc(to + PADDING));
+			if (own == nullptr) {
+				out = nullptr;
+				RETURN_ERR("Allocation failure");
+			}
+			memcpy(own, out, outIdx);
+			out = own;
+			outLen = to;
+			return false;
+		}
 		uint8_t* oldOut = out;
-		out = static_cast<uint8_t*>(std::realloc(out, to));
+		out = static_cast<uint8_t*>(std::realloc(out, to + PADDING));
 		if (out == nullptr) {
 			std::free(oldOut);
 			err = "Allocation failure";
@@ -472,7 +2675,7 @@ private:
 			return false;
 		}
 
-		size_t m = std::max(n, outLen);
+		size_t m = std::max(outIdx + n, outLen);
 		return resize((m * 3) >> 1);
 	}
 
@@ -480,128 +2683,122 @@ private:
 	// at end of in or out, which is almost always). The slow case should be
 	// reached with a `call` and there's not much point to optimize it.
 
+#ifdef B2J_X86
+
+	// Loads the 16 B at in + idx where a full load would cross into the next
+	// page past the end of the input. Bytes past inLen are zero.
 	[[gnu::target("sse2")]]
-	NOINLINE(__m128i load_partial_128i_slow(size_t n)) {
-		// TODO(perf) compare against a right-aligned load + shuffle when possible.
-		// TODO(perf) compare against AVX512VL+BW _mm_mask_loadu_epi8.
-		uint8_t x[16];
-		for (size_t i = 0; i < n; i++) x[i] = in[inIdx + i];
+	NOINLINE(__m128i load_tail_128i(size_t idx, Enabler<ISA::SSE2>)) {
+		uint8_t x[16] = {};
+		if (idx < inLen)
+			memcpy(x, in + idx, std::min<size_t>(inLen - idx, 16));
 		return _mm_loadu_si128(reinterpret_cast<__m128i*>(x));
 	}
 
-	// Safely loads n bytes. The values in xmm beyond n are undefined.
+	[[gnu::target("ssse3")]]
+	NOINLINE(__m128i load_tail_128i(size_t idx, Enabler<ISA::SSSE3>)) {
+		if (UNLIKELY(inLen < 16 || idx >= inLen))
+			return load_tail_128i(idx, Enabler<ISA::SSE2>{});
+		// Load the last 16 B of the input and shuffle them down.
+		const __m128i last = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + inLen - 16));
+		const __m128i shuf = _mm_loadu_si128(reinterpret_cast<__m128i const*>(SHIFT_DOWN + idx - (inLen - 16)));
+		return _mm_shuffle_epi8(last, shuf);
+	}
+
+	// Loads the 16 B at in + idx. Bytes past inLen are undefined, but the load
+	// never crosses into a page that the input doesn't extend into.
 	[[gnu::target("sse2")]]
-	inline __m128i load_partial_128i(size_t n) {
-		// Do a full load if we're 16B from the end of the input.
-		// Other acceptable criteria:
-		// n == 16
-		// (reinterpret_cast<intptr_t>(in + inIdx) & 0xFFF) < 0xFF0 (16B from page boundary)
-		if (LIKELY(n + inIdx < inLen)) {
-			return _mm_loadu_si128(reinterpret_cast<__m128i const*>(&in[inIdx]));
+	inline __m128i load_128i(size_t idx) {
+		if (LIKELY(idx + 16 <= inReadable || !crossesPage(in + idx, 16))) {
+			return _mm_loadu_si128(reinterpret_cast<__m128i const*>(&in[idx]));
 		}
 
-		return load_partial_128i_slow(n);
+		return load_tail_128i(idx, Enabler<isa>{});
+	}
+
+	// Safely loads n bytes. The values in xmm beyond n are undefined.
+	[[gnu::target("sse2")]]
+	inline __m128i load_partial_128i([[maybe_unused]] size_t n) {
+		return load_128i(inIdx);
 	}
 
 	[[gnu::target("avx2")]]
-	NOINLINE(__m256i load_partial_256i_slow(size_t n)) {
-		if (n <= 16)
-			return _mm256_castsi128_si256(load_partial_128i(n));
-
-		__m128i lo = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + inIdx));;
-		inIdx += 16;
-		__m128i hi = load_partial_128i(n - 16);
-		inIdx -= 16;
+	NOINLINE(__m256i load_partial_256i_slow()) {
+		__m128i lo = load_128i(inIdx);
+		__m128i hi = load_128i(inIdx + 16);
 		return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
 	}
 
 	// Safely loads n bytes. The values in ymm beyond n are undefined.
 	[[gnu::target("avx2")]]
-	inline __m256i load_partial_256i(size_t n) {
-		// debug assert n != 0 && n <= 32
-		
-		// Other acceptable criteria:
-		// n == 32
-		// (reinterpret_cast<intptr_t>(in + inIdx) & 0xFFF) < 0xFE0 (32B from page boundary)
-		if (LIKELY(n + inIdx < inLen)) {
+	inline __m256i load_partial_256i([[maybe_unused]] size_t n) {
+		if (LIKELY(inIdx + 32 <= inReadable || !crossesPage(in + inIdx, 32))) {
 			return _mm256_loadu_si256(reinterpret_cast<__m256i const*>(&in[inIdx]));
 		}
 
-		return load_partial_256i_slow(n);
+		return load_partial_256i_slow();
 	}
 
+	// Safely loads n bytes. The values in zmm beyond n are zero.
 	[[gnu::target("avx512f,avx512bw,bmi2")]]
 	inline __m512i load_partial_512i(size_t n) {
-		// if (LIKELY(n + inIdx < inLen)) {
-		// 	return _mm512_loadu_si512(&in[inIdx]);
-		// }
-
-		__mmask64 mask = _bzhi_u64(-1, n); // TODO n needs to clamp at inLen
+		// Masked-off bytes don't fault.
+		if (n > inLen - inIdx)
+			n = inLen - inIdx;
+		__mmask64 mask = _bzhi_u64(-1, n);
 		return _mm512_maskz_loadu_epi8(mask, &in[inIdx]);
 	}
 
+	// Stores n bytes by writing a full vector. resize() allocates PADDING
+	// bytes past outLen for the excess.
 	[[gnu::target("sse2")]]
-	NOINLINE(void store_partial_128i_slow(__m128i v, size_t n)) {
-		// maskmovdqu is implicitly NT.
-		// Does AVX512BW have fast byte-granular store?
-		// pblendvb for load+blend+store requires SSE4.1 and this has to work with SSE2.
-		// TODO(perf) Try _mm_storeu_si128(temp, v), memcpy(out + outIdx, temp, n)?
-		union {
-			int8_t  i8[16];
-			int16_t i16[8];
-			int32_t i32[4];
-			int64_t i64[2];
-		} u;
-		_mm_storeu_si128(reinterpret_cast<__m128i*>(u.i8), v);
-		int j = 0;
-		if (n & 8) {
-			*reinterpret_cast<int64_t*>(out + outIdx) = u.i64[0];
-			j += 8;
-		}
-		if (n & 4) {
-			reinterpret_cast<int32_t*>(out + outIdx)[j >> 2] = u.i32[j >> 2];
-			j += 4;
-		}
-		if (n & 2) {
-			reinterpret_cast<int16_t*>(out + outIdx)[j >> 1] = u.i16[j >> 1];
-			j += 2;
-		}
-		if (n & 1) {
-			out[outIdx + j] = u.i8[j];
-		}
+	inline void store_partial_128i(__m128i v, [[maybe_unused]] size_t n) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + outIdx), v);
 	}
 
-	// Safely stores n bytes. May write more than n bytes.
-	[[gnu::target("sse2")]]
-	inline void store_partial_128i(__m128i v, size_t n) {
-		if (LIKELY(16 + outIdx < outLen)) {
-			return _mm_storeu_si128(reinterpret_cast<__m128i*>(out + outIdx), v);
-		}
-		store_partial_128i_slow(v, n);
+	// Stores n bytes by writing a full vector.
+	[[gnu::target("avx2")]]
+	inline void store_partial_256i(__m256i v, [[maybe_unused]] size_t n) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + outIdx), v);
 	}
 
-	[[gnu::target("avx2")]]
-	NOINLINE(void store_partial_256i_slow(__m256i v, size_t n)) {
-		store_partial_128i(_mm256_castsi256_si128(v), n);
-		if (n > 16)
-			store_partial_128i(_mm256_extracti128_si256(v, 1), n - 16);
+	// Stores n bytes by writing a full vector.
+	[[gnu::target("avx512f")]]
+	inline void store_partial_512i(__m512i v, [[maybe_unused]] size_t n) {
+		_mm512_storeu_si512(out + outIdx, v);
+	}
+#endif // B2J_X86
+
+#ifdef __wasm_simd128__
+	NOINLINE(v128_t load_partial_v128_slow()) {
+		// Zero-filled so that the null-terminated kernel stops at the end.
+		if (LIKELY(inLen >= 16)) {
+			// Load the last 16 B of the input and swizzle them down.
+			const v128_t last = wasm_v128_load(in + inLen - 16);
+			return wasm_i8x16_swizzle(last, wasm_v128_load(SHIFT_DOWN + inIdx - (inLen - 16)));
+		}
+		uint8_t x[16] = {};
+		memcpy(x, in + inIdx, inLen - inIdx);
+		return wasm_v128_load(x);
 	}
 
-	// Safely stores n bytes. May write more than n bytes.
-	[[gnu::target("avx2")]]
-	inline void store_partial_256i(__m256i v, size_t n) {
-		if (LIKELY(32 + outIdx < outLen)) {
-			return _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + outIdx), v);
+	// Safely loads n bytes. The values in the vector beyond n are undefined.
+	inline v128_t load_partial_v128([[maybe_unused]] size_t n) {
+		// Over-reading is only a problem at the end of linear memory (traps),
+		// which is page-aligned, but the input could be the last allocation in
+		// the heap.
+		if (LIKELY(inIdx + 16 <= inReadable || !crossesPage(in + inIdx, 16))) {
+			return wasm_v128_load(in + inIdx);
 		}
-		store_partial_256i_slow(v, n);
+
+		return load_partial_v128_slow();
 	}
 
-	// Safely stores n bytes. May write more than n bytes.
-	[[gnu::target("avx512f,avx512bw,bmi2")]]
-	inline void store_partial_512i(__m512i v, size_t n) {
-		__mmask64 mask = _bzhi_u64(-1, n); // TODO n needs to clamp at outLen
-		_mm512_mask_storeu_epi8(out + outIdx, mask, v);
+	// Stores n bytes by writing a full vector.
+	inline void store_partial_v128(v128_t v, [[maybe_unused]] size_t n) {
+		wasm_v128_store(out + outIdx, v);
 	}
+#endif // __wasm_simd128__
 
 	// Writes the `\ u 0 0 ch cl` sequence
 	inline void writeControlChar(uint8_t c) {
@@ -611,13 +2808,23 @@ private:
 		out[outIdx++] = hexNib(c & 0xf);
 	}
 
-	// Writes n characters from in to out, escaping per ECMA-262 sec 24.5.2.2.
-	bool writeEscapedChars(size_t n, Enabler<ISA::BASELINE>) {
-		const size_t end = inIdx + n;
+	// Writes the `\ u h h h h` sequence for a UTF-16 code unit.
+	inline void writeUnicodeEscape(uint16_t u) {
+		memcpy(out + outIdx, "\\u", 2);
+		out[outIdx + 2] = hexNib(u >> 12);
+		out[outIdx + 3] = hexNib((u >> 8) & 0xf);
+		out[outIdx + 4] = hexNib((u >> 4) & 0xf);
+		out[outIdx + 5] = hexNib(u & 0xf);
+		outIdx += 6;
+	}
+
+	// Writes the characters from inIdx to blockEnd from in to out, escaping per
+	// ECMA-262 sec 24.5.2.2. Space must already be ensured for the rest of the
+	// string, up to end.
+	bool writeEscapedRange(size_t blockEnd, size_t end) {
 		// TODO(perf) the inner ensureSpace can be skipped when ensureSpace(n * 6)
 		// is true (worst-case expansion is 6x).
-		ENSURE_SPACE_OR_RETURN(n);
-		while (inIdx < end) {
+		while (inIdx < blockEnd) {
 			uint8_t xc;
 			const uint8_t c = in[inIdx++];
 			if (LIKELY(c >= 0x20 && c != 0x22 && c != 0x5c)) {
@@ -634,6 +2841,13 @@ private:
 		return false;
 	}
 
+	// Writes n characters from in to out, escaping per ECMA-262 sec 24.5.2.2.
+	bool writeEscapedChars(size_t n, Enabler<ISA::BASELINE>) {
+		ENSURE_SPACE_OR_RETURN(n);
+		return writeEscapedRange(inIdx + n, inIdx + n);
+	}
+
+#ifdef B2J_X86
 	[[gnu::target("sse2,bmi")]]
 	bool writeEscapedChars(size_t n, Enabler<ISA::SSE2>) {
 		const size_t end = inIdx + n;
@@ -739,18 +2953,67 @@ private:
 			const size_t clampedN = n > 32 ? 32 : n;
 			__m256i chars = load_partial_256i(clampedN);
 
-			// see above (unsigned comparison)
-			__m256i iseq = _mm256_cmpgt_epi8(esch20, _mm256_xor_si256(chars, _mm256_set1_epu8(0x80)));
-			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, esch22));
-			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, esch5c));
+			// see above (unsigned comparison)
+			__m256i iseq = _mm256_cmpgt_epi8(esch20, _mm256_xor_si256(chars, _mm256_set1_epu8(0x80)));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, esch22));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, esch5c));
+
+			uint32_t mask = _mm256_movemask_epi8(iseq);
+			uint32_t esRIdx = _tzcnt_u32(mask);
+
+			if (esRIdx > clampedN) // No chars need escaping.
+				esRIdx = clampedN;
+
+			store_partial_256i(chars, esRIdx);
+			n -= esRIdx;
+			outIdx += esRIdx;
+			inIdx += esRIdx;
+
+			if (esRIdx < clampedN) {
+				uint8_t xc;
+				uint8_t c = in[inIdx++];
+				n--;
+				if ((xc = getEscape(c))) { // single char escape
+					ENSURE_SPACE_OR_RETURN(end - inIdx + 1);
+					out[outIdx++] = '\\';
+					out[outIdx++] = xc;
+				} else { // c < 0x20, control
+					ENSURE_SPACE_OR_RETURN(end - inIdx + 5);
+					writeControlChar(c);
+				}
+			}
+		}
+		return false;
+	}
+
+	[[gnu::target("avx512f,avx512bw,bmi,bmi2")]]
+	bool writeEscapedChars(size_t n, Enabler<ISA::AVX512F>) {
+		const size_t end = inIdx + n;
+		ENSURE_SPACE_OR_RETURN(n);
+
+		// escape if (x < 0x20 || x == 0x22 || x == 0x5c)
+		// allow if (x >= 0x20 && x != 0x22 && x != 0x5c)
+
+		__m512i esch20 = _mm512_set1_epu8(0x20);
+		__m512i esch22 = _mm512_set1_epu8(0x22);
+		__m512i esch5c = _mm512_set1_epu8(0x5c);
+
+		while (inIdx < end) {
+			const size_t clampedN = n > 64 ? 64 : n;
+			__m512i chars = load_partial_512i(clampedN);
+
+			__mmask64 mask1 = _mm512_cmpge_epu8_mask(chars, esch20);
+			mask1 = _mm512_mask_cmpneq_epu8_mask(mask1, chars, esch22);
+			mask1 = _mm512_mask_cmpneq_epu8_mask(mask1, chars, esch5c);
+			// TODO(perf) is it better to use two mask regs and & them later so
+			// there's no dependency chain on the cmps?
 
-			uint32_t mask = _mm256_movemask_epi8(iseq);
-			uint32_t esRIdx = _tzcnt_u32(mask);
+			uint64_t esRIdx = _tzcnt_u64(~mask1);
 
 			if (esRIdx > clampedN) // No chars need escaping.
 				esRIdx = clampedN;
 
-			store_partial_256i(chars, esRIdx);
+			store_partial_512i(chars, esRIdx);
 			n -= esRIdx;
 			outIdx += esRIdx;
 			inIdx += esRIdx;
@@ -771,35 +3034,35 @@ private:
 		}
 		return false;
 	}
+#endif // B2J_X86
 
-	[[gnu::target("avx512f,avx512bw,bmi,bmi2")]]
-	bool writeEscapedChars(size_t n, Enabler<ISA::AVX512F>) {
+#ifdef __wasm_simd128__
+	bool writeEscapedChars(size_t n, Enabler<ISA::WASM_SIMD128>) {
 		const size_t end = inIdx + n;
 		ENSURE_SPACE_OR_RETURN(n);
 
 		// escape if (x < 0x20 || x == 0x22 || x == 0x5c)
-		// allow if (x >= 0x20 && x != 0x22 && x != 0x5c)
 
-		__m512i esch20 = _mm512_set1_epu8(0x20);
-		__m512i esch22 = _mm512_set1_epu8(0x22);
-		__m512i esch5c = _mm512_set1_epu8(0x5c);
+		const v128_t esch20 = wasm_u8x16_splat(0x20);
+		const v128_t esch22 = wasm_u8x16_splat(0x22);
+		const v128_t esch5c = wasm_u8x16_splat(0x5c);
 
 		while (inIdx < end) {
-			const size_t clampedN = n > 64 ? 64 : n;
-			__m512i chars = load_partial_512i(clampedN);
+			const size_t clampedN = n > 16 ? 16 : n;
+			v128_t chars = load_partial_v128(clampedN);
 
-			__mmask64 mask1 = _mm512_cmpge_epu8_mask(chars, esch20);
-			mask1 = _mm512_mask_cmpneq_epu8_mask(mask1, chars, esch22);
-			mask1 = _mm512_mask_cmpneq_epu8_mask(mask1, chars, esch5c);
-			// TODO(perf) is it better to use two mask regs and & them later so
-			// there's no dependency chain on the cmps?
+			// Unlike SSE2, wasm has unsigned byte comparisons.
+			v128_t iseq = wasm_u8x16_lt(chars, esch20);
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, esch22));
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, esch5c));
 
-			uint64_t esRIdx = _tzcnt_u64(~mask1);
+			uint32_t mask = wasm_i8x16_bitmask(iseq);
+			uint32_t esRIdx = mask ? __builtin_ctz(mask) : 16;
 
 			if (esRIdx > clampedN) // No chars need escaping.
 				esRIdx = clampedN;
 
-			store_partial_512i(chars, esRIdx);
+			store_partial_v128(chars, esRIdx);
 			n -= esRIdx;
 			outIdx += esRIdx;
 			inIdx += esRIdx;
@@ -820,6 +3083,7 @@ private:
 		}
 		return false;
 	}
+#endif // __wasm_simd128__
 
 	// Writes the null-terminated string from in to out, escaping per JSON spec.
 	bool writeEscapedChars(Enabler<ISA::BASELINE>) {
@@ -844,6 +3108,7 @@ private:
 		return false;
 	}
 
+#ifdef B2J_X86
 	[[gnu::target("sse4.2")]]
 	bool writeEscapedChars(Enabler<ISA::SSE42>) {
 		// escape if (x < 0x20 || x == 0x22 || x == 0x5c)
@@ -855,7 +3120,7 @@ private:
 		const __m128i escapes = _mm_set_epi8(0,0, 0,0, 0,0, 0,0, 0,0, val.i,0x5d, 0x5b,0x23, 0x21,0x20);
 
 		while (inIdx < inLen) {
-			__m128i chars = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&in[inIdx])); // TODO this can overrun
+			__m128i chars = load_partial_128i(16);
 			int esRIdx = _mm_cmpistri(escapes, chars,
 				_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
 
@@ -926,41 +3191,621 @@ private:
 		return false;
 	}
 
-	[[gnu::target("avx512f,avx512bw,bmi,bmi2")]]
-	bool writeEscapedChars(Enabler<ISA::AVX512F>) {
-		__m512i esch20 = _mm512_set1_epu8(0x20);
-		__m512i esch22 = _mm512_set1_epu8(0x22);
-		__m512i esch5c = _mm512_set1_epu8(0x5c);
+	[[gnu::target("avx512f,avx512bw,bmi,bmi2")]]
+	bool writeEscapedChars(Enabler<ISA::AVX512F>) {
+		__m512i esch20 = _mm512_set1_epu8(0x20);
+		__m512i esch22 = _mm512_set1_epu8(0x22);
+		__m512i esch5c = _mm512_set1_epu8(0x5c);
+
+		while (inIdx < inLen) {
+			__m512i chars = load_partial_512i(64);
+
+			__mmask64 mask1 = _mm512_cmpge_epu8_mask(chars, esch20);
+			mask1 = _mm512_mask_cmpneq_epu8_mask(mask1, chars, esch22);
+			mask1 = _mm512_mask_cmpneq_epu8_mask(mask1, chars, esch5c);
+
+			uint32_t esRIdx = static_cast<uint32_t>(_tzcnt_u64(~mask1));
+
+			ENSURE_SPACE_OR_RETURN(esRIdx);
+			store_partial_512i(chars, esRIdx);
+			outIdx += esRIdx;
+			inIdx += esRIdx;
+
+			if (esRIdx < 64) {
+				if (in[inIdx] == 0)
+					return false;
+				
+				uint8_t xc;
+				uint8_t c = in[inIdx++];
+				if ((xc = getEscape(c))) { // single char escape
+					ENSURE_SPACE_OR_RETURN(2);
+					out[outIdx++] = '\\';
+					out[outIdx++] = xc;
+				} else { // c < 0x20, control
+					ENSURE_SPACE_OR_RETURN(6);
+					writeControlChar(c);
+				}
+			}
+		}
+		return false;
+	}
+#endif // B2J_X86
+
+#ifdef __wasm_simd128__
+	bool writeEscapedChars(Enabler<ISA::WASM_SIMD128>) {
+		// escape if (x < 0x20 || x == 0x22 || x == 0x5c)
+
+		const v128_t esch20 = wasm_u8x16_splat(0x20);
+		const v128_t esch22 = wasm_u8x16_splat(0x22);
+		const v128_t esch5c = wasm_u8x16_splat(0x5c);
+
+		while (inIdx < inLen) {
+			v128_t chars = load_partial_v128(16);
+
+			v128_t iseq = wasm_u8x16_lt(chars, esch20);
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, esch22));
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, esch5c));
+
+			uint32_t mask = wasm_i8x16_bitmask(iseq);
+			uint32_t esRIdx = mask ? __builtin_ctz(mask) : 16; // position of 0 *or* a char that needs to be escaped
+
+			ENSURE_SPACE_OR_RETURN(esRIdx);
+			store_partial_v128(chars, esRIdx);
+			outIdx += esRIdx;
+			inIdx += esRIdx;
+
+			if (esRIdx < 16) {
+				if (in[inIdx] == 0)
+					return false;
+
+				uint8_t xc;
+				uint8_t c = in[inIdx++];
+				if ((xc = getEscape(c))) { // single char escape
+					ENSURE_SPACE_OR_RETURN(2);
+					out[outIdx++] = '\\';
+					out[outIdx++] = xc;
+				} else { // c < 0x20, control
+					ENSURE_SPACE_OR_RETURN(6);
+					writeControlChar(c);
+				}
+			}
+		}
+		return false;
+	}
+#endif // __wasm_simd128__
+
+	// Like writeEscapedChars, but also validates UTF-8. Invalid sequences are
+	// an error or are replaced with U+FFFD, depending on invalidUtf8.
+	bool writeValidatedChars(size_t n, Enabler<ISA::BASELINE>) {
+		const size_t end = inIdx + n;
+		ENSURE_SPACE_OR_RETURN(n);
+		while (inIdx < end) {
+			if (LIKELY(in[inIdx] < 0x80)) {
+				if (writeEscapedRange(inIdx + 1, end))
+					return true;
+				continue;
+			}
+
+			const int len = utf8Sequence(in + inIdx, end - inIdx);
+			if (LIKELY(len > 0)) {
+				memcpy(out + outIdx, in + inIdx, len);
+				outIdx += len;
+				inIdx += len;
+			} else {
+				if (invalidUtf8 == InvalidUtf8::THROW)
+					RETURN_ERR("Invalid UTF-8");
+				inIdx += -len;
+				ENSURE_SPACE_OR_RETURN(end - inIdx + 3);
+				memcpy(out + outIdx, "\xef\xbf\xbd", 3);
+				outIdx += 3;
+			}
+		}
+		return false;
+	}
+
+	// The vectorized kernels only detect that a string is invalid. This redoes
+	// it with the scalar kernel, which errors or replaces.
+	NOINLINE(bool rewriteInvalidUtf8(size_t start, size_t outStart, size_t n)) {
+		if (invalidUtf8 == InvalidUtf8::THROW)
+			RETURN_ERR("Invalid UTF-8");
+		inIdx = start;
+		outIdx = outStart;
+		return writeValidatedChars(n, Enabler<ISA::BASELINE>{});
+	}
+
+	// The vectorized kernels work on whole blocks so that the validator can
+	// carry state from one to the next. Blocks without chars that need escaping
+	// (almost all) are stored as-is.
+#ifdef B2J_X86
+	[[gnu::target("sse4.2")]]
+	bool writeValidatedChars(size_t n, Enabler<ISA::SSE42>) {
+		const size_t start = inIdx;
+		const size_t outStart = outIdx;
+		const size_t end = inIdx + n;
+		ENSURE_SPACE_OR_RETURN(n);
+
+		// escape if (x < 0x20 || x == 0x22 || x == 0x5c)
+		// xor 0x80 to get unsigned comparison. https://stackoverflow.com/q/32945410/1218408
+		const __m128i esch20 = _mm_set1_epu8(0x20 ^ 0x80);
+		const __m128i esch22 = _mm_set1_epu8(0x22);
+		const __m128i esch5c = _mm_set1_epu8(0x5c);
+
+		__m128i prev = _mm_setzero_si128();
+		__m128i prevIncomplete = _mm_setzero_si128();
+		__m128i error = _mm_setzero_si128();
+
+		while (inIdx < end) {
+			const size_t blockLen = end - inIdx > 16 ? 16 : end - inIdx;
+			__m128i chars = load_partial_128i(blockLen);
+			if (blockLen < 16) // Zero the tail so it validates as ASCII.
+				chars = _mm_and_si128(chars, _mm_loadu_si128(reinterpret_cast<const __m128i*>(TAIL_MASK + 32 - blockLen)));
+
+			if (_mm_movemask_epi8(chars)) {
+				error = _mm_or_si128(error, utf8::errors(chars, prev));
+				prevIncomplete = utf8::incomplete(chars);
+			} else {
+				error = _mm_or_si128(error, prevIncomplete);
+				prevIncomplete = _mm_setzero_si128();
+			}
+			prev = chars;
+
+			__m128i iseq = _mm_cmpgt_epi8(esch20, _mm_xor_si128(chars, _mm_set1_epu8(0x80)));
+			iseq = _mm_or_si128(iseq, _mm_cmpeq_epi8(chars, esch22));
+			iseq = _mm_or_si128(iseq, _mm_cmpeq_epi8(chars, esch5c));
+			const uint32_t mask = _mm_movemask_epi8(iseq) & ((1u << blockLen) - 1);
+
+			if (LIKELY(mask == 0)) {
+				store_partial_128i(chars, blockLen);
+				outIdx += blockLen;
+				inIdx += blockLen;
+			} else if (writeEscapedRange(inIdx + blockLen, end)) {
+				return true;
+			}
+		}
+		error = _mm_or_si128(error, prevIncomplete);
+
+		if (UNLIKELY(!_mm_testz_si128(error, error)))
+			return rewriteInvalidUtf8(start, outStart, n);
+		return false;
+	}
+
+	[[gnu::target("avx2")]]
+	bool writeValidatedChars(size_t n, Enabler<ISA::AVX2>) {
+		const size_t start = inIdx;
+		const size_t outStart = outIdx;
+		const size_t end = inIdx + n;
+		ENSURE_SPACE_OR_RETURN(n);
+
+		// escape if (x < 0x20 || x == 0x22 || x == 0x5c)
+		// xor 0x80 to get unsigned comparison. https://stackoverflow.com/q/32945410/1218408
+		const __m256i esch20 = _mm256_set1_epu8(0x20 ^ 0x80);
+		const __m256i esch22 = _mm256_set1_epu8(0x22);
+		const __m256i esch5c = _mm256_set1_epu8(0x5c);
+
+		__m256i prev = _mm256_setzero_si256();
+		__m256i prevIncomplete = _mm256_setzero_si256();
+		__m256i error = _mm256_setzero_si256();
+
+		while (inIdx < end) {
+			const size_t blockLen = end - inIdx > 32 ? 32 : end - inIdx;
+			__m256i chars = load_partial_256i(blockLen);
+			if (blockLen < 32) // Zero the tail so it validates as ASCII.
+				chars = _mm256_and_si256(chars, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(TAIL_MASK + 32 - blockLen)));
+
+			if (_mm256_movemask_epi8(chars)) {
+				error = _mm256_or_si256(error, utf8::errors(chars, prev));
+				prevIncomplete = utf8::incomplete(chars);
+			} else {
+				error = _mm256_or_si256(error, prevIncomplete);
+				prevIncomplete = _mm256_setzero_si256();
+			}
+			prev = chars;
+
+			__m256i iseq = _mm256_cmpgt_epi8(esch20, _mm256_xor_si256(chars, _mm256_set1_epu8(0x80)));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, esch22));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, esch5c));
+			const uint64_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(iseq)) &
+				((uint64_t(1) << blockLen) - 1);
+
+			if (LIKELY(mask == 0)) {
+				store_partial_256i(chars, blockLen);
+				outIdx += blockLen;
+				inIdx += blockLen;
+			} else if (writeEscapedRange(inIdx + blockLen, end)) {
+				return true;
+			}
+		}
+		error = _mm256_or_si256(error, prevIncomplete);
+
+		if (UNLIKELY(!_mm256_testz_si256(error, error)))
+			return rewriteInvalidUtf8(start, outStart, n);
+		return false;
+	}
+#endif // B2J_X86
+
+#ifdef __wasm_simd128__
+	bool writeValidatedChars(size_t n, Enabler<ISA::WASM_SIMD128>) {
+		const size_t start = inIdx;
+		const size_t outStart = outIdx;
+		const size_t end = inIdx + n;
+		ENSURE_SPACE_OR_RETURN(n);
+
+		// escape if (x < 0x20 || x == 0x22 || x == 0x5c)
+		const v128_t esch20 = wasm_u8x16_splat(0x20);
+		const v128_t esch22 = wasm_u8x16_splat(0x22);
+		const v128_t esch5c = wasm_u8x16_splat(0x5c);
+
+		v128_t prev = wasm_u8x16_splat(0);
+		v128_t prevIncomplete = wasm_u8x16_splat(0);
+		v128_t error = wasm_u8x16_splat(0);
+
+		while (inIdx < end) {
+			const size_t blockLen = end - inIdx > 16 ? 16 : end - inIdx;
+			v128_t chars = load_partial_v128(blockLen);
+			if (blockLen < 16) // Zero the tail so it validates as ASCII.
+				chars = wasm_v128_and(chars, wasm_v128_load(TAIL_MASK + 32 - blockLen));
+
+			if (wasm_i8x16_bitmask(chars)) {
+				error = wasm_v128_or(error, utf8::errors(chars, prev));
+				prevIncomplete = utf8::incomplete(chars);
+			} else {
+				error = wasm_v128_or(error, prevIncomplete);
+				prevIncomplete = wasm_u8x16_splat(0);
+			}
+			prev = chars;
+
+			v128_t iseq = wasm_u8x16_lt(chars, esch20);
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, esch22));
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, esch5c));
+			const uint32_t mask = wasm_i8x16_bitmask(iseq) & ((1u << blockLen) - 1);
+
+			if (LIKELY(mask == 0)) {
+				store_partial_v128(chars, blockLen);
+				outIdx += blockLen;
+				inIdx += blockLen;
+			} else if (writeEscapedRange(inIdx + blockLen, end)) {
+				return true;
+			}
+		}
+		error = wasm_v128_or(error, prevIncomplete);
+
+		if (UNLIKELY(wasm_v128_any_true(error)))
+			return rewriteInvalidUtf8(start, outStart, n);
+		return false;
+	}
+#endif // __wasm_simd128__
+
+	// Writes the chars from inIdx to blockEnd (or a bit past it, to finish a
+	// multibyte sequence), escaping per ECMA-262 sec 24.5.2.2 and escapeFlags.
+	// Multibyte sequences are validated; invalid ones are an error if
+	// invalidUtf8 is THROW, are written as \ufffd if ESCAPE_NON_ASCII is set,
+	// and are otherwise replaced or copied per invalidUtf8. Space must already
+	// be ensured for the rest of the string, up to end.
+	bool writeProfiledRange(size_t blockEnd, size_t end) {
+		while (inIdx < blockEnd) {
+			const uint8_t c = in[inIdx];
+			if (c < 0x80) {
+				if ((escapeFlags & ESCAPE_HTML) && (c == '<' || c == '>' || c == '&')) {
+					ENSURE_SPACE_OR_RETURN(end - inIdx + 5);
+					inIdx++;
+					writeUnicodeEscape(c);
+				} else if (writeEscapedRange(inIdx + 1, end)) {
+					return true;
+				}
+				continue;
+			}
+
+			// Worst case is a 4-byte sequence written as a surrogate pair.
+			ENSURE_SPACE_OR_RETURN(end - inIdx + 12);
+			const int len = utf8Sequence(in + inIdx, end - inIdx);
+			uint32_t cp;
+			if (LIKELY(len > 0)) {
+				cp = decodeUtf8(in + inIdx, len);
+				if (!(escapeFlags & ESCAPE_NON_ASCII) &&
+					!((escapeFlags & ESCAPE_HTML) && (cp == 0x2028 || cp == 0x2029))) {
+					std::memcpy(out + outIdx, in + inIdx, len);
+					outIdx += len;
+					inIdx += len;
+					continue;
+				}
+				inIdx += len;
+			} else {
+				if (invalidUtf8 == InvalidUtf8::THROW)
+					RETURN_ERR("Invalid UTF-8");
+				if (!(escapeFlags & ESCAPE_NON_ASCII)) {
+					if (invalidUtf8 == InvalidUtf8::REPLACE) {
+						out[outIdx++] = 0xef;
+						out[outIdx++] = 0xbf;
+						out[outIdx++] = 0xbd;
+					} else {
+						std::memcpy(out + outIdx, in + inIdx, -len);
+						outIdx += -len;
+					}
+					inIdx += -len;
+					continue;
+				}
+				cp = 0xfffd;
+				inIdx += -len;
+			}
+
+			if (cp >= 0x10000) {
+				cp -= 0x10000;
+				writeUnicodeEscape(0xd800 | (cp >> 10));
+				writeUnicodeEscape(0xdc00 | (cp & 0x3ff));
+			} else {
+				writeUnicodeEscape(cp);
+			}
+		}
+		return false;
+	}
+
+	// Writes a populated document's JSON. AddItems transcodes items without
+	// escapeFlags, so this escapes them; only strings can hold characters
+	// that need it, so the JSON's structure is left alone.
+	bool writePopulated(const SizedBuffer& doc) {
+		ENSURE_SPACE_OR_RETURN(doc.size);
+		if (!escapeFlags) {
+			memcpy(out + outIdx, doc.data, doc.size);
+			outIdx += doc.size;
+			return false;
+		}
+
+		const uint8_t* p = doc.data;
+		const uint8_t* const end = p + doc.size;
+		while (p < end) {
+			const uint8_t c = *p;
+			if (c < 0x80) {
+				if ((escapeFlags & ESCAPE_HTML) && (c == '<' || c == '>' || c == '&')) {
+					ENSURE_SPACE_OR_RETURN(end - p + 5);
+					writeUnicodeEscape(c);
+				} else {
+					out[outIdx++] = c;
+				}
+				p++;
+				continue;
+			}
+
+			// Worst case is a 4-byte sequence written as a surrogate pair.
+			ENSURE_SPACE_OR_RETURN(end - p + 12);
+			const int len = utf8Sequence(p, end - p);
+			uint32_t cp;
+			if (LIKELY(len > 0)) {
+				cp = decodeUtf8(p, len);
+				if (!(escapeFlags & ESCAPE_NON_ASCII) &&
+					!((escapeFlags & ESCAPE_HTML) && (cp == 0x2028 || cp == 0x2029))) {
+					memcpy(out + outIdx, p, len);
+					outIdx += len;
+					p += len;
+					continue;
+				}
+				p += len;
+			} else {
+				if (invalidUtf8 == InvalidUtf8::THROW)
+					RETURN_ERR("Invalid UTF-8");
+				if (!(escapeFlags & ESCAPE_NON_ASCII)) {
+					if (invalidUtf8 == InvalidUtf8::REPLACE) {
+						memcpy(out + outIdx, "\xef\xbf\xbd", 3);
+						outIdx += 3;
+					} else {
+						memcpy(out + outIdx, p, -len);
+						outIdx += -len;
+					}
+					p += -len;
+					continue;
+				}
+				cp = 0xfffd;
+				p += -len;
+			}
+
+			if (cp >= 0x10000) {
+				cp -= 0x10000;
+				writeUnicodeEscape(0xd800 | (cp >> 10));
+				writeUnicodeEscape(0xdc00 | (cp & 0x3ff));
+			} else {
+				writeUnicodeEscape(cp);
+			}
+		}
+		return false;
+	}
+
+	// Compare constants for the writeProfiledChars kernels. Bytes below lt
+	// (after xor with flip) and bytes equal to quote, backslash, (x | 2) == ltgt
+	// or amp/e2 need the scalar path. Unused compares repeat '"' rather than
+	// branching in the loop, so the kernel costs the same for every profile.
+	struct ProfileConsts {
+		uint8_t flip, lt, ltgtOr, ltgt, amp, e2;
+	};
+
+	ProfileConsts profileConsts() const {
+		// Non-ASCII bytes must be seen to escape or validate them. Otherwise
+		// compare unsigned (by flipping the sign bit) so that they're copied.
+		const bool high = (escapeFlags & ESCAPE_NON_ASCII) || invalidUtf8 != InvalidUtf8::COPY;
+		const bool html = escapeFlags & ESCAPE_HTML;
+		return {
+			uint8_t(high ? 0 : 0x80),
+			uint8_t(high ? 0x20 : 0xa0),
+			uint8_t(html ? 2 : 0),
+			uint8_t(html ? '>' : '"'), // '<' | 2 == '>'
+			uint8_t(html ? '&' : '"'),
+			// U+2028 and U+2029 are E2 80 A8 and E2 80 A9.
+			uint8_t(html && !high ? 0xe2 : '"')
+		};
+	}
+
+	// Like writeEscapedChars, but also escapes per escapeFlags.
+	bool writeProfiledChars(size_t n, Enabler<ISA::BASELINE>) {
+		ENSURE_SPACE_OR_RETURN(n);
+		return writeProfiledRange(inIdx + n, inIdx + n);
+	}
+
+#ifdef B2J_X86
+	[[gnu::target("sse2,bmi")]]
+	bool writeProfiledChars(size_t n, Enabler<ISA::SSE2>) {
+		const size_t end = inIdx + n;
+		ENSURE_SPACE_OR_RETURN(n);
+
+		const ProfileConsts k = profileConsts();
+		const __m128i flip = _mm_set1_epu8(k.flip);
+		const __m128i eschLt = _mm_set1_epu8(k.lt);
+		const __m128i esch22 = _mm_set1_epu8(0x22);
+		const __m128i esch5c = _mm_set1_epu8(0x5c);
+		const __m128i eschLtgtOr = _mm_set1_epu8(k.ltgtOr);
+		const __m128i eschLtgt = _mm_set1_epu8(k.ltgt);
+		const __m128i eschAmp = _mm_set1_epu8(k.amp);
+		const __m128i eschE2 = _mm_set1_epu8(k.e2);
+
+		while (inIdx < end) {
+			const size_t clampedN = end - inIdx > 16 ? 16 : end - inIdx;
+			__m128i chars = load_partial_128i(clampedN);
+
+			__m128i iseq = _mm_cmpgt_epi8(eschLt, _mm_xor_si128(chars, flip));
+			iseq = _mm_or_si128(iseq, _mm_cmpeq_epi8(chars, esch22));
+			iseq = _mm_or_si128(iseq, _mm_cmpeq_epi8(chars, esch5c));
+			iseq = _mm_or_si128(iseq, _mm_cmpeq_epi8(_mm_or_si128(chars, eschLtgtOr), eschLtgt));
+			iseq = _mm_or_si128(iseq, _mm_cmpeq_epi8(chars, eschAmp));
+			iseq = _mm_or_si128(iseq, _mm_cmpeq_epi8(chars, eschE2));
+
+			uint32_t mask = _mm_movemask_epi8(iseq);
+			uint32_t esRIdx = _tzcnt_u32(mask);
+
+			if (esRIdx > clampedN) // No chars need escaping.
+				esRIdx = clampedN;
+
+			store_partial_128i(chars, esRIdx);
+			outIdx += esRIdx;
+			inIdx += esRIdx;
+
+			if (esRIdx < clampedN && writeProfiledRange(inIdx + 1, end))
+				return true;
+		}
+		return false;
+	}
+
+	[[gnu::target("avx2,bmi")]]
+	bool writeProfiledChars(size_t n, Enabler<ISA::AVX2>) {
+		const size_t end = inIdx + n;
+		ENSURE_SPACE_OR_RETURN(n);
+
+		const ProfileConsts k = profileConsts();
+		const __m256i flip = _mm256_set1_epu8(k.flip);
+		const __m256i eschLt = _mm256_set1_epu8(k.lt);
+		const __m256i esch22 = _mm256_set1_epu8(0x22);
+		const __m256i esch5c = _mm256_set1_epu8(0x5c);
+		const __m256i eschLtgtOr = _mm256_set1_epu8(k.ltgtOr);
+		const __m256i eschLtgt = _mm256_set1_epu8(k.ltgt);
+		const __m256i eschAmp = _mm256_set1_epu8(k.amp);
+		const __m256i eschE2 = _mm256_set1_epu8(k.e2);
+
+		while (inIdx < end) {
+			const size_t clampedN = end - inIdx > 32 ? 32 : end - inIdx;
+			__m256i chars = load_partial_256i(clampedN);
+
+			__m256i iseq = _mm256_cmpgt_epi8(eschLt, _mm256_xor_si256(chars, flip));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, esch22));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, esch5c));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(_mm256_or_si256(chars, eschLtgtOr), eschLtgt));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, eschAmp));
+			iseq = _mm256_or_si256(iseq, _mm256_cmpeq_epi8(chars, eschE2));
+
+			uint32_t mask = _mm256_movemask_epi8(iseq);
+			uint32_t esRIdx = _tzcnt_u32(mask);
+
+			if (esRIdx > clampedN) // No chars need escaping.
+				esRIdx = clampedN;
+
+			store_partial_256i(chars, esRIdx);
+			outIdx += esRIdx;
+			inIdx += esRIdx;
+
+			if (esRIdx < clampedN && writeProfiledRange(inIdx + 1, end))
+				return true;
+		}
+		return false;
+	}
+#endif // B2J_X86
+
+#ifdef __wasm_simd128__
+	bool writeProfiledChars(size_t n, Enabler<ISA::WASM_SIMD128>) {
+		const size_t end = inIdx + n;
+		ENSURE_SPACE_OR_RETURN(n);
 
-		while (inIdx < inLen) {
-			__m512i chars = load_partial_512i(64);
+		const ProfileConsts k = profileConsts();
+		const v128_t flip = wasm_u8x16_splat(k.flip);
+		const v128_t eschLt = wasm_u8x16_splat(k.lt);
+		const v128_t esch22 = wasm_i8x16_splat(0x22);
+		const v128_t esch5c = wasm_i8x16_splat(0x5c);
+		const v128_t eschLtgtOr = wasm_u8x16_splat(k.ltgtOr);
+		const v128_t eschLtgt = wasm_u8x16_splat(k.ltgt);
+		const v128_t eschAmp = wasm_u8x16_splat(k.amp);
+		const v128_t eschE2 = wasm_u8x16_splat(k.e2);
 
-			__mmask64 mask1 = _mm512_cmpge_epu8_mask(chars, esch20);
-			mask1 = _mm512_mask_cmpneq_epu8_mask(mask1, chars, esch22);
-			mask1 = _mm512_mask_cmpneq_epu8_mask(mask1, chars, esch5c);
+		while (inIdx < end) {
+			const size_t clampedN = end - inIdx > 16 ? 16 : end - inIdx;
+			v128_t chars = load_partial_v128(clampedN);
 
-			uint32_t esRIdx = static_cast<uint32_t>(_tzcnt_u64(~mask1));
+			v128_t iseq = wasm_i8x16_lt(wasm_v128_xor(chars, flip), eschLt);
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, esch22));
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, esch5c));
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(wasm_v128_or(chars, eschLtgtOr), eschLtgt));
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, eschAmp));
+			iseq = wasm_v128_or(iseq, wasm_i8x16_eq(chars, eschE2));
 
-			ENSURE_SPACE_OR_RETURN(esRIdx);
-			store_partial_512i(chars, esRIdx);
+			uint32_t mask = wasm_i8x16_bitmask(iseq);
+			uint32_t esRIdx = mask ? __builtin_ctz(mask) : 16;
+
+			if (esRIdx > clampedN) // No chars need escaping.
+				esRIdx = clampedN;
+
+			store_partial_v128(chars, esRIdx);
 			outIdx += esRIdx;
 			inIdx += esRIdx;
 
-			if (esRIdx < 64) {
-				if (in[inIdx] == 0)
-					return false;
-				
-				uint8_t xc;
-				uint8_t c = in[inIdx++];
-				if ((xc = getEscape(c))) { // single char escape
-					ENSURE_SPACE_OR_RETURN(2);
-					out[outIdx++] = '\\';
-					out[outIdx++] = xc;
-				} else { // c < 0x20, control
-					ENSURE_SPACE_OR_RETURN(6);
-					writeControlChar(c);
-				}
-			}
+			if (esRIdx < clampedN && writeProfiledRange(inIdx + 1, end))
+				return true;
+		}
+		return false;
+	}
+#endif // __wasm_simd128__
+
+	// Writes n chars of a string or key in one of the non-default modes.
+	bool writeCheckedChars(size_t n) {
+		if (escapeFlags)
+			return writeProfiledChars(n, Enabler<isa>{});
+		return writeValidatedChars(n, Enabler<isa>{});
+	}
+
+	// Writes n chars of a string value.
+	inline bool writeStringChars(size_t n) {
+		if (UNLIKELY(invalidUtf8 != InvalidUtf8::COPY || escapeFlags))
+			return writeCheckedChars(n);
+		return writeEscapedChars(n, Enabler<isa>{});
+	}
+
+	// Like writeStringChars, for 1 to STRING_CACHE_MAX chars. Copies the
+	// escaped output from stringCache if the string is there, or else writes
+	// it and caches it.
+	bool writeCachedChars(size_t n) {
+		const uint8_t* str = in + inIdx;
+		StringSlot& slot = stringCache[hashBytes(str, n) & (stringCache.size() - 1)];
+		if (slot.len == n && memcmp(slot.raw, str, n) == 0) {
+			stringHits++;
+			ENSURE_SPACE_OR_RETURN(slot.escLen);
+			memcpy(out + outIdx, slot.esc, slot.escLen);
+			outIdx += slot.escLen;
+			inIdx += n;
+			return false;
+		}
+
+		stringMisses++;
+		const size_t start = outIdx;
+		if (writeStringChars(n))
+			return true;
+		const size_t escLen = outIdx - start;
+		if (escLen <= STRING_CACHE_MAX_ESCAPED) {
+			slot.len = static_cast<uint8_t>(n);
+			slot.escLen = static_cast<uint8_t>(escLen);
+			memcpy(slot.raw, str, n);
+			memcpy(slot.esc, out + start, escLen);
 		}
 		return false;
 	}
@@ -979,6 +3824,7 @@ private:
 	// TODO(perf) SSE2: arithmetic (nib + (nib < 10 ? 48 : 87))
 	// TODO(perf) SSSE3: 128-bit pshufb
 
+#ifdef B2J_X86
 	[[gnu::target("avx2")]]
 	inline void transcodeObjectId(Enabler<ISA::AVX2>) {
 		__m128i a = load_partial_128i(12);
@@ -1021,11 +3867,39 @@ private:
 		outIdx += 24;
 		out[outIdx++] = '"';
 	}
+#endif // B2J_X86
+
+#ifdef __wasm_simd128__
+	inline void transcodeObjectId(Enabler<ISA::WASM_SIMD128>) {
+		v128_t a = load_partial_v128(12);
+		inIdx += 12;
+
+		// Same technique as the AVX2 version, but 128 bits wide: split into
+		// nibbles, interleave hi/lo, then look up the hex digit with swizzle.
+		const v128_t HEX_LUT = wasm_i8x16_make(
+			'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+
+		v128_t hi = wasm_u8x16_shr(a, 4);
+		v128_t lo = wasm_v128_and(a, wasm_u8x16_splat(0b1111));
+		v128_t b0 = wasm_i8x16_shuffle(hi, lo, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+		v128_t b1 = wasm_i8x16_shuffle(hi, lo, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+		b0 = wasm_i8x16_swizzle(HEX_LUT, b0);
+		b1 = wasm_i8x16_swizzle(HEX_LUT, b1);
+
+		// Caller ensured 26 bytes of space; this writes exactly 26.
+		out[outIdx++] = '"';
+		wasm_v128_store(out + outIdx, b0);
+		wasm_v128_store64_lane(out + outIdx + 16, b1, 0);
+		outIdx += 24;
+		out[outIdx++] = '"';
+	}
+#endif // __wasm_simd128__
+
+	// Enters the document or array at inIdx, whose key path is currentPath.
+	bool pushFrame(bool isArray) {
+		if (UNLIKELY(frames.size() == maxDepth))
+			RETURN_ERR("Maximum nesting depth exceeded");
 
-	bool getMissingIds(
-		bool isArray,
-		std::string baseKey = ""
-	) {
 		const int32_t size = readLE<int32_t>();
 		if (UNLIKELY(size < 5))
 			RETURN_ERR("BSON size must be >= 5");
@@ -1033,15 +3907,294 @@ private:
 		if (UNLIKELY(size + inIdx - 4 > inLen))
 			RETURN_ERR("BSON size exceeds input length");
 
-		int32_t arrIdx = 0;
+		// Keys are scanned up to their null terminator without bounds checks;
+		// this stops them within the input.
+		if (UNLIKELY(in[inIdx + size - 5] != 0))
+			RETURN_ERR("BSON document must end with a null byte");
+
+		frames.push_back({inIdx + size - 4, currentPath.size(), 0, isArray});
+		return false;
+	}
+
+	// Leaves the current document, having read its terminator.
+	bool popFrame() {
+		if (UNLIKELY(inIdx != frames.back().end))
+			RETURN_ERR("BSON size doesn't match document");
+		if (frames.back().sortedStart != UNSORTED)
+			sortedElems.resize(frames.back().sortedStart);
+		frames.pop_back();
+		return false;
+	}
+
+	// Records the elements of the object that was just entered, at inIdx, in
+	// key byte order, for the walker to visit in that order. Elements with
+	// equal keys stay in document order.
+	bool sortFrame() {
+		Frame& frame = frames.back();
+		const size_t start = sortedElems.size();
+		frame.seeks = true;
+		frame.sortedStart = static_cast<uint32_t>(start);
+		size_t i = inIdx;
+		const size_t last = frame.end - 1; // the terminator
+		while (i < last) {
+			const uint8_t type = in[i];
+			if (UNLIKELY(type == 0))
+				RETURN_ERR("BSON size doesn't match document");
+			// The terminator bounds the key.
+			const size_t keyLen = static_cast<const uint8_t*>(memchr(in + i + 1, 0, last - i)) - (in + i + 1);
+			const size_t valueStart = i + 1 + keyLen + 1;
+			if (UNLIKELY(valueStart > last))
+				RETURN_ERR("Truncated BSON (in key)");
+			size_t size;
+			if (const char* e = valueSize(type, in + valueStart, last - valueStart, size))
+				RETURN_ERR(e);
+			sortedElems.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(keyLen)});
+			if (UNLIKELY(!arraySlices.empty()) && type == BSON_DATA_ARRAY) {
+				// Its count sibling is sorted among the keys too.
+				const size_t pathLen = currentPath.size();
+				if (pathLen)
+					currentPath += '.';
+				currentPath.append(reinterpret_cast<const char*>(in + i + 1), keyLen);
+				auto it = arraySlices.find(currentPath);
+				currentPath.resize(pathLen);
+				if (it != arraySlices.end() && !it->second.countName.empty())
+					sortedElems.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(keyLen), &it->second});
+			}
+			i = valueStart + size;
+		}
+		if (sortedElems.size() - start < 2)
+			return false;
+
+		auto less = [this](const SortedElem& a, const SortedElem& b) {
+			const uint8_t* aKey = a.count ? reinterpret_cast<const uint8_t*>(a.count->countName.data()) : in + a.offset + 1;
+			const uint8_t* bKey = b.count ? reinterpret_cast<const uint8_t*>(b.count->countName.data()) : in + b.offset + 1;
+			const size_t aLen = a.count ? a.count->countName.size() : a.keyLen;
+			const size_t bLen = b.count ? b.count->countName.size() : b.keyLen;
+			const int c = memcmp(aKey, bKey, std::min(aLen, bLen));
+			return c < 0 || (c == 0 && aLen < bLen);
+		};
+		SortedElem* first = sortedElems.data() + start;
+		SortedElem* end = sortedElems.data() + sortedElems.size();
+		if (end - first <= 16) {
+			// Insertion sort; small objects are the common case.
+			for (SortedElem* it = first + 1; it < end; it++) {
+				const SortedElem e = *it;
+				SortedElem* j = it;
+				for (; j > first && less(e, j[-1]); j--)
+					*j = j[-1];
+				*j = e;
+			}
+		} else if (!std::is_sorted(first, end, less)) {
+			std::stable_sort(first, end, less);
+		}
+		return false;
+	}
+
+	// Applies the arraySlices entry for currentPath, if any, to the array that
+	// was just entered, at inIdx: skips its first elements by their sizes.
+	// Arrays in an array share its path, but only the outermost is sliced.
+	bool sliceFrame() {
+		if (frames.size() > 1 && frames[frames.size() - 2].isArray)
+			return false;
+		auto it = arraySlices.find(currentPath);
+		if (it == arraySlices.end())
+			return false;
+		Frame& frame = frames.back();
+		frame.seeks = true;
+		frame.slice = &it->second;
+		while (frame.arrIdx < frame.slice->skip && in[inIdx] != 0) {
+			if (skipElement(frame))
+				return true;
+		}
+		frame.firstIdx = frame.arrIdx;
+		return false;
+	}
+
+	// Skips the array element at inIdx without transcoding it. Keys of array
+	// elements are their index, so only the value's size has to be read.
+	bool skipElement(Frame& frame) {
+		const size_t valueStart = inIdx + nDigits(frame.arrIdx) + 1;
+		const size_t last = frame.end - 1; // the terminator
+		if (UNLIKELY(valueStart > last))
+			RETURN_ERR("Truncated BSON");
+		size_t size;
+		if (const char* e = valueSize(in[inIdx], in + valueStart, last - valueStart, size))
+			RETURN_ERR(e);
+		inIdx = valueStart + size;
+		frame.arrIdx++;
+		return false;
+	}
+
+	// For a sorted object or sliced array, moves inIdx to the next element
+	// to write, or to the terminator after the last one.
+	bool seek(Frame& frame) {
+		if (!frame.isArray) {
+			while (const SortedElem* count = countAt(frame)) {
+				if (writeSortedCount(*count, frame.arrIdx != 0))
+					return true;
+				frame.arrIdx++;
+			}
+			const size_t i = frame.sortedStart + frame.arrIdx;
+			inIdx = i < sortedElems.size() ? sortedElems[i].offset : frame.end - 1;
+			return false;
+		}
+		if (frame.arrIdx - frame.firstIdx < frame.slice->limit)
+			return false;
+		if (frame.slice->countKey.empty()) {
+			inIdx = frame.end - 1;
+			return false;
+		}
+		// Counts the rest for writeCount.
+		while (in[inIdx] != 0) {
+			if (skipElement(frame))
+				return true;
+		}
+		return false;
+	}
+
+	// Returns the count sibling that's next to write in the sorted object,
+	// or nullptr.
+	const SortedElem* countAt(const Frame& frame) const {
+		const size_t i = frame.sortedStart + frame.arrIdx;
+		return i < sortedElems.size() && UNLIKELY(sortedElems[i].count != nullptr) ? &sortedElems[i] : nullptr;
+	}
+
+	// Sets count to the length of the sliced array of a count sibling in a
+	// sorted object, counting its elements by their sizes.
+	bool sortedCount(const SortedElem& elem, int32_t& count) {
+		const size_t valueStart = elem.offset + 1 + elem.keyLen + 1;
+		const size_t saved = inIdx;
+		inIdx = valueStart;
+		// sortFrame() checked the array's size.
+		Frame array = {valueStart + readLE<int32_t>(), 0, 0, true};
+		while (in[inIdx] != 0) {
+			if (skipElement(array))
+				return true;
+		}
+		inIdx = saved;
+		count = array.arrIdx;
+		return false;
+	}
+
+	// Writes the count sibling of a sliced array in a sorted object at its
+	// sorted position, which may come before the array.
+	bool writeSortedCount(const SortedElem& elem, bool comma) {
+		const std::string& key = elem.count->countKey;
+		int32_t count;
+		if (sortedCount(elem, count))
+			return true;
+		ENSURE_SPACE_OR_RETURN(1 + key.size() + INT_BUF_DIGS<int32_t>);
+		if (comma)
+			out[outIdx++] = ',';
+		memcpy(out + outIdx, key.data(), key.size());
+		outIdx += key.size();
+		uint8_t temp[INT_BUF_DIGS<int32_t>];
+		uint8_t* temp_p = temp;
+		const size_t n = fast_itoa(temp_p, count);
+		memcpy(out + outIdx, temp_p, n);
+		outIdx += n;
+		return false;
+	}
+
+	// Writes the count sibling of a sliced array that was just closed, if
+	// it's an object member. An array element or the top-level value has no
+	// siblings to add it to, and a sorted object writes it in key order (see
+	// writeSortedCount()).
+	bool writeCount(const Frame& frame) {
+		const std::string& key = frame.slice->countKey;
+		if (key.empty() || frames.size() < 2 || frames[frames.size() - 2].isArray ||
+			frames[frames.size() - 2].sortedStart != UNSORTED)
+			return false;
+		ENSURE_SPACE_OR_RETURN(1 + key.size() + INT_BUF_DIGS<int32_t>);
+		out[outIdx++] = ',';
+		memcpy(out + outIdx, key.data(), key.size());
+		outIdx += key.size();
+		uint8_t temp[INT_BUF_DIGS<int32_t>];
+		uint8_t* temp_p = temp;
+		const size_t n = fast_itoa(temp_p, frame.arrIdx);
+		memcpy(out + outIdx, temp_p, n);
+		outIdx += n;
+		return false;
+	}
+
+	// Sets currentPath to the path of the key from keyStart to inIdx.
+	inline void setPath(const Frame& frame, size_t keyStart) {
+		currentPath.resize(frame.pathLen);
+		if (frame.pathLen)
+			currentPath += '.';
+		currentPath.append(reinterpret_cast<const char*>(in + keyStart), inIdx - keyStart);
+	}
+
+	// Records the ObjectId at inIdx, whose key path is currentPath, if it
+	// should be populated but isn't in populateInfo.
+	inline void recordMissingId() {
+		if (!populateInfo)
+			return;
+		auto idMapForPath = populateInfo->paths.find(currentPath);
+		if (idMapForPath == populateInfo->paths.end())
+			return;
+		ObjectId id;
+		memcpy(id.data(), in + inIdx, 12);
+		if (idMapForPath->second.find(id) == idMapForPath->second.end()) {
+			populateInfo->missingIds.try_emplace(currentPath, ObjectIdSet())
+				.first->second.insert(id);
+		}
+	}
+
+	// Same as getMissingIds(false), but reads the index's tape instead of
+	// parsing. Frames' `end`s are tape indices.
+	bool getMissingIds(const BsonIndex& index) {
+		const std::vector<TapeEntry>& tape = index.tape;
+		frames.clear();
+		currentPath.clear();
+		frames.push_back({tape[0].next, 0, 0, false});
+
+		for (size_t i = 1; i < tape.size(); i++) {
+			while (i >= frames.back().end)
+				frames.pop_back();
+			const TapeEntry& entry = tape[i];
+			const Frame& frame = frames.back();
+			currentPath.resize(frame.pathLen);
+			if (!frame.isArray) {
+				if (frame.pathLen)
+					currentPath += '.';
+				currentPath.append(reinterpret_cast<const char*>(in + entry.keyOffset),
+					entry.valueOffset - entry.keyOffset - 1);
+			}
+
+			if (entry.type == BSON_DATA_OBJECT || entry.type == BSON_DATA_ARRAY) {
+				if (UNLIKELY(frames.size() == maxDepth))
+					RETURN_ERR("Maximum nesting depth exceeded");
+				frames.push_back({entry.next, currentPath.size(), 0, entry.type == BSON_DATA_ARRAY});
+			} else if (entry.type == BSON_DATA_OID) {
+				inIdx = entry.valueOffset;
+				recordMissingId();
+			}
+		}
+		return false;
+	}
+
+	bool getMissingIds(bool isArray) {
+		frames.clear();
+		currentPath.clear();
+		if (pushFrame(isArray))
+			return true;
 
 		while (true) {
+			Frame& frame = frames.back();
 			const uint8_t elementType = in[inIdx++];
-			if (UNLIKELY(elementType == 0))
-				break;
+			if (UNLIKELY(elementType == 0)) {
+				if (popFrame())
+					return true;
+				if (frames.empty())
+					return false;
+				continue;
+			}
 
-			if (isArray) {
-				inIdx += nDigits(arrIdx);
+			if (frame.isArray) {
+				inIdx += nDigits(frame.arrIdx);
+				// Elements share the array's path.
+				currentPath.resize(frame.pathLen);
 			} else {
 				size_t keyStart = inIdx;
 				size_t keyEnd = inIdx;
@@ -1052,11 +4205,10 @@ private:
 					RETURN_ERR("Truncated BSON (in key)");
 
 				inIdx = keyEnd;
-				currentPath = baseKey.empty() ?
-					std::string(in + keyStart, in + inIdx) :
-					baseKey + "." + std::string(in + keyStart, in + inIdx);
+				setPath(frame, keyStart);
 				inIdx++; // skip null terminator
 			}
+			frame.arrIdx++;
 
 			switch (elementType) {
 			case BSON_DATA_STRING: {
@@ -1068,19 +4220,7 @@ private:
 			}
 			case BSON_DATA_OID: {
 				if (LIKELY(inIdx + 12 <= inLen)) {
-					if (populateInfo) {
-						auto idMapForPath = populateInfo->paths.find(currentPath);
-						if (idMapForPath != populateInfo->paths.end()) {
-							ObjectId id;
-							memcpy(id.data(), in + inIdx, 12);
-							auto doc = idMapForPath->second.find(id);
-							if (doc == idMapForPath->second.end()) {
-								populateInfo->missingIds.try_emplace(currentPath, ObjectIdSet())
-									.first->second.insert(id);
-							}
-						}
-					}
-
+					recordMissingId();
 					inIdx += 12;
 					break;
 				} else
@@ -1107,20 +4247,11 @@ private:
 					RETURN_ERR("Truncated BSON (in Boolean)");
 				break;
 			}
-			case BSON_DATA_OBJECT: {
-				// Bounds check in head of this function.
-				if (UNLIKELY((getMissingIds(false, currentPath))))
-					return true;
-				break;
-			}
+			case BSON_DATA_OBJECT:
 			case BSON_DATA_ARRAY: {
-				// Bounds check in head of this function.
-				if (UNLIKELY((getMissingIds(true, currentPath))))
-					return true;
-				if (UNLIKELY(in[inIdx - 1] != 0)) {
-					err = "Invalid array terminator byte";
+				// Invalidates frame.
+				if (UNLIKELY(pushFrame(elementType == BSON_DATA_ARRAY)))
 					return true;
-				}
 				break;
 			}
 			case BSON_DATA_NULL:
@@ -1141,257 +4272,575 @@ private:
 			default:
 				RETURN_ERR("Unknown BSON type");
 			}
-
-			arrIdx++;
 		}
-
-		return false;
 	}
 
-	bool transcodeObject(
-		bool isArray,
-		std::string baseKey = ""
-	) {
-		const int32_t size = readLE<int32_t>();
-		if (UNLIKELY(size < 5))
-			RETURN_ERR("BSON size must be >= 5");
-
-		if (UNLIKELY(size + inIdx - 4 > inLen))
-			RETURN_ERR("BSON size exceeds input length");
-
-		int32_t arrIdx = 0;
+	// Walks the document with an explicit stack of frames rather than
+	// recursion, so nesting depth costs heap, not native stack, and is
+	// limited by maxDepth.
+	bool transcodeObject(bool isArray) {
+		currentPath.clear();
+		return transcodeDocument(isArray);
+	}
 
+	// Transcodes the document or array at inIdx, whose key path is
+	// currentPath.
+	bool transcodeDocument(bool isArray) {
+		frames.clear();
+		sortedElems.clear();
+		if (pushFrame(isArray) || (canonical && !isArray && sortFrame()) ||
+			(isArray && !arraySlices.empty() && sliceFrame()))
+			return true;
 		ENSURE_SPACE_OR_RETURN(1);
 		out[outIdx++] = isArray ? '[' : '{';
+		return transcodeFrames(0);
+	}
 
+	// Continues transcoding until `base` frames are left open.
+	bool transcodeFrames(size_t base) {
 		while (true) {
+			if (UNLIKELY(outIdx >= flushAt) && compressOutput(false))
+				return true;
+			Frame& frame = frames.back();
+			if (UNLIKELY(frame.seeks) && seek(frame))
+				return true;
 			const uint8_t elementType = in[inIdx++];
-			if (UNLIKELY(elementType == 0))
-				break;
+			if (UNLIKELY(elementType == 0)) {
+				ENSURE_SPACE_OR_RETURN(1);
+				out[outIdx++] = frame.isArray ? ']' : '}';
+				if (UNLIKELY(frame.slice != nullptr) && writeCount(frame))
+					return true;
+				if (popFrame())
+					return true;
+				if (frames.size() == base)
+					return false;
+				continue;
+			}
 
-			if (LIKELY(arrIdx)) {
+			if (LIKELY(frame.arrIdx != frame.firstIdx)) {
 				ENSURE_SPACE_OR_RETURN(1);
 				out[outIdx++] = ',';
 			}
 
 			// Write name
-			if (isArray) {
-				inIdx += nDigits(arrIdx);
-			} else {
-				ENSURE_SPACE_OR_RETURN(1);
-				out[outIdx++] = '"';
-				size_t keyStart = inIdx;
-				writeEscapedChars(Enabler<isa>{});
-				currentPath = baseKey.empty() ?
-					std::string(in + keyStart, in + inIdx) :
-					baseKey + "." + std::string(in + keyStart, in + inIdx);
-				inIdx++; // skip null terminator
-				ENSURE_SPACE_OR_RETURN(2);
-				memcpy(out + outIdx, "\":", 2);
-				outIdx += 2;
+			if (frame.isArray) {
+				inIdx += nDigits(frame.arrIdx);
+				// Elements share the array's path.
+				currentPath.resize(frame.pathLen);
+			} else if (writeKey(frame)) {
+				return true;
 			}
+			frame.arrIdx++;
 
-			switch (elementType) {
-			case BSON_DATA_STRING: {
-				const int32_t size = readLE<int32_t>();
-				if (UNLIKELY(size <= 0 || static_cast<size_t>(size) > inLen - inIdx))
-					RETURN_ERR("Bad string length");
+			if (UNLIKELY(writeValue(elementType)))
+				return true;
+		}
+	}
 
-				ENSURE_SPACE_OR_RETURN(1);
-				out[outIdx++] = '"';
-				writeEscapedChars(size - 1, Enabler<isa>{});
-				inIdx++; // skip null terminator
-				ENSURE_SPACE_OR_RETURN(1);
-				out[outIdx++] = '"';
-				break;
+	// Writes the key at inIdx and the colon after it, and sets currentPath.
+	inline bool writeKey(const Frame& frame) {
+		ENSURE_SPACE_OR_RETURN(1);
+		out[outIdx++] = '"';
+		size_t keyStart = inIdx;
+		if (UNLIKELY(invalidUtf8 != InvalidUtf8::COPY || escapeFlags)) {
+			const void* nul = memchr(in + inIdx, 0, inLen - inIdx);
+			if (UNLIKELY(nul == nullptr))
+				RETURN_ERR("Truncated BSON (in key)");
+			const size_t keyLen = static_cast<const uint8_t*>(nul) - (in + inIdx);
+			if (writeCheckedChars(keyLen))
+				return true;
+		} else if (writeEscapedChars(Enabler<isa>{})) {
+			return true;
+		}
+		setPath(frame, keyStart);
+		inIdx++; // skip null terminator
+		ENSURE_SPACE_OR_RETURN(2);
+		memcpy(out + outIdx, "\":", 2);
+		outIdx += 2;
+		return false;
+	}
+
+	// Writes the value of type elementType at inIdx. Documents and arrays are
+	// only opened.
+	inline bool writeValue(uint8_t elementType) {
+		switch (elementType) {
+		case BSON_DATA_STRING: {
+			const int32_t size = readLE<int32_t>();
+			if (UNLIKELY(size <= 0 || static_cast<size_t>(size) > inLen - inIdx))
+				RETURN_ERR("Bad string length");
+
+			ENSURE_SPACE_OR_RETURN(1);
+			out[outIdx++] = '"';
+			if (!stringCache.empty() && size - 1 <= static_cast<int32_t>(STRING_CACHE_MAX) && size > 1) {
+				if (writeCachedChars(size - 1))
+					return true;
+			} else if (writeStringChars(size - 1)) {
+				return true;
 			}
-			case BSON_DATA_OID: {
-				if (LIKELY(inIdx + 12 <= inLen)) {
-					if (baseKey.empty() && currentPath == "_id") {
-						memcpy(docId.data(), in + inIdx, 12);
-					}
+			inIdx++; // skip null terminator
+			ENSURE_SPACE_OR_RETURN(1);
+			out[outIdx++] = '"';
+			return false;
+		}
+		case BSON_DATA_OID: {
+			if (LIKELY(inIdx + 12 <= inLen)) {
+				if (frames.size() == 1 && currentPath == "_id") {
+					memcpy(docId.data(), in + inIdx, 12);
+					hasDocId = true;
+				}
 
-					if (populateInfo) {
-						auto idMapForPath = populateInfo->paths.find(currentPath);
-						if (idMapForPath != populateInfo->paths.end()) {
-							ObjectId id;
-							memcpy(id.data(), in + inIdx, 12);
-							auto doc = idMapForPath->second.find(id);
-							if (doc != idMapForPath->second.end()) {
-								ENSURE_SPACE_OR_RETURN(doc->second.size);
-								memcpy(out + outIdx, doc->second.data, doc->second.size);
-								outIdx += doc->second.size;
-								inIdx += 12;
-								break;
-							}
+				if (populatePaths) {
+					auto idMapForPath = populatePaths->find(currentPath);
+					if (idMapForPath != populatePaths->end()) {
+						ObjectId id;
+						memcpy(id.data(), in + inIdx, 12);
+						auto doc = idMapForPath->second.find(id);
+						if (doc != idMapForPath->second.end()) {
+							if (writePopulated(doc->second))
+								return true;
+							inIdx += 12;
+							return false;
 						}
 					}
+				}
 
-					ENSURE_SPACE_OR_RETURN(26);
-					transcodeObjectId(Enabler<isa>{});
-				} else
-					RETURN_ERR("Truncated BSON (in ObjectId)");
-				break;
-			}
-			case BSON_DATA_INT: {
-				if (LIKELY(inIdx + 4 <= inLen)) {
-					const int32_t value = readLE<int32_t>();
-					uint8_t temp[INT_BUF_DIGS<int32_t>];
-					uint8_t* temp_p = temp;
-					size_t n = fast_itoa(temp_p, value);
-					ENSURE_SPACE_OR_RETURN(n);
-					memcpy(out + outIdx, temp_p, n);
-					outIdx += n;
-				} else
-					RETURN_ERR("Truncated BSON (in Int)");
-				break;
-			}
-			case BSON_DATA_NUMBER: {
-				if (LIKELY(inIdx + 8 <= inLen)) {
-					const double value = readLE<double>();
-					if (std::isfinite(value)) {
-						constexpr size_t kBufferSize = 128;
-						ENSURE_SPACE_OR_RETURN(kBufferSize);
-						StringBuilder sb(reinterpret_cast<char*>(out + outIdx), kBufferSize);
-						auto& dc = DoubleToStringConverter::EcmaScriptConverter();
-						dc.ToShortest(value, &sb);
-						outIdx += sb.position();
-					} else {
-						ENSURE_SPACE_OR_RETURN(4);
-						memcpy(out + outIdx, "null", 4);
-						outIdx += 4;
-					}
-				} else
-					RETURN_ERR("Truncated BSON (in Number)");
-				break;
-			}
-			case BSON_DATA_DATE: {
-				if (LIKELY(inIdx + 8 <= inLen)) {
-					ENSURE_SPACE_OR_RETURN(26);
-					const int64_t value = readLE<int64_t>(); // BSON encodes UTC ms since Unix epoch
-					const time_t seconds = value / 1000;
-					const int32_t millis = value % 1000;
+				ENSURE_SPACE_OR_RETURN(26);
+				transcodeObjectId(Enabler<isa>{});
+			} else
+				RETURN_ERR("Truncated BSON (in ObjectId)");
+			return false;
+		}
+		case BSON_DATA_INT: {
+			if (LIKELY(inIdx + 4 <= inLen)) {
+				const int32_t value = readLE<int32_t>();
+				uint8_t temp[INT_BUF_DIGS<int32_t>];
+				uint8_t* temp_p = temp;
+				size_t n = fast_itoa(temp_p, value);
+				ENSURE_SPACE_OR_RETURN(n);
+				memcpy(out + outIdx, temp_p, n);
+				outIdx += n;
+			} else
+				RETURN_ERR("Truncated BSON (in Int)");
+			return false;
+		}
+		case BSON_DATA_NUMBER: {
+			if (LIKELY(inIdx + 8 <= inLen)) {
+				const double value = readLE<double>();
+				if (std::isfinite(value)) {
+					constexpr size_t kBufferSize = 128;
+					ENSURE_SPACE_OR_RETURN(kBufferSize);
+					StringBuilder sb(reinterpret_cast<char*>(out + outIdx), kBufferSize);
+					auto& dc = DoubleToStringConverter::EcmaScriptConverter();
+					dc.ToShortest(value, &sb);
+					outIdx += sb.position();
+				} else {
+					ENSURE_SPACE_OR_RETURN(4);
+					memcpy(out + outIdx, "null", 4);
+					outIdx += 4;
+				}
+			} else
+				RETURN_ERR("Truncated BSON (in Number)");
+			return false;
+		}
+		case BSON_DATA_DATE: {
+			if (LIKELY(inIdx + 8 <= inLen)) {
+				ENSURE_SPACE_OR_RETURN(26);
+				const int64_t value = readLE<int64_t>(); // BSON encodes UTC ms since Unix epoch
+				const time_t seconds = value / 1000;
+				const int32_t millis = value % 1000;
 
-					out[outIdx++] = '"';
-					tm* gmt = gmtime(&seconds);
+				out[outIdx++] = '"';
+				tm* gmt = gmtime(&seconds);
 
-					uint8_t temp[INT_BUF_DIGS<int32_t>];
-					uint8_t* temp_p = temp;
-					size_t n;
+				uint8_t temp[INT_BUF_DIGS<int32_t>];
+				uint8_t* temp_p = temp;
+				size_t n;
 
-					n = fast_itoa(temp_p, gmt->tm_year + 1900);
-					memcpy(out + outIdx, temp_p, n);
-					outIdx += n;
-					temp_p = temp;
-
-					out[outIdx++] = '-';
-					memcpy(out + outIdx, digits + ((gmt->tm_mon + 1) * 2), 2);
-					outIdx += 2;
-
-					out[outIdx++] = '-';
-					memcpy(out + outIdx, digits + (gmt->tm_mday) * 2, 2);
-					outIdx += 2;
-
-					out[outIdx++] = 'T';
-					memcpy(out + outIdx, digits + (gmt->tm_hour) * 2, 2);
-					outIdx += 2;
-
-					out[outIdx++] = ':';
-					memcpy(out + outIdx, digits + (gmt->tm_min) * 2, 2);
-					outIdx += 2;
-
-					out[outIdx++] = ':';
-					memcpy(out + outIdx, digits + (gmt->tm_sec) * 2, 2);
-					outIdx += 2;
-
-					memcpy(out + outIdx, ".000Z\"", 6);
-					n = fast_itoa(temp_p, millis);
-					outIdx += 4 - n;
-					// TODO(perf) benchmark specializing for the three possible
-					// n values. GCC inlines if specialized.
-					memcpy(out + outIdx, temp_p, n);
-					// if (n == 3) memcpy(out + outIdx, temp_p, n);
-					// if (n == 2) memcpy(out + outIdx, temp_p, n);
-					// if (n == 1) memcpy(out + outIdx, temp_p, n);
-					outIdx += n + 2;
-				} else
-					RETURN_ERR("Truncated BSON (in Date)");
-				break;
-			}
-			case BSON_DATA_BOOLEAN: {
-				if (LIKELY(inIdx + 1 <= inLen)) {
-					const uint8_t val = in[inIdx++];
-					if (val == 1) {
-						ENSURE_SPACE_OR_RETURN(4);
-						memcpy(out + outIdx, "true", 4);
-						outIdx += 4;
-					} else {
-						ENSURE_SPACE_OR_RETURN(5);
-						memcpy(out + outIdx, "false", 5);
-						outIdx += 5;
-					}
-				} else
-					RETURN_ERR("Truncated BSON (in Boolean)");
-				break;
-			}
-			case BSON_DATA_OBJECT: {
-				// Bounds check in head of this function.
-				if (UNLIKELY((transcodeObject(false, currentPath))))
+				n = fast_itoa(temp_p, gmt->tm_year + 1900);
+				memcpy(out + outIdx, temp_p, n);
+				outIdx += n;
+				temp_p = temp;
+
+				out[outIdx++] = '-';
+				memcpy(out + outIdx, digits + ((gmt->tm_mon + 1) * 2), 2);
+				outIdx += 2;
+
+				out[outIdx++] = '-';
+				memcpy(out + outIdx, digits + (gmt->tm_mday) * 2, 2);
+				outIdx += 2;
+
+				out[outIdx++] = 'T';
+				memcpy(out + outIdx, digits + (gmt->tm_hour) * 2, 2);
+				outIdx += 2;
+
+				out[outIdx++] = ':';
+				memcpy(out + outIdx, digits + (gmt->tm_min) * 2, 2);
+				outIdx += 2;
+
+				out[outIdx++] = ':';
+				memcpy(out + outIdx, digits + (gmt->tm_sec) * 2, 2);
+				outIdx += 2;
+
+				memcpy(out + outIdx, ".000Z\"", 6);
+				n = fast_itoa(temp_p, millis);
+				outIdx += 4 - n;
+				// TODO(perf) benchmark specializing for the three possible
+				// n values. GCC inlines if specialized.
+				memcpy(out + outIdx, temp_p, n);
+				// if (n == 3) memcpy(out + outIdx, temp_p, n);
+				// if (n == 2) memcpy(out + outIdx, temp_p, n);
+				// if (n == 1) memcpy(out + outIdx, temp_p, n);
+				outIdx += n + 2;
+			} else
+				RETURN_ERR("Truncated BSON (in Date)");
+			return false;
+		}
+		case BSON_DATA_BOOLEAN: {
+			if (LIKELY(inIdx + 1 <= inLen)) {
+				const uint8_t val = in[inIdx++];
+				if (val == 1) {
+					ENSURE_SPACE_OR_RETURN(4);
+					memcpy(out + outIdx, "true", 4);
+					outIdx += 4;
+				} else {
+					ENSURE_SPACE_OR_RETURN(5);
+					memcpy(out + outIdx, "false", 5);
+					outIdx += 5;
+				}
+			} else
+				RETURN_ERR("Truncated BSON (in Boolean)");
+			return false;
+		}
+		case BSON_DATA_OBJECT:
+		case BSON_DATA_ARRAY: {
+			// Invalidates references into frames.
+			if (UNLIKELY(pushFrame(elementType == BSON_DATA_ARRAY)))
+				return true;
+			if (canonical && elementType == BSON_DATA_OBJECT && sortFrame())
+				return true;
+			if (UNLIKELY(!arraySlices.empty()) && elementType == BSON_DATA_ARRAY && sliceFrame())
+				return true;
+			ENSURE_SPACE_OR_RETURN(1);
+			out[outIdx++] = elementType == BSON_DATA_ARRAY ? '[' : '{';
+			return false;
+		}
+		case BSON_DATA_NULL: {
+			ENSURE_SPACE_OR_RETURN(4);
+			memcpy(out + outIdx, "null", 4);
+			outIdx += 4;
+			return false;
+		}
+		case BSON_DATA_LONG: {
+			if (LIKELY(inIdx + 8 <= inLen)) {
+				const int64_t value = readLE<int64_t>();
+				uint8_t temp[INT_BUF_DIGS<int64_t>];
+				uint8_t* temp_p = temp;
+				size_t n = fast_itoa(temp_p, value);
+				ENSURE_SPACE_OR_RETURN(n);
+				memcpy(out + outIdx, temp_p, n);
+				outIdx += n;
+			} else
+				RETURN_ERR("Truncated BSON (in Long)");
+			return false;
+		}
+		case BSON_DATA_UNDEFINED:
+			// noop
+			return false;
+		case BSON_DATA_DECIMAL128:
+		case BSON_DATA_BINARY:
+		case BSON_DATA_REGEXP:
+		case BSON_DATA_SYMBOL:
+		case BSON_DATA_TIMESTAMP:
+		case BSON_DATA_MIN_KEY:
+		case BSON_DATA_MAX_KEY:
+		case BSON_DATA_CODE:
+		case BSON_DATA_CODE_W_SCOPE:
+		case BSON_DATA_DBPOINTER:
+			RETURN_ERR("BSON type incompatible with JSON");
+		default:
+			RETURN_ERR("Unknown BSON type");
+		}
+	}
+
+	// toObject's walk. Like transcodeDocument, but each element's value is
+	// collected into props, and a document's properties are defined all at
+	// once when it closes.
+	bool buildObject(napi_env env, napi_value& result) {
+		currentPath.clear();
+		frames.clear();
+		sortedElems.clear();
+		propsStart.clear();
+		if (pushFrame(false) || (canonical && sortFrame()))
+			return true;
+		propsStart.push_back(0);
+
+		while (true) {
+			Frame& frame = frames.back();
+			if (UNLIKELY(frame.seeks)) {
+				// Count siblings in sorted objects, as in writeSortedCount().
+				while (const SortedElem* count = countAt(frame)) {
+					napi_property_descriptor countProp = {};
+					countProp.attributes = napi_default_jsproperty;
+					int32_t n;
+					if (sortedCount(*count, n))
+						return true;
+					if (napi_create_string_utf8(env, count->count->countName.data(), count->count->countName.size(), &countProp.name) != napi_ok ||
+						napi_create_int32(env, n, &countProp.value) != napi_ok)
+						RETURN_ERR("Failed to create object");
+					props.push_back(countProp);
+					frame.arrIdx++;
+				}
+				if (seek(frame))
 					return true;
-				break;
 			}
-			case BSON_DATA_ARRAY: {
-				// Bounds check in head of this function.
-				if (UNLIKELY((transcodeObject(true, currentPath))))
+			const uint8_t elementType = in[inIdx++];
+			if (UNLIKELY(elementType == 0)) {
+				const bool isArray = frame.isArray;
+				const ArraySlice* slice = frame.slice;
+				const int32_t count = frame.arrIdx;
+				if (popFrame())
 					return true;
-				if (UNLIKELY(in[inIdx - 1] != 0)) {
-					err = "Invalid array terminator byte";
+				const size_t start = propsStart.back();
+				propsStart.pop_back();
+				napi_value doc;
+				if (makeDocument(env, isArray, start, doc))
 					return true;
+				props.resize(start);
+				if (frames.empty()) {
+					result = doc;
+					return false;
 				}
-				break;
+				props.back().value = doc;
+				// The count sibling, as in writeCount().
+				if (UNLIKELY(slice != nullptr) && !slice->countName.empty() && !frames.back().isArray &&
+					frames.back().sortedStart == UNSORTED) {
+					napi_property_descriptor countProp = {};
+					countProp.attributes = napi_default_jsproperty;
+					if (napi_create_string_utf8(env, slice->countName.data(), slice->countName.size(), &countProp.name) != napi_ok ||
+						napi_create_int32(env, count, &countProp.value) != napi_ok)
+						RETURN_ERR("Failed to create object");
+					props.push_back(countProp);
+				}
+				continue;
 			}
-			case BSON_DATA_NULL: {
-				ENSURE_SPACE_OR_RETURN(4);
-				memcpy(out + outIdx, "null", 4);
-				outIdx += 4;
-				break;
+
+			napi_property_descriptor prop = {};
+			prop.attributes = napi_default_jsproperty;
+			if (frame.isArray) {
+				inIdx += nDigits(frame.arrIdx);
+				currentPath.resize(frame.pathLen);
+			} else if (readKey(env, frame, prop.name)) {
+				return true;
 			}
-			case BSON_DATA_LONG: {
-				if (LIKELY(inIdx + 8 <= inLen)) {
-					const int64_t value = readLE<int64_t>();
-					uint8_t temp[INT_BUF_DIGS<int64_t>];
-					uint8_t* temp_p = temp;
-					size_t n = fast_itoa(temp_p, value);
-					ENSURE_SPACE_OR_RETURN(n);
-					memcpy(out + outIdx, temp_p, n);
-					outIdx += n;
-				} else
-					RETURN_ERR("Truncated BSON (in Long)");
-				break;
+			frame.arrIdx++;
+
+			if (elementType == BSON_DATA_OBJECT || elementType == BSON_DATA_ARRAY) {
+				// The value is set when the document closes.
+				props.push_back(prop);
+				// Invalidates frame.
+				if (UNLIKELY(pushFrame(elementType == BSON_DATA_ARRAY)))
+					return true;
+				if (canonical && elementType == BSON_DATA_OBJECT && sortFrame())
+					return true;
+				if (UNLIKELY(!arraySlices.empty()) && elementType == BSON_DATA_ARRAY && sliceFrame())
+					return true;
+				propsStart.push_back(props.size());
+				continue;
 			}
-			case BSON_DATA_UNDEFINED:
-				// noop
-				break;
-			case BSON_DATA_DECIMAL128:
-			case BSON_DATA_BINARY:
-			case BSON_DATA_REGEXP:
-			case BSON_DATA_SYMBOL:
-			case BSON_DATA_TIMESTAMP:
-			case BSON_DATA_MIN_KEY:
-			case BSON_DATA_MAX_KEY:
-			case BSON_DATA_CODE:
-			case BSON_DATA_CODE_W_SCOPE:
-			case BSON_DATA_DBPOINTER:
-				RETURN_ERR("BSON type incompatible with JSON");
-			default:
-				RETURN_ERR("Unknown BSON type");
+			if (elementType == BSON_DATA_UNDEFINED && !frame.isArray)
+				continue; // as JSON.stringify leaves it out
+			if (UNLIKELY(readValue(env, elementType, prop.value)))
+				return true;
+			props.push_back(prop);
+		}
+	}
+
+	// Creates the object or array with the properties from props[start].
+	bool makeDocument(napi_env env, bool isArray, size_t start, napi_value& doc) {
+		const size_t n = props.size() - start;
+		if (isArray) {
+			if (napi_create_array_with_length(env, n, &doc) != napi_ok)
+				RETURN_ERR("Failed to create array");
+			for (size_t i = 0; i < n; i++) {
+				if (napi_set_element(env, doc, static_cast<uint32_t>(i), props[start + i].value) != napi_ok)
+					RETURN_ERR("Failed to create array");
 			}
+			return false;
+		}
+		if (napi_create_object(env, &doc) != napi_ok ||
+			(n && napi_define_properties(env, doc, n, props.data() + start) != napi_ok)) {
+			RETURN_ERR("Failed to create object");
+		}
+		return false;
+	}
 
-			arrIdx++;
+	// Reads the key at inIdx into a string, reusing the one for an identical
+	// key, and sets currentPath.
+	bool readKey(napi_env env, const Frame& frame, napi_value& key) {
+		const size_t keyStart = inIdx;
+		// pushFrame checked that the document ends with a null byte.
+		const size_t keyLen = strlen(reinterpret_cast<const char*>(in + inIdx));
+		inIdx += keyLen;
+		const std::string_view bytes(reinterpret_cast<const char*>(in + keyStart), keyLen);
+		auto it = keyCache.find(bytes);
+		if (it != keyCache.end()) {
+			key = it->second;
+		} else {
+			if (makeString(env, in + keyStart, keyLen, key))
+				return true;
+			keyCache.emplace(bytes, key);
 		}
+		setPath(frame, keyStart);
+		inIdx++; // skip null terminator
+		return false;
+	}
 
-		ENSURE_SPACE_OR_RETURN(1);
-		out[outIdx++] = isArray ? ']' : '}';
+	// Returns the index of the first byte >= 0x80 in p[0, n), or n.
+	static size_t asciiPrefix(const uint8_t* p, size_t n, Enabler<ISA::BASELINE>) {
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			uint64_t w;
+			memcpy(&w, p + i, 8);
+			if (w & 0x8080808080808080ULL)
+				break;
+		}
+		while (i < n && p[i] < 0x80)
+			i++;
+		return i;
+	}
+
+#ifdef B2J_X86
+	[[gnu::target("sse2,bmi")]]
+	static size_t asciiPrefix(const uint8_t* p, size_t n, Enabler<ISA::SSE2>) {
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const uint32_t mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+			if (mask)
+				return i + _tzcnt_u32(mask);
+		}
+		return i + asciiPrefix(p + i, n - i, Enabler<ISA::BASELINE>{});
+	}
+
+	[[gnu::target("avx2,bmi")]]
+	static size_t asciiPrefix(const uint8_t* p, size_t n, Enabler<ISA::AVX2>) {
+		size_t i = 0;
+		for (; i + 32 <= n; i += 32) {
+			const uint32_t mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)));
+			if (mask)
+				return i + _tzcnt_u32(mask);
+		}
+		return i + asciiPrefix(p + i, n - i, Enabler<ISA::SSE2>{});
+	}
+#endif // B2J_X86
+
+#ifdef __wasm_simd128__
+	static size_t asciiPrefix(const uint8_t* p, size_t n, Enabler<ISA::WASM_SIMD128>) {
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const uint32_t mask = wasm_i8x16_bitmask(wasm_v128_load(p + i));
+			if (mask)
+				return i + __builtin_ctz(mask);
+		}
+		return i + asciiPrefix(p + i, n - i, Enabler<ISA::BASELINE>{});
+	}
+#endif // __wasm_simd128__
+
+	// Creates a string from n bytes of UTF-8. ASCII strings are created as
+	// one-byte strings, which V8 doesn't have to decode.
+	bool makeString(napi_env env, const uint8_t* p, size_t n, napi_value& str) {
+		size_t i = asciiPrefix(p, n, Enabler<isa>{});
+
+		napi_status status;
+		if (i == n) {
+			status = napi_create_string_latin1(env, reinterpret_cast<const char*>(p), n, &str);
+		} else {
+			if (invalidUtf8 == InvalidUtf8::THROW) {
+				while (i < n) {
+					if (p[i] < 0x80) {
+						i++;
+						continue;
+					}
+					const int len = utf8Sequence(p + i, n - i);
+					if (len < 0)
+						RETURN_ERR("Invalid UTF-8");
+					i += len;
+				}
+			}
+			// Replaces invalid sequences with U+FFFD like Buffer#toString.
+			status = napi_create_string_utf8(env, reinterpret_cast<const char*>(p), n, &str);
+		}
+		if (status != napi_ok)
+			RETURN_ERR("Failed to create string");
+		return false;
+	}
+
+	// Reads the value of type elementType at inIdx, other than a document or
+	// array. ObjectIds and dates go through writeValue.
+	bool readValue(napi_env env, uint8_t elementType, napi_value& value) {
+		napi_status status = napi_ok;
+		switch (elementType) {
+		case BSON_DATA_STRING: {
+			const int32_t size = readLE<int32_t>();
+			if (UNLIKELY(size <= 0 || static_cast<size_t>(size) > inLen - inIdx))
+				RETURN_ERR("Bad string length");
+			if (makeString(env, in + inIdx, size - 1, value))
+				return true;
+			inIdx += size;
+			return false;
+		}
+		case BSON_DATA_OID:
+		case BSON_DATA_DATE: {
+			outIdx = 0;
+			if (writeValue(elementType))
+				return true;
+			if (out[0] == '"') {
+				status = napi_create_string_latin1(env, reinterpret_cast<const char*>(out + 1), outIdx - 2, &value);
+			} else {
+				// A populated document.
+				napi_value global, json, parse, text;
+				if (napi_get_global(env, &global) != napi_ok ||
+					napi_get_named_property(env, global, "JSON", &json) != napi_ok ||
+					napi_get_named_property(env, json, "parse", &parse) != napi_ok ||
+					napi_create_string_utf8(env, reinterpret_cast<const char*>(out), outIdx, &text) != napi_ok ||
+					napi_call_function(env, json, parse, 1, &text, &value) != napi_ok) {
+					RETURN_ERR("Failed to parse populated document");
+				}
+			}
+			break;
+		}
+		case BSON_DATA_INT:
+			if (UNLIKELY(inIdx + 4 > inLen))
+				RETURN_ERR("Truncated BSON (in Int)");
+			status = napi_create_int32(env, readLE<int32_t>(), &value);
+			break;
+		case BSON_DATA_NUMBER: {
+			if (UNLIKELY(inIdx + 8 > inLen))
+				RETURN_ERR("Truncated BSON (in Number)");
+			const double d = readLE<double>();
+			status = std::isfinite(d) ? napi_create_double(env, d, &value) : napi_get_null(env, &value);
+			break;
+		}
+		case BSON_DATA_LONG:
+			if (UNLIKELY(inIdx + 8 > inLen))
+				RETURN_ERR("Truncated BSON (in Long)");
+			// Rounds to nearest, like JSON.parse of the digits.
+			status = napi_create_double(env, static_cast<double>(readLE<int64_t>()), &value);
+			break;
+		case BSON_DATA_BOOLEAN:
+			if (UNLIKELY(inIdx + 1 > inLen))
+				RETURN_ERR("Truncated BSON (in Boolean)");
+			status = napi_get_boolean(env, in[inIdx++] == 1, &value);
+			break;
+		case BSON_DATA_NULL:
+		case BSON_DATA_UNDEFINED: // in an array
+			status = napi_get_null(env, &value);
+			break;
+		default:
+			// Errors for the rest.
+			return writeValue(elementType);
+		}
+		if (status != napi_ok)
+			RETURN_ERR("Failed to create value");
 		return false;
 	}
 };
@@ -1409,63 +4858,677 @@ void PopulateInfo<isa>::AddItems(const Napi::CallbackInfo& info) {
 	paths.try_emplace(path.Utf8Value(), ObjectIdMap());
 	ObjectIdMap& map = paths[path.Utf8Value()];
 	ObjectIdSet& set = missingIds[path.Utf8Value()];
+	version++;
 
-	Napi::Object wrapedTranscoder = Transcoder<isa>::ctor->New({});
+	Napi::Object wrapedTranscoder = env.GetInstanceData<Napi::FunctionReference>()->New({});
 	Transcoder<isa>* trans = Transcoder<isa>::Unwrap(wrapedTranscoder);
 
 	for (uint32_t i = 0; i < nBuffers; i++) {
 		Napi::Uint8Array buffer = buffers.Get(i).As<Napi::Uint8Array>();
 
+		trans->hasDocId = false;
 		bool status = trans->transcode(buffer.Data(), buffer.ByteLength(), false);
 		if (status) {
 			std::free(trans->out);
 			Napi::Error::New(env, trans->err).ThrowAsJavaScriptException();
 			return;
 		}
+		if (!trans->hasDocId) {
+			std::free(trans->out);
+			Napi::Error::New(env, "Populate items must have an ObjectId _id").ThrowAsJavaScriptException();
+			return;
+		}
 
 		SizedBuffer sb;
 		sb.size = trans->outIdx;
 		sb.data = static_cast<uint8_t*>(std::malloc(sb.size));
 		if (sb.data == nullptr) {
+			std::free(trans->out);
 			Napi::Error::New(env, "Allocation failure").ThrowAsJavaScriptException();
 			return;
 		}
 		std::memcpy(sb.data, trans->out, sb.size);
+		std::free(trans->out);
 		map[trans->docId] = sb;
 		set.erase(trans->docId);
 	}
 }
 
+// Encodes JSON text as BSON, as BSON.serialize(JSON.parse(text)) would: numbers
+// that are int32s become Int, others Number. Strings at the paths given by the
+// objectIds option that are 24 hex digits become ObjectIds. Unlike JSON.parse,
+// invalid UTF-8 and duplicate keys are errors. Strings are scanned with SIMD;
+// the structure is parsed a byte at a time.
+template<ISA isa>
+class JsonEncoder {
+public:
+	static void Init(Napi::Env env, Napi::Object exports) {
+		exports.Set("jsonToBson", Napi::Function::New<&JsonEncoder<isa>::jsonToBsonNodeFn>(env, "jsonToBson"));
+	}
+
+	/**
+	 * 0. Uint8Array        UTF-8 JSON text of an object
+	 * 1. Object|undefined  {objectIds: string[], maxDepth: number}
+	 */
+	static Napi::Value jsonToBsonNodeFn(const Napi::CallbackInfo& info) {
+		Napi::Env env = info.Env();
+		if (!info[0].IsTypedArray() || info[0].As<Napi::TypedArray>().TypedArrayType() != napi_uint8_array) {
+			Napi::Error::New(env, "Input must be a buffer").ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		JsonEncoder enc;
+		if (info[1].IsObject()) {
+			Napi::Value ids = info[1].As<Napi::Object>().Get("objectIds");
+			if (!ids.IsUndefined()) {
+				if (!ids.IsArray()) {
+					Napi::TypeError::New(env, "objectIds must be an array of paths").ThrowAsJavaScriptException();
+					return env.Undefined();
+				}
+				Napi::Array arr = ids.As<Napi::Array>();
+				for (uint32_t i = 0; i < arr.Length(); i++) {
+					Napi::Value path = arr.Get(i);
+					if (!path.IsString()) {
+						Napi::TypeError::New(env, "objectIds must be an array of paths").ThrowAsJavaScriptException();
+						return env.Undefined();
+					}
+					enc.objectIdPaths.insert(path.As<Napi::String>().Utf8Value());
+				}
+			}
+
+			Napi::Value depth = info[1].As<Napi::Object>().Get("maxDepth");
+			if (!depth.IsUndefined()) {
+				const double d = depth.IsNumber() ? depth.As<Napi::Number>().DoubleValue() : 0;
+				if (!(d >= 1 && d <= UINT32_MAX && d == std::floor(d))) {
+					Napi::TypeError::New(env, "maxDepth must be a positive integer").ThrowAsJavaScriptException();
+					return env.Undefined();
+				}
+				enc.maxDepth = static_cast<uint32_t>(d);
+			}
+		}
+
+		Napi::Uint8Array arr = info[0].As<Napi::Uint8Array>();
+		enc.in = arr.Data();
+		enc.inLen = arr.ByteLength();
+		// JSON is usually a bit longer than its BSON.
+		if (enc.resize(enc.inLen + 64) || enc.encode()) {
+			std::free(enc.out);
+			std::string msg = enc.err;
+			if (enc.errAtPos)
+				msg += " at position " + std::to_string(enc.inIdx);
+			Napi::Error::New(env, msg).ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+		return Napi::Buffer<uint8_t>::New(env, enc.out, enc.outIdx, [](Napi::Env, uint8_t* data) {
+			std::free(data);
+		});
+	}
+
+private:
+	const uint8_t* in = nullptr;
+	size_t inLen = 0;
+	size_t inIdx = 0;
+	uint8_t* out = nullptr;
+	size_t outLen = 0;
+	size_t outIdx = 0;
+	const char* err = nullptr;
+	// Whether err is about the JSON at inIdx.
+	bool errAtPos = false;
+	uint32_t maxDepth = 200;
+	std::unordered_set<std::string> objectIdPaths;
+	// Set while encoding a value whose path is in objectIdPaths. Elements of
+	// arrays share the array's path.
+	std::string currentPath;
+	// Keys written so far in each open object, by depth, to reject duplicates.
+	// Kept between objects at a depth to reuse the buckets.
+	std::vector<std::unordered_set<std::string>> keySets;
+
+	struct Frame {
+		size_t start; // outIdx of the document's size
+		size_t pathLen; // length of its key path in currentPath
+		int32_t arrIdx; // index of the next element
+		bool isArray;
+	};
+	std::vector<Frame> frames;
+
+#define JSON_ERR(msg) return err = (msg), errAtPos = true, true
+
+	bool resize(size_t to) {
+		uint8_t* oldOut = out;
+		out = static_cast<uint8_t*>(std::realloc(out, to));
+		if (out == nullptr) {
+			std::free(oldOut);
+			RETURN_ERR("Allocation failure");
+		}
+		outLen = to;
+		return false;
+	}
+
+	[[nodiscard]]
+	inline bool ensureSpace(size_t n) {
+		if (LIKELY(outIdx + n <= outLen))
+			return false;
+		const size_t m = std::max(outIdx + n, outLen);
+		return resize((m * 3) >> 1);
+	}
+
+	template<typename T>
+	inline void writeLE(size_t at, T v) {
+		memcpy(out + at, &v, sizeof(T));
+	}
+
+	inline void skipSpace() {
+		while (inIdx < inLen) {
+			const uint8_t c = in[inIdx];
+			if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+				return;
+			inIdx++;
+		}
+	}
+
+	// Whether the next non-space character is c, which is then consumed.
+	inline bool consume(uint8_t c) {
+		skipSpace();
+		if (inIdx < inLen && in[inIdx] == c) {
+			inIdx++;
+			return true;
+		}
+		return false;
+	}
+
+	bool encode() {
+		skipSpace();
+		if (inIdx == inLen)
+			JSON_ERR("Unexpected end of JSON");
+		if (in[inIdx] != '{')
+			JSON_ERR("JSON must be an object");
+		inIdx++;
+		if (openDocument(false))
+			return true;
+
+		// Whether a ',' followed the last value in the current document.
+		bool more = false;
+		while (!frames.empty()) {
+			Frame& frame = frames.back();
+			skipSpace();
+			const bool closing = inIdx < inLen && in[inIdx] == (frame.isArray ? ']' : '}');
+			if (frame.arrIdx && closing == more) {
+				if (inIdx == inLen)
+					JSON_ERR("Unexpected end of JSON");
+				JSON_ERR(closing ? "Unexpected character" : "Expected ',' or the end of the document");
+			}
+			if (closing) {
+				inIdx++;
+				if (closeDocument())
+					return true;
+				more = !frames.empty() && consume(',');
+				continue;
+			}
+
+			// Element type, filled in by writeValue.
+			ENSURE_SPACE_OR_RETURN(1 + 11);
+			const size_t typeIdx = outIdx++;
+			if (frame.isArray) {
+				uint8_t temp[INT_BUF_DIGS<int32_t>];
+				uint8_t* temp_p = temp;
+				const size_t n = fast_itoa(temp_p, frame.arrIdx);
+				memcpy(out + outIdx, temp_p, n);
+				outIdx += n;
+				out[outIdx++] = 0;
+				currentPath.resize(frame.pathLen);
+			} else {
+				skipSpace();
+				if (inIdx == inLen || in[inIdx] != '"')
+					JSON_ERR("Expected a string key");
+				inIdx++;
+				if (writeKey(frame))
+					return true;
+				if (!consume(':'))
+					JSON_ERR("Expected ':'");
+			}
+			frame.arrIdx++;
+
+			// Invalidates frame if it opens a document.
+			const size_t depth = frames.size();
+			if (writeValue(typeIdx))
+				return true;
+			more = frames.size() == depth && consume(',');
+		}
+
+		skipSpace();
+		if (inIdx != inLen)
+			JSON_ERR("Unexpected character after JSON");
+		return false;
+	}
+
+	bool openDocument(bool isArray) {
+		if (UNLIKELY(frames.size() == maxDepth))
+			RETURN_ERR("Maximum nesting depth exceeded");
+		ENSURE_SPACE_OR_RETURN(4);
+		frames.push_back({outIdx, currentPath.size(), 0, isArray});
+		outIdx += 4; // size, written by closeDocument
+		if (!isArray) {
+			if (keySets.size() < frames.size())
+				keySets.resize(frames.size());
+			keySets[frames.size() - 1].clear();
+		}
+		return false;
+	}
+
+	bool closeDocument() {
+		ENSURE_SPACE_OR_RETURN(1);
+		out[outIdx++] = 0;
+		const size_t start = frames.back().start;
+		writeLE<int32_t>(start, static_cast<int32_t>(outIdx - start));
+		currentPath.resize(frames.back().pathLen);
+		frames.pop_back();
+		return false;
+	}
+
+	// Writes the key after the opening quote as a cstring and sets
+	// currentPath.
+	bool writeKey(const Frame& frame) {
+		const size_t quote = inIdx - 1;
+		const size_t start = outIdx;
+		if (writeStringChars())
+			return true;
+		if (UNLIKELY(memchr(out + start, 0, outIdx - start) != nullptr))
+			JSON_ERR("Keys can't contain null characters");
+		if (UNLIKELY(!keySets[frames.size() - 1].emplace(reinterpret_cast<const char*>(out + start), outIdx - start).second)) {
+			inIdx = quote;
+			JSON_ERR("Duplicate key");
+		}
+		currentPath.resize(frame.pathLen);
+		if (frame.pathLen)
+			currentPath += '.';
+		currentPath.append(reinterpret_cast<const char*>(out + start), outIdx - start);
+		ENSURE_SPACE_OR_RETURN(1);
+		out[outIdx++] = 0;
+		return false;
+	}
+
+	// Writes the value at inIdx and sets out[typeIdx] to its type.
+	bool writeValue(size_t typeIdx) {
+		skipSpace();
+		if (UNLIKELY(inIdx == inLen))
+			JSON_ERR("Unexpected end of JSON");
+		// Room for a number, or a string's length.
+		ENSURE_SPACE_OR_RETURN(8);
+		const uint8_t c = in[inIdx];
+		switch (c) {
+		case '"': {
+			inIdx++;
+			const size_t start = outIdx;
+			outIdx += 4; // length
+			if (writeStringChars())
+				return true;
+			const size_t n = outIdx - start - 4;
+			if (n == 24 && !objectIdPaths.empty() && objectIdPaths.count(currentPath) &&
+				parseObjectId(out + start + 4, out + start)) {
+				out[typeIdx] = BSON_DATA_OID;
+				outIdx = start + 12;
+				return false;
+			}
+			ENSURE_SPACE_OR_RETURN(1);
+			out[outIdx++] = 0;
+			writeLE<int32_t>(start, static_cast<int32_t>(n + 1));
+			out[typeIdx] = BSON_DATA_STRING;
+			return false;
+		}
+		case '{':
+		case '[':
+			inIdx++;
+			out[typeIdx] = c == '[' ? BSON_DATA_ARRAY : BSON_DATA_OBJECT;
+			return openDocument(c == '[');
+		case 't':
+		case 'f':
+		case 'n': {
+			const char* word = c == 't' ? "true" : c == 'f' ? "false" : "null";
+			const size_t len = strlen(word);
+			if (inLen - inIdx < len || memcmp(in + inIdx, word, len) != 0)
+				JSON_ERR("Unexpected character");
+			inIdx += len;
+			if (c == 'n') {
+				out[typeIdx] = BSON_DATA_NULL;
+			} else {
+				out[typeIdx] = BSON_DATA_BOOLEAN;
+				out[outIdx++] = c == 't';
+			}
+			return false;
+		}
+		default:
+			if (c == '-' || (c >= '0' && c <= '9'))
+				return writeNumber(typeIdx);
+			JSON_ERR("Unexpected character");
+		}
+	}
+
+	// Decodes 24 hex digits at hex into the 12 bytes at dst. Returns false if
+	// they aren't all hex digits.
+	static bool parseObjectId(const uint8_t* hex, uint8_t* dst) {
+		uint8_t bytes[12];
+		for (size_t i = 0; i < 12; i++) {
+			const int hi = hexValue(hex[2 * i]);
+			const int lo = hexValue(hex[2 * i + 1]);
+			if (hi < 0 || lo < 0)
+				return false;
+			bytes[i] = static_cast<uint8_t>(hi << 4 | lo);
+		}
+		memcpy(dst, bytes, 12);
+		return true;
+	}
+
+	static int hexValue(uint8_t c) {
+		if (c >= '0' && c <= '9') return c - '0';
+		c |= 0x20;
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		return -1;
+	}
+
+	// Writes the number at inIdx as an Int if JSON.parse would give an int32
+	// other than -0, or else as a Number.
+	bool writeNumber(size_t typeIdx) {
+		const size_t start = inIdx;
+		const bool negative = in[inIdx] == '-';
+		if (negative)
+			inIdx++;
+		const size_t intStart = inIdx;
+		while (inIdx < inLen && in[inIdx] >= '0' && in[inIdx] <= '9')
+			inIdx++;
+		const size_t intDigits = inIdx - intStart;
+		if (intDigits == 0 || (in[intStart] == '0' && intDigits > 1))
+			return invalidNumber(start);
+		bool integer = true;
+		if (inIdx < inLen && in[inIdx] == '.') {
+			integer = false;
+			const size_t fracStart = ++inIdx;
+			while (inIdx < inLen && in[inIdx] >= '0' && in[inIdx] <= '9')
+				inIdx++;
+			if (inIdx == fracStart)
+				return invalidNumber(start);
+		}
+		if (inIdx < inLen && (in[inIdx] | 0x20) == 'e') {
+			integer = false;
+			inIdx++;
+			if (inIdx < inLen && (in[inIdx] == '+' || in[inIdx] == '-'))
+				inIdx++;
+			const size_t expStart = inIdx;
+			while (inIdx < inLen && in[inIdx] >= '0' && in[inIdx] <= '9')
+				inIdx++;
+			if (inIdx == expStart)
+				return invalidNumber(start);
+		}
+
+		double value;
+		if (integer && intDigits <= 18) {
+			// Exact, and converts to the nearest double like the slow path.
+			int64_t v = 0;
+			for (size_t i = intStart; i < inIdx; i++)
+				v = v * 10 + (in[i] - '0');
+			if (negative)
+				v = -v;
+			if (v >= INT32_MIN && v <= INT32_MAX && !(negative && v == 0)) {
+				out[typeIdx] = BSON_DATA_INT;
+				writeLE<int32_t>(outIdx, static_cast<int32_t>(v));
+				outIdx += 4;
+				return false;
+			}
+			value = negative && v == 0 ? -0.0 : static_cast<double>(v);
+		} else {
+			static const StringToDoubleConverter converter(StringToDoubleConverter::NO_FLAGS,
+				0.0, 0.0, nullptr, nullptr);
+			int processed;
+			value = converter.StringToDouble(reinterpret_cast<const char*>(in + start),
+				static_cast<int>(inIdx - start), &processed);
+			if (value >= INT32_MIN && value <= INT32_MAX && value == std::floor(value) &&
+				!(value == 0 && std::signbit(value))) {
+				out[typeIdx] = BSON_DATA_INT;
+				writeLE<int32_t>(outIdx, static_cast<int32_t>(value));
+				outIdx += 4;
+				return false;
+			}
+		}
+		out[typeIdx] = BSON_DATA_NUMBER;
+		writeLE<double>(outIdx, value);
+		outIdx += 8;
+		return false;
+	}
+
+	bool invalidNumber(size_t start) {
+		inIdx = start;
+		JSON_ERR("Invalid number");
+	}
+
+	// Writes the string after the opening quote, unescaped, through the
+	// closing quote, which is skipped. Escapes always decode to valid UTF-8,
+	// so checking the output checks the raw bytes in the input.
+	bool writeStringChars() {
+		const size_t quote = inIdx - 1;
+		const size_t outStart = outIdx;
+		while (true) {
+			const size_t runEnd = scanString(inIdx, Enabler<isa>{});
+			const size_t n = runEnd - inIdx;
+			ENSURE_SPACE_OR_RETURN(n + 4);
+			memcpy(out + outIdx, in + inIdx, n);
+			outIdx += n;
+			inIdx = runEnd;
+			if (UNLIKELY(inIdx == inLen))
+				JSON_ERR("Unterminated string");
+			const uint8_t c = in[inIdx++];
+			if (c == '"') {
+				if (UNLIKELY(!validUtf8(out + outStart, outIdx - outStart))) {
+					inIdx = quote;
+					JSON_ERR("Invalid UTF-8 in string");
+				}
+				return false;
+			}
+			if (c != '\\') {
+				inIdx--;
+				JSON_ERR("Bad control character in string");
+			}
+			if (writeEscape())
+				return true;
+		}
+	}
+
+	// Writes the character for the escape after the backslash at inIdx - 1.
+	// Space for 4 bytes must be ensured.
+	bool writeEscape() {
+		if (UNLIKELY(inIdx == inLen))
+			JSON_ERR("Unterminated string");
+		const uint8_t c = in[inIdx++];
+		uint8_t ch;
+		switch (c) {
+		case '"': ch = '"'; break;
+		case '\\': ch = '\\'; break;
+		case '/': ch = '/'; break;
+		case 'b': ch = '\b'; break;
+		case 'f': ch = '\f'; break;
+		case 'n': ch = '\n'; break;
+		case 'r': ch = '\r'; break;
+		case 't': ch = '\t'; break;
+		case 'u': {
+			uint32_t cp;
+			if (readHex4(cp))
+				return true;
+			if (cp >= 0xd800 && cp <= 0xdbff && inLen - inIdx >= 6 &&
+				in[inIdx] == '\\' && in[inIdx + 1] == 'u') {
+				const size_t save = inIdx;
+				inIdx += 2;
+				uint32_t lo;
+				if (readHex4(lo))
+					return true;
+				if (lo >= 0xdc00 && lo <= 0xdfff)
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+				else
+					inIdx = save; // unpaired; the next escape is separate
+			}
+			// Unpaired surrogates are written as U+FFFD, as js-bson does.
+			if (cp >= 0xd800 && cp <= 0xdfff)
+				cp = 0xfffd;
+			writeUtf8(cp);
+			return false;
+		}
+		default:
+			inIdx--;
+			JSON_ERR("Bad escaped character");
+		}
+		out[outIdx++] = ch;
+		return false;
+	}
+
+	bool readHex4(uint32_t& v) {
+		if (inLen - inIdx < 4)
+			JSON_ERR("Bad Unicode escape");
+		v = 0;
+		for (size_t i = 0; i < 4; i++) {
+			const int d = hexValue(in[inIdx + i]);
+			if (d < 0)
+				JSON_ERR("Bad Unicode escape");
+			v = v << 4 | d;
+		}
+		inIdx += 4;
+		return false;
+	}
+
+	inline void writeUtf8(uint32_t cp) {
+		if (cp < 0x80) {
+			out[outIdx++] = static_cast<uint8_t>(cp);
+		} else if (cp < 0x800) {
+			out[outIdx++] = static_cast<uint8_t>(0xc0 | cp >> 6);
+			out[outIdx++] = static_cast<uint8_t>(0x80 | (cp & 0x3f));
+		} else if (cp < 0x10000) {
+			out[outIdx++] = static_cast<uint8_t>(0xe0 | cp >> 12);
+			out[outIdx++] = static_cast<uint8_t>(0x80 | (cp >> 6 & 0x3f));
+			out[outIdx++] = static_cast<uint8_t>(0x80 | (cp & 0x3f));
+		} else {
+			out[outIdx++] = static_cast<uint8_t>(0xf0 | cp >> 18);
+			out[outIdx++] = static_cast<uint8_t>(0x80 | (cp >> 12 & 0x3f));
+			out[outIdx++] = static_cast<uint8_t>(0x80 | (cp >> 6 & 0x3f));
+			out[outIdx++] = static_cast<uint8_t>(0x80 | (cp & 0x3f));
+		}
+	}
+
+	// Returns the index of the first '"', '\' or control character at or
+	// after i, or inLen.
+	size_t scanString(size_t i, Enabler<ISA::BASELINE>) {
+		while (i < inLen && in[i] >= 0x20 && in[i] != '"' && in[i] != '\\')
+			i++;
+		return i;
+	}
+
+#ifdef B2J_X86
+	[[gnu::target("sse2,bmi")]]
+	size_t scanString(size_t i, Enabler<ISA::SSE2>) {
+		const __m128i esch20 = _mm_set1_epu8(0x20 ^ 0x80);
+		const __m128i esch22 = _mm_set1_epu8(0x22);
+		const __m128i esch5c = _mm_set1_epu8(0x5c);
+		for (; i + 16 <= inLen; i += 16) {
+			const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+			__m128i special = _mm_cmpgt_epi8(esch20, _mm_xor_si128(chars, _mm_set1_epu8(0x80)));
+			special = _mm_or_si128(special, _mm_cmpeq_epi8(chars, esch22));
+			special = _mm_or_si128(special, _mm_cmpeq_epi8(chars, esch5c));
+			const uint32_t mask = _mm_movemask_epi8(special);
+			if (mask)
+				return i + _tzcnt_u32(mask);
+		}
+		return scanString(i, Enabler<ISA::BASELINE>{});
+	}
+
+	[[gnu::target("avx2,bmi")]]
+	size_t scanString(size_t i, Enabler<ISA::AVX2>) {
+		const __m256i esch20 = _mm256_set1_epu8(0x20 ^ 0x80);
+		const __m256i esch22 = _mm256_set1_epu8(0x22);
+		const __m256i esch5c = _mm256_set1_epu8(0x5c);
+		for (; i + 32 <= inLen; i += 32) {
+			const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+			__m256i special = _mm256_cmpgt_epi8(esch20, _mm256_xor_si256(chars, _mm256_set1_epu8(0x80)));
+			special = _mm256_or_si256(special, _mm256_cmpeq_epi8(chars, esch22));
+			special = _mm256_or_si256(special, _mm256_cmpeq_epi8(chars, esch5c));
+			const uint32_t mask = _mm256_movemask_epi8(special);
+			if (mask)
+				return i + _tzcnt_u32(mask);
+		}
+		return scanString(i, Enabler<ISA::SSE2>{});
+	}
+#endif // B2J_X86
+
+#ifdef __wasm_simd128__
+	size_t scanString(size_t i, Enabler<ISA::WASM_SIMD128>) {
+		const v128_t esch20 = wasm_i8x16_splat(0x20);
+		const v128_t esch22 = wasm_i8x16_splat(0x22);
+		const v128_t esch5c = wasm_i8x16_splat(0x5c);
+		for (; i + 16 <= inLen; i += 16) {
+			const v128_t chars = wasm_v128_load(in + i);
+			v128_t special = wasm_u8x16_lt(chars, esch20);
+			special = wasm_v128_or(special, wasm_i8x16_eq(chars, esch22));
+			special = wasm_v128_or(special, wasm_i8x16_eq(chars, esch5c));
+			const uint32_t mask = wasm_i8x16_bitmask(special);
+			if (mask)
+				return i + __builtin_ctz(mask);
+		}
+		return scanString(i, Enabler<ISA::BASELINE>{});
+	}
+#endif // __wasm_simd128__
+
+#undef JSON_ERR
+};
+
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
 	char const* isa;
+#ifdef __wasm_simd128__
+	if (supports<ISA::WASM_SIMD128>()) {
+		Transcoder<ISA::WASM_SIMD128>::Init(env, exports);
+		PopulateInfo<ISA::WASM_SIMD128>::Init(env, exports);
+		FrozenPopulateInfo<ISA::WASM_SIMD128>::Init(env, exports);
+		JsonEncoder<ISA::WASM_SIMD128>::Init(env, exports);
+		isa = "WASM-SIMD128";
+	} else
+#endif
+#ifdef B2J_X86
 #ifdef B2J_USE_AVX512
 	// This is maybe slower than the AVX2 version.
 	if (supports<ISA::AVX512F>()) {
 		// (Actually uses AVX512F, AVX512BW, BMI1, BMI2)
 		Transcoder<ISA::AVX512F>::Init(env, exports);
 		PopulateInfo<ISA::AVX512F>::Init(env, exports);
+		FrozenPopulateInfo<ISA::AVX512F>::Init(env, exports);
+		JsonEncoder<ISA::AVX512F>::Init(env, exports);
 		isa = "AVX512";
 	} else
 #endif
 	if (supports<ISA::AVX2>()) {
 		Transcoder<ISA::AVX2>::Init(env, exports);
 		PopulateInfo<ISA::AVX2>::Init(env, exports);
+		FrozenPopulateInfo<ISA::AVX2>::Init(env, exports);
+		JsonEncoder<ISA::AVX2>::Init(env, exports);
 		isa = "AVX2";
 	} else if (supports<ISA::SSE42>()) {
 		Transcoder<ISA::SSE42>::Init(env, exports);
 		PopulateInfo<ISA::SSE42>::Init(env, exports);
+		FrozenPopulateInfo<ISA::SSE42>::Init(env, exports);
+		JsonEncoder<ISA::SSE42>::Init(env, exports);
 		isa = "SSE4.2";
 	} else if (supports<ISA::SSE2>()) {
 		Transcoder<ISA::SSE2>::Init(env, exports);
 		PopulateInfo<ISA::SSE2>::Init(env, exports);
+		FrozenPopulateInfo<ISA::SSE2>::Init(env, exports);
+		JsonEncoder<ISA::SSE2>::Init(env, exports);
 		isa = "SSE2";
-	} else {
+	} else
+#endif // B2J_X86
+	{
 		Transcoder<ISA::BASELINE>::Init(env, exports);
 		PopulateInfo<ISA::BASELINE>::Init(env, exports);
+		FrozenPopulateInfo<ISA::BASELINE>::Init(env, exports);
+		JsonEncoder<ISA::BASELINE>::Init(env, exports);
 		isa = "Baseline";
 	}
 
+	BsonIndex::Init(env, exports);
+
 	exports.Set(Napi::String::New(env, "ISE"), isa);
+	exports.Set(Napi::String::New(env, "INPUT_PADDING"), Napi::Number::New(env, PADDING));
 
 	return exports;
 }
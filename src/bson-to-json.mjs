@@ -1,5 +1,8 @@
 //@ts-check
 
+import {isUtf8} from "node:buffer";
+import * as zlib from "node:zlib";
+
 const BSON_DATA_NUMBER = 1;
 const BSON_DATA_STRING = 2;
 const BSON_DATA_OBJECT = 3;
@@ -53,15 +56,103 @@ function nDigits(v) {
 }
 
 // ECMA-262 Table 65 (sec. 24.5.2.2)
-const ESCAPES = {
-	0x08: 'b'.charCodeAt(0),
-	0x09: 't'.charCodeAt(0),
-	0x0a: 'n'.charCodeAt(0),
-	0x0c: 'f'.charCodeAt(0),
-	0x0d: 'r'.charCodeAt(0),
-	0x22: '"'.charCodeAt(0),
-	0x5c: '\\'.charCodeAt(0)
-};
+const ESCAPES = new Uint8Array(256);
+ESCAPES[0x08] = 'b'.charCodeAt(0);
+ESCAPES[0x09] = 't'.charCodeAt(0);
+ESCAPES[0x0a] = 'n'.charCodeAt(0);
+ESCAPES[0x0c] = 'f'.charCodeAt(0);
+ESCAPES[0x0d] = 'r'.charCodeAt(0);
+ESCAPES[0x22] = '"'.charCodeAt(0);
+ESCAPES[0x5c] = '\\'.charCodeAt(0);
+
+// Number of bytes that escaping adds for each input byte: 1 for the escapes
+// above, 5 for other control characters (\u00XX), else 0.
+const ESCAPE_EXTRA = new Int8Array(256);
+for (let c = 0; c < 0x20; c++)
+	ESCAPE_EXTRA[c] = ESCAPES[c] ? 1 : 5;
+ESCAPE_EXTRA[0x22] = 1;
+ESCAPE_EXTRA[0x5c] = 1;
+
+// ESCAPE_EXTRA for asciiOnly mode, where each code point from U+0080 up is
+// written as \uXXXX (6 B) or a surrogate pair (12 B). The lead byte of a
+// multibyte sequence accounts for that and each continuation byte takes away
+// its own 1 B. Assumes valid UTF-8.
+const ASCII_ESCAPE_EXTRA = new Int8Array(256);
+ASCII_ESCAPE_EXTRA.set(ESCAPE_EXTRA.subarray(0, 0x80));
+ASCII_ESCAPE_EXTRA.fill(-1, 0x80, 0xc0);
+ASCII_ESCAPE_EXTRA.fill(5, 0xc0, 0xf0);
+ASCII_ESCAPE_EXTRA.fill(11, 0xf0, 0x100);
+
+// ESCAPE_EXTRA for htmlSafe mode, which also writes <, > and & as \u00XX, and
+// U+2028 and U+2029 (e2 80 a8/a9) as \u20XX. 0xe2 starts other characters
+// too, so its 3 B is an upper bound.
+const HTML_ESCAPE_EXTRA = ESCAPE_EXTRA.slice();
+const HTML_ASCII_ESCAPE_EXTRA = ASCII_ESCAPE_EXTRA.slice();
+for (const c of [0x26, 0x3c, 0x3e])
+	HTML_ESCAPE_EXTRA[c] = HTML_ASCII_ESCAPE_EXTRA[c] = 5;
+HTML_ESCAPE_EXTRA[0xe2] = 3;
+
+// ESCAPE_EXTRA for populated documents' JSON in asciiOnly and htmlSafe
+// modes. Only the characters that PopulateInfo#addItems didn't escape count.
+const ASCII_POPULATED_EXTRA = ASCII_ESCAPE_EXTRA.slice();
+ASCII_POPULATED_EXTRA.fill(0, 0, 0x80);
+const HTML_POPULATED_EXTRA = new Int8Array(256);
+const HTML_ASCII_POPULATED_EXTRA = ASCII_POPULATED_EXTRA.slice();
+for (const c of [0x26, 0x3c, 0x3e])
+	HTML_POPULATED_EXTRA[c] = HTML_ASCII_POPULATED_EXTRA[c] = 5;
+HTML_POPULATED_EXTRA[0xe2] = 3;
+
+// Upper bound on the output length of a fixed-size value (the longest is a
+// Date with a 6-digit year, 29 B) plus the preceding comma or `":`. One
+// ensureSpace() call per element covers the key and any such value.
+const MAX_SCALAR_LEN = 32;
+
+// Default brotli quality. brotli's own default, 11, is meant for static assets
+// and is several times slower than 5 for little gain on JSON.
+const BROTLI_RESPONSE_QUALITY = 5;
+
+// Limits of strings kept by the stringCache option: input bytes, and output
+// bytes including the quotes.
+const STRING_CACHE_MAX = 32;
+const STRING_CACHE_MAX_ESCAPED = 66;
+
+// Runs shorter than this are copied in a loop, which is cheaper than creating
+// a subarray for TypedArray#set.
+const MIN_BULK_COPY = 16;
+
+/**
+ * Copies `src[start, end)` into `dst` at `dstIdx`. Returns the new `dstIdx`.
+ * @param {Uint8Array} dst
+ * @param {number} dstIdx
+ * @param {Uint8Array} src
+ * @param {number} start
+ * @param {number} end
+ */
+function copyRange(dst, dstIdx, src, start, end) {
+	if (end - start >= MIN_BULK_COPY) {
+		dst.set(src.subarray(start, end), dstIdx);
+		return dstIdx + end - start;
+	}
+	for (let i = start; i < end; i++)
+		dst[dstIdx++] = src[i];
+	return dstIdx;
+}
+
+/**
+ * Writes `\uXXXX` for the UTF-16 code unit `u`. Returns the new `outIdx`.
+ * @param {Uint8Array} out
+ * @param {number} outIdx
+ * @param {number} u
+ */
+function writeUnicodeEscape(out, outIdx, u) {
+	out[outIdx++] = BACKSLASH;
+	out[outIdx++] = LOWERCASE_U;
+	out[outIdx++] = hex(u >>> 12);
+	out[outIdx++] = hex((u >>> 8) & 0xF);
+	out[outIdx++] = hex((u >>> 4) & 0xF);
+	out[outIdx++] = hex(u & 0xF);
+	return outIdx;
+}
 
 function readInt32LE(buffer, index) {
 	return buffer[index] |
@@ -95,12 +186,399 @@ function bigInt64FromHalves(low, high) {
 	return BigInt.asIntN(64, full);
 }
 
+// Byte -> two lowercase hex digits.
+const HEX_PAIRS = new Uint8Array(512);
+for (let i = 0; i < 256; i++) {
+	HEX_PAIRS[i * 2] = hex(i >>> 4);
+	HEX_PAIRS[i * 2 + 1] = hex(i & 0xF);
+}
+
+/**
+ * @param {Uint8Array} a
+ * @param {Uint8Array} b
+ * @param {number} bStart
+ */
+function idEquals(a, b, bStart) {
+	// Compare highest-entropy bytes first.
+	for (let i = 11; i >= 0; i--) {
+		if (a[i] !== b[bStart + i])
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Map keyed by ObjectId bytes that can be queried without allocating a key.
+ * Like ObjectIdHasher in the C++ version, this hashes the low 8 bytes, which
+ * are high-entropy.
+ * @template V
+ */
+class ObjectIdMap {
+	constructor() {
+		/** @type {Map<number, {id: Uint8Array, value: V}[]>} */
+		this.buckets = new Map();
+		this.size = 0;
+	}
+
+	/**
+	 * Masked to stay in Smi range so Map keys don't allocate HeapNumbers.
+	 * @param {Uint8Array} buf
+	 * @param {number} start
+	 * @private
+	 */
+	static hash(buf, start) {
+		return (readInt32LE(buf, start + 4) ^ readInt32LE(buf, start + 8)) & 0x3FFFFFFF;
+	}
+
+	/**
+	 * @param {Uint8Array} buf
+	 * @param {number} start
+	 * @private
+	 */
+	find(buf, start) {
+		const bucket = this.buckets.get(ObjectIdMap.hash(buf, start));
+		if (bucket) {
+			for (let i = 0; i < bucket.length; i++) {
+				if (idEquals(bucket[i].id, buf, start))
+					return bucket[i];
+			}
+		}
+		return undefined;
+	}
+
+	/**
+	 * @param {Uint8Array} buf
+	 * @param {number} start
+	 */
+	get(buf, start) {
+		return this.find(buf, start)?.value;
+	}
+
+	/**
+	 * Copies the 12 bytes at `buf[start]` for the key.
+	 * @param {Uint8Array} buf
+	 * @param {number} start
+	 * @param {V} value
+	 */
+	set(buf, start, value) {
+		const entry = this.find(buf, start);
+		if (entry) {
+			entry.value = value;
+			return;
+		}
+		const h = ObjectIdMap.hash(buf, start);
+		let bucket = this.buckets.get(h);
+		if (!bucket)
+			this.buckets.set(h, bucket = []);
+		bucket.push({id: buf.slice(start, start + 12), value});
+		this.size++;
+	}
+
+	/**
+	 * @param {Uint8Array} buf
+	 * @param {number} start
+	 */
+	delete(buf, start) {
+		const bucket = this.buckets.get(ObjectIdMap.hash(buf, start));
+		if (!bucket)
+			return;
+		for (let i = 0; i < bucket.length; i++) {
+			if (idEquals(bucket[i].id, buf, start)) {
+				bucket.splice(i, 1);
+				this.size--;
+				return;
+			}
+		}
+	}
+
+	*keys() {
+		for (const bucket of this.buckets.values()) {
+			for (const entry of bucket)
+				yield entry.id;
+		}
+	}
+}
+
+/**
+ * A node in the trie of populated paths, one level per dotted path segment.
+ * Transcoders keep a pointer to the node for the current position, so they
+ * can match keys by comparing bytes instead of building path strings.
+ * @typedef {object} PathNode
+ * @property {string} path Full dotted path.
+ * @property {Uint8Array} key This segment.
+ * @property {PathNode[]} children
+ * @property {ObjectIdMap<Uint8Array> | null} ids
+ */
+
+/**
+ * Returns the child of `node` whose key equals `buf[start, end)`, or null.
+ * @param {PathNode} node
+ * @param {Uint8Array} buf
+ * @param {number} start
+ * @param {number} end
+ */
+function findChild(node, buf, start, end) {
+	const children = node.children;
+	const len = end - start;
+	outer: for (let i = 0; i < children.length; i++) {
+		const key = children[i].key;
+		if (key.length !== len)
+			continue;
+		for (let j = 0; j < len; j++) {
+			if (key[j] !== buf[start + j])
+				continue outer;
+		}
+		return children[i];
+	}
+	return null;
+}
+
+// Returns true if buf[start, end) is "_id".
+function isIdKey(buf, start, end) {
+	return end - start === 3 && buf[start] === 0x5f && buf[start + 1] === 0x69 &&
+		buf[start + 2] === 0x64;
+}
+
+/**
+ * 32-bit FNV-1a hash of `buf`, for the response cache. Cache hits are verified
+ * by comparing the input.
+ * @param {Uint8Array} buf
+ */
+function hashBytes(buf) {
+	let h = 0x811c9dc5;
+	for (let i = 0; i < buf.length; i++)
+		h = Math.imul(h ^ buf[i], 0x01000193);
+	return h >>> 0;
+}
+
+const XXH_P1 = 0x9e3779b185ebca87n;
+const XXH_P2 = 0xc2b2ae3d27d4eb4fn;
+const XXH_P3 = 0x165667b19e3779f9n;
+const XXH_P4 = 0x85ebca77c2b2ae63n;
+const XXH_P5 = 0x27d4eb2f165667c5n;
+
+/**
+ * XXH64 (seed 0) of `buf` as 16 hex digits, for the `hash` option.
+ * @param {Buffer} buf
+ */
+function xxh64(buf) {
+	const u64 = (/** @type {bigint} */ x) => BigInt.asUintN(64, x);
+	const rotl = (/** @type {bigint} */ x, /** @type {bigint} */ r) => u64((x << r) | (x >> (64n - r)));
+	const round = (/** @type {bigint} */ acc, /** @type {bigint} */ lane) => u64(rotl(u64(acc + lane * XXH_P2), 31n) * XXH_P1);
+	const n = buf.length;
+	let i = 0;
+	let h;
+	if (n >= 32) {
+		const v = [u64(XXH_P1 + XXH_P2), XXH_P2, 0n, u64(-XXH_P1)];
+		for (; i + 32 <= n; i += 32) {
+			for (let j = 0; j < 4; j++)
+				v[j] = round(v[j], buf.readBigUInt64LE(i + j * 8));
+		}
+		h = u64(rotl(v[0], 1n) + rotl(v[1], 7n) + rotl(v[2], 12n) + rotl(v[3], 18n));
+		for (const lane of v)
+			h = u64((h ^ round(0n, lane)) * XXH_P1 + XXH_P4);
+	} else {
+		h = XXH_P5;
+	}
+	h = u64(h + BigInt(n));
+	for (; i + 8 <= n; i += 8)
+		h = u64(rotl(h ^ round(0n, buf.readBigUInt64LE(i)), 27n) * XXH_P1 + XXH_P4);
+	if (i + 4 <= n) {
+		h = u64(rotl(h ^ u64(BigInt(buf.readUInt32LE(i)) * XXH_P1), 23n) * XXH_P2 + XXH_P3);
+		i += 4;
+	}
+	for (; i < n; i++)
+		h = u64(rotl(h ^ u64(BigInt(buf[i]) * XXH_P5), 11n) * XXH_P1);
+	h ^= h >> 33n;
+	h = u64(h * XXH_P2);
+	h ^= h >> 29n;
+	h = u64(h * XXH_P3);
+	h ^= h >> 32n;
+	return h.toString(16).padStart(16, "0");
+}
+
+/**
+ * Parses the `changeEnvelope` option, an object mapping output keys to dotted
+ * paths in the event.
+ * @param {Record<string, string>} envelope
+ */
+function parseEnvelope(envelope) {
+	const entries = envelope !== null && typeof envelope === "object" && !Array.isArray(envelope) ?
+		Object.entries(envelope) : [];
+	if (!entries.length || entries.some(([, path]) => typeof path !== "string" || !path))
+		throw new TypeError("changeEnvelope must map output keys to event paths");
+	return entries.map(([key, path]) => ({
+		key: Buffer.from(JSON.stringify(key) + ":"),
+		path: path.split(".").map(seg => Buffer.from(seg))
+	}));
+}
+
+/**
+ * @typedef {object} ArraySlice
+ * @property {number} skip
+ * @property {number} limit
+ * @property {Buffer | null} countKey JSON-encoded with the colon.
+ * @property {Buffer | null} countName The same key unencoded, for sorting.
+ */
+
+/**
+ * Parses the `arraySlices` option, an object mapping dotted paths to
+ * `{skip, limit, count}`. Returns null if it's empty.
+ * @param {Record<string, {skip?: number, limit?: number, count?: boolean | string}>} slices
+ * @returns {Map<string, ArraySlice> | null}
+ */
+function parseArraySlices(slices) {
+	const invalid = () => new TypeError("arraySlices must map paths to {skip, limit, count}");
+	const isCount = (/** @type {unknown} */ n) => n === undefined ||
+		(Number.isInteger(n) && /** @type {number} */ (n) >= 0 && /** @type {number} */ (n) <= 0x7fffffff);
+	if (slices === null || typeof slices !== "object" || Array.isArray(slices))
+		throw invalid();
+	const map = new Map();
+	for (const [path, spec] of Object.entries(slices)) {
+		if (!path || spec === null || typeof spec !== "object")
+			throw invalid();
+		const {skip = 0, limit = 0x7fffffff, count} = spec;
+		if (!isCount(skip) || !isCount(limit))
+			throw invalid();
+		let countKey = null;
+		if (typeof count === "string" && count)
+			countKey = count;
+		else if (count === true)
+			countKey = path.slice(path.lastIndexOf(".") + 1) + "Count";
+		else if (count !== undefined && count !== false)
+			throw invalid();
+		map.set(path, {
+			skip,
+			limit,
+			countKey: countKey === null ? null : Buffer.from(JSON.stringify(countKey) + ":"),
+			countName: countKey === null ? null : Buffer.from(countKey)
+		});
+	}
+	return map.size ? map : null;
+}
+
+const DEFAULT_ENVELOPE = parseEnvelope({
+	operationType: "operationType",
+	documentKey: "documentKey",
+	fullDocument: "fullDocument",
+	updateDescription: "updateDescription"
+});
+
+/**
+ * Decodes the key at `input[start, end)`, for matching `arraySlices` paths.
+ * @param {Uint8Array} input
+ * @param {number} start
+ * @param {number} end
+ */
+function keyString(input, start, end) {
+	return Buffer.from(input.buffer, input.byteOffset + start, end - start).toString();
+}
+
+/**
+ * Like `valueSize`, but also sizes the types that aren't written as JSON, for
+ * skipping over elements that won't be output.
+ * @param {Uint8Array} input
+ * @param {number} type
+ * @param {number} i
+ * @param {number} avail
+ */
+function anyValueSize(input, type, i, avail) {
+	let size;
+	switch (type) {
+	case BSON_DATA_DECIMAL128: size = 16; break;
+	case BSON_DATA_TIMESTAMP: size = 8; break;
+	case BSON_DATA_MIN_KEY:
+	case BSON_DATA_MAX_KEY: size = 0; break;
+	case BSON_DATA_BINARY: // subtype
+	case BSON_DATA_SYMBOL:
+	case BSON_DATA_CODE:
+	case BSON_DATA_DBPOINTER:
+	case BSON_DATA_CODE_W_SCOPE: {
+		if (avail < 4)
+			throw new Error("Truncated BSON");
+		const len = readInt32LE(input, i);
+		if (len < 0)
+			throw new Error("Bad length");
+		// A code-with-scope's length includes itself.
+		size = type === BSON_DATA_CODE_W_SCOPE ? len :
+			4 + len + (type === BSON_DATA_BINARY ? 1 : type === BSON_DATA_DBPOINTER ? 12 : 0);
+		break;
+	}
+	case BSON_DATA_REGEXP: { // Pattern and flags cstrings.
+		const end = i + avail;
+		const patternEnd = input.indexOf(0, i);
+		const flagsEnd = patternEnd === -1 || patternEnd >= end ? -1 : input.indexOf(0, patternEnd + 1);
+		if (flagsEnd === -1 || flagsEnd >= end)
+			throw new Error("Truncated BSON");
+		size = flagsEnd + 1 - i;
+		break;
+	}
+	default:
+		return valueSize(input, type, i, avail);
+	}
+	if (size > avail)
+		throw new Error("Truncated BSON");
+	return size;
+}
+
+/**
+ * Returns the offset of the type byte of the element with the given key in
+ * the document at `input[inIdx]`, or -1.
+ * @param {Uint8Array} input
+ * @param {number} inIdx
+ * @param {Uint8Array} key
+ */
+function findElement(input, inIdx, key) {
+	if (input.length - inIdx < 5)
+		throw new Error("Truncated BSON");
+	const size = readInt32LE(input, inIdx);
+	if (size < 5)
+		throw new Error("BSON size must be >= 5");
+	if (size + inIdx > input.length)
+		throw new Error("BSON size exceeds input length");
+	const end = inIdx + size;
+	if (input[end - 1] !== 0)
+		throw new Error("BSON document must end with a null byte");
+
+	inIdx += 4;
+	while (input[inIdx] !== 0) {
+		const start = inIdx++;
+		// The document's terminator bounds the key.
+		const nameEnd = input.indexOf(0, inIdx);
+		const valueStart = nameEnd + 1;
+		if (valueStart >= end)
+			throw new Error("Truncated BSON (in key)");
+		if (nameEnd - inIdx === key.length && Buffer.compare(input.subarray(inIdx, nameEnd), key) === 0)
+			return start;
+		// Events have siblings like clusterTime (a Timestamp) that aren't
+		// output, so skip any type.
+		inIdx = valueStart + anyValueSize(input, input[start], valueStart, end - 1 - valueStart);
+	}
+	return -1;
+}
+
+/**
+ * @typedef {object} CacheEntry
+ * @property {Uint8Array} input
+ * @property {Buffer} output
+ * @property {Uint8Array} docId
+ * @property {number} bytes Input plus output.
+ */
+
 export class PopulateInfo {
 	constructor() {
-		/** @type {Map<string, Map<string, Uint8Array>>} */
+		/** @type {Map<string, ObjectIdMap<Uint8Array>>} */
 		this.paths = new Map();
-		/** @type {Record<string, Set<string>>} */
+		/** @type {Record<string, ObjectIdMap<true>>} */
 		this.missingIds = Object.create(null);
+		/** @type {PathNode} */
+		this.root = {path: "", key: new Uint8Array(0), children: [], ids: null};
+		/**
+		 * Incremented when paths change, so Transcoders can drop cached
+		 * output.
+		 * @private
+		 */
+		this.version = 0;
 	}
 
 	/**
@@ -108,15 +586,21 @@ export class PopulateInfo {
 	 * @param {Uint8Array[]} items
 	 */
 	addItems(path, items) {
-		if (!this.paths.has(path))
-			this.paths.set(path, new Map());
-		const map = /** @type {Map<string, Uint8Array>} */ (this.paths.get(path));
+		this.version++;
+		let map = this.paths.get(path);
+		if (!map) {
+			map = new ObjectIdMap();
+			this.setPath(path, map);
+		}
 		const mpSet = this.missingIds[path];
+		const t = new Transcoder();
 		for (const item of items) {
-			const t = new Transcoder();
+			t.hasDocId = false;
 			const jsonBuf = t.transcode(item);
-			map.set(t.docId, jsonBuf);
-			mpSet?.delete(t.docId);
+			if (!t.hasDocId)
+				throw new Error("Populate items must have an ObjectId _id");
+			map.set(t.docId, 0, jsonBuf);
+			mpSet?.delete(t.docId, 0);
 		}
 	}
 
@@ -128,29 +612,533 @@ export class PopulateInfo {
 		const p1Map = this.paths.get(path1);
 		if (!p1Map)
 			throw new Error("Path not found: " + path1);
-		this.paths.set(path2, p1Map);
+		this.version++;
+		this.setPath(path2, p1Map);
 	}
 
 	/** @param {string} path */
 	getMissingIdsForPath(path) {
 		const o = [];
-		for (const id of this.missingIds[path] ?? [])
-			o.push(Buffer.from(id, "hex"));
+		for (const id of this.missingIds[path]?.keys() ?? [])
+			o.push(Buffer.from(id));
 		return o;
 	}
+
+	/**
+	 * @param {string} path
+	 * @param {ObjectIdMap<Uint8Array>} map
+	 * @private
+	 */
+	setPath(path, map) {
+		this.paths.set(path, map);
+		insertPath(this.root, path, map);
+	}
+}
+
+/**
+ * Adds `path` to the trie rooted at `root`.
+ * @param {PathNode} root
+ * @param {string} path
+ * @param {ObjectIdMap<Uint8Array>} map
+ */
+function insertPath(root, path, map) {
+	let node = root;
+	for (const segment of path.split(".")) {
+		const key = Buffer.from(segment);
+		let child = findChild(node, key, 0, key.length);
+		if (!child) {
+			const childPath = node === root ? segment : `${node.path}.${segment}`;
+			child = {path: childPath, key, children: [], ids: null};
+			node.children.push(child);
+		}
+		node = child;
+	}
+	node.ids = map;
+}
+
+/**
+ * Read-only snapshot of a PopulateInfo that can be shared with worker threads.
+ * The items are serialized into a SharedArrayBuffer, which is the `handle`:
+ * posting it to a worker shares the memory instead of copying it.
+ *
+ * Layout (little-endian u32s): nMaps, then per map nEntries and per entry a
+ * 12-byte ObjectId, JSON length and JSON; then nPaths, and per path its UTF-8
+ * length, the path and the index of its map.
+ */
+export class FrozenPopulateInfo {
+	/** @param {PopulateInfo | FrozenPopulateInfo | SharedArrayBuffer} source */
+	constructor(source) {
+		if (source instanceof FrozenPopulateInfo)
+			source = source.handle;
+		else if (source instanceof PopulateInfo)
+			source = FrozenPopulateInfo.serialize(source);
+		else if (typeof source === "object" && source !== null && !(source instanceof SharedArrayBuffer))
+			throw new TypeError("Expected a PopulateInfo or FrozenPopulateInfo");
+		else if (!(source instanceof SharedArrayBuffer))
+			throw new TypeError("Expected a PopulateInfo or a handle");
+
+		/** @readonly */
+		this.handle = source;
+		/** @type {PathNode} */
+		this.root = {path: "", key: new Uint8Array(0), children: [], ids: null};
+
+		const buf = new Uint8Array(source);
+		let idx = 0;
+		const maps = new Array(readInt32LE(buf, idx));
+		idx += 4;
+		for (let i = 0; i < maps.length; i++) {
+			const map = maps[i] = new ObjectIdMap();
+			const nEntries = readInt32LE(buf, idx);
+			idx += 4;
+			for (let j = 0; j < nEntries; j++) {
+				const len = readInt32LE(buf, idx + 12);
+				map.set(buf, idx, buf.subarray(idx + 16, idx + 16 + len));
+				idx += 16 + len;
+			}
+		}
+		const nPaths = readInt32LE(buf, idx);
+		idx += 4;
+		for (let i = 0; i < nPaths; i++) {
+			const len = readInt32LE(buf, idx);
+			const path = Buffer.from(source, idx + 4, len).toString();
+			idx += 4 + len;
+			insertPath(this.root, path, maps[readInt32LE(buf, idx)]);
+			idx += 4;
+		}
+	}
+
+	/**
+	 * @param {PopulateInfo} p
+	 * @private
+	 */
+	static serialize(p) {
+		// repeatPath shares maps between paths; keep sharing them.
+		/** @type {Map<ObjectIdMap<Uint8Array>, number>} */
+		const mapIdxs = new Map();
+		let size = 8;
+		for (const [path, map] of p.paths) {
+			size += 8 + Buffer.byteLength(path);
+			if (mapIdxs.has(map))
+				continue;
+			mapIdxs.set(map, mapIdxs.size);
+			size += 4;
+			for (const bucket of map.buckets.values()) {
+				for (const entry of bucket)
+					size += 16 + entry.value.length;
+			}
+		}
+
+		const sab = new SharedArrayBuffer(size);
+		const out = Buffer.from(sab);
+		let idx = out.writeUInt32LE(mapIdxs.size, 0);
+		for (const map of mapIdxs.keys()) {
+			idx = out.writeUInt32LE(map.size, idx);
+			for (const bucket of map.buckets.values()) {
+				for (const {id, value} of bucket) {
+					out.set(id, idx);
+					idx = out.writeUInt32LE(value.length, idx + 12);
+					out.set(value, idx);
+					idx += value.length;
+				}
+			}
+		}
+		idx = out.writeUInt32LE(p.paths.size, idx);
+		for (const [path, map] of p.paths) {
+			const len = out.write(path, idx + 4);
+			idx = out.writeUInt32LE(len, idx) + len;
+			idx = out.writeUInt32LE(/** @type {number} */ (mapIdxs.get(map)), idx);
+		}
+		return sab;
+	}
+}
+
+/**
+ * Returns the size of the value of type `type` at `input[i]`, which has to fit
+ * in `avail` bytes.
+ * @param {Uint8Array} input
+ * @param {number} type
+ * @param {number} i
+ * @param {number} avail
+ */
+function valueSize(input, type, i, avail) {
+	let size;
+	switch (type) {
+	case BSON_DATA_STRING:
+	case BSON_DATA_OBJECT:
+	case BSON_DATA_ARRAY: {
+		if (avail < 4)
+			throw new Error("Truncated BSON");
+		const len = readInt32LE(input, i);
+		if (type === BSON_DATA_STRING) {
+			if (len <= 0 || len > avail - 4)
+				throw new Error("Bad string length");
+			return 4 + len;
+		}
+		if (len < 5)
+			throw new Error("BSON size must be >= 5");
+		if (len > avail)
+			throw new Error("BSON size exceeds input length");
+		return len;
+	}
+	case BSON_DATA_OID: size = 12; break;
+	case BSON_DATA_INT: size = 4; break;
+	case BSON_DATA_NUMBER:
+	case BSON_DATA_DATE:
+	case BSON_DATA_LONG: size = 8; break;
+	case BSON_DATA_BOOLEAN: size = 1; break;
+	case BSON_DATA_NULL:
+	case BSON_DATA_UNDEFINED: size = 0; break;
+	case BSON_DATA_DECIMAL128:
+	case BSON_DATA_BINARY:
+	case BSON_DATA_REGEXP:
+	case BSON_DATA_SYMBOL:
+	case BSON_DATA_TIMESTAMP:
+	case BSON_DATA_MIN_KEY:
+	case BSON_DATA_MAX_KEY:
+	case BSON_DATA_CODE:
+	case BSON_DATA_CODE_W_SCOPE:
+	case BSON_DATA_DBPOINTER:
+		throw new Error("BSON type incompatible with JSON");
+	default:
+		throw new Error("Unknown BSON type " + type);
+	}
+	if (size > avail)
+		throw new Error("Truncated BSON");
+	return size;
+}
+
+/**
+ * Returns the offsets of the elements of the object whose first element is at
+ * `input[i]` and whose terminator is at `input[last]`, in key byte order.
+ * Elements with equal keys stay in document order. If countName returns the
+ * name of an array's count sibling, that's sorted in too, as `~offset` of
+ * the array.
+ * @param {Uint8Array} input
+ * @param {number} i
+ * @param {number} last
+ * @param {((keyStart: number, keyEnd: number) => Buffer | null) | null} [countName]
+ */
+function sortedElements(input, i, last, countName = null) {
+	/** @type {{offset: number, key: Uint8Array}[]} */
+	const elements = [];
+	while (i < last) {
+		const type = input[i];
+		if (type === 0)
+			throw new Error("BSON size doesn't match document");
+		// The terminator bounds the key.
+		const keyEnd = input.indexOf(0, i + 1);
+		const valueStart = keyEnd + 1;
+		if (valueStart > last)
+			throw new Error("Truncated BSON (in key)");
+		elements.push({offset: i, key: input.subarray(i + 1, keyEnd)});
+		if (countName && type === BSON_DATA_ARRAY) {
+			// Its count sibling is sorted among the keys too.
+			const name = countName(i + 1, keyEnd);
+			if (name)
+				elements.push({offset: ~i, key: name});
+		}
+		i = valueStart + valueSize(input, type, valueStart, last - valueStart);
+	}
+	// Array#sort is stable.
+	elements.sort((a, b) => Buffer.compare(a.key, b.key));
+	return elements.map(e => e.offset);
+}
+
+/**
+ * Returns the number of elements in the array at i, which sortedElements()
+ * has checked the size of.
+ * @param {Uint8Array} input
+ * @param {number} i
+ */
+function arrayLength(input, i) {
+	const last = i + readInt32LE(input, i) - 1; // the terminator
+	i += 4;
+	let n = 0;
+	while (input[i] !== 0) {
+		// Keys of array elements are their index.
+		const valueStart = i + nDigits(n) + 1;
+		if (valueStart > last)
+			throw new Error("Truncated BSON");
+		i = valueStart + valueSize(input, input[i], valueStart, last - valueStart);
+		n++;
+	}
+	return n;
+}
+
+// Length of the populate version and slice generation that start the fields
+// of transcodeFields().
+const FIELDS_HEADER = 2;
+
+// Fields of each BsonIndex tape entry. See TapeEntry in the C++ version.
+const TAPE_TYPE = 0;
+const TAPE_KEY = 1; // offset of the key; the type byte precedes it
+const TAPE_VALUE = 2; // offset of the value; the key's terminator precedes it
+const TAPE_SIZE = 3;
+const TAPE_NEXT = 4; // index of the entry after this one's descendants
+const TAPE_FIELDS = 5;
+
+/**
+ * Structural index of a BSON document, built once and reused by
+ * `Transcoder#getMissingIds`, which walks it, and `#transcodePath`, which
+ * finds elements with it.
+ */
+export class BsonIndex {
+	/**
+	 * @param {Uint8Array} input BSON-encoded input. Shouldn't be modified
+	 * afterwards.
+	 */
+	constructor(input) {
+		if (!(input instanceof Uint8Array))
+			throw new Error("Input must be a buffer");
+		if (input.length < 5)
+			throw new Error("Input buffer must have length >= 5");
+		/** @private */
+		this.buffer = input;
+		/**
+		 * TAPE_FIELDS numbers per element, in document order. Entry 0 is the
+		 * document itself.
+		 * @private
+		 * @type {number[]}
+		 */
+		this.tape = [];
+		this.build();
+	}
+
+	/** The number of elements, including the document itself. */
+	get length() {
+		return this.tape.length / TAPE_FIELDS;
+	}
+
+	/** @private */
+	build() {
+		const input = this.buffer;
+		const tape = this.tape;
+		/** @type {{entry: number, end: number}[]} */
+		const open = [];
+		let i = 0;
+
+		/**
+		 * Opens the document at i, which has to end before limit.
+		 * @param {number} type
+		 * @param {number} keyOffset
+		 * @param {number} limit
+		 */
+		const openDocument = (type, keyOffset, limit) => {
+			if (i + 4 > limit)
+				throw new Error("Truncated BSON");
+			const size = readInt32LE(input, i);
+			if (size < 5)
+				throw new Error("BSON size must be >= 5");
+			if (size > limit - i)
+				throw new Error("BSON size exceeds input length");
+			if (input[i + size - 1] !== 0)
+				throw new Error("BSON document must end with a null byte");
+			open.push({entry: tape.length / TAPE_FIELDS, end: i + size});
+			tape.push(type, keyOffset, i, size, 0);
+			i += 4;
+		};
+
+		openDocument(BSON_DATA_OBJECT, 0, input.length);
+
+		while (open.length) {
+			const {entry, end} = open[open.length - 1];
+			const type = input[i++];
+			if (type === 0) {
+				if (i !== end)
+					throw new Error("BSON size doesn't match document");
+				tape[entry * TAPE_FIELDS + TAPE_NEXT] = tape.length / TAPE_FIELDS;
+				open.pop();
+				continue;
+			}
+
+			// The document's terminator bounds the key.
+			const keyOffset = i;
+			i = input.indexOf(0, i) + 1;
+			if (i === end)
+				throw new Error("Truncated BSON (in key)");
+			// Bytes left before the document's terminator.
+			const avail = end - 1 - i;
+
+			if (type === BSON_DATA_OBJECT || type === BSON_DATA_ARRAY) {
+				openDocument(type, keyOffset, end - 1);
+				continue;
+			}
+
+			const size = valueSize(input, type, i, avail);
+			tape.push(type, keyOffset, i, size, tape.length / TAPE_FIELDS + 1);
+			i += size;
+		}
+	}
+
+	/**
+	 * Returns the child of `entry` with the key `seg`, or -1. Array elements
+	 * are addressed by index.
+	 * @param {number} entry
+	 * @param {string} seg
+	 * @private
+	 */
+	child(entry, seg) {
+		const tape = this.tape;
+		const base = entry * TAPE_FIELDS;
+		const type = tape[base + TAPE_TYPE];
+		const next = tape[base + TAPE_NEXT];
+		let child = entry + 1;
+		if (type === BSON_DATA_ARRAY) {
+			// Array keys are always "0", "1", ..., so skip rather than compare.
+			if (!/^(0|[1-9][0-9]{0,8})$/.test(seg))
+				return -1;
+			for (let idx = Number(seg); idx && child < next; idx--)
+				child = tape[child * TAPE_FIELDS + TAPE_NEXT];
+		} else if (type === BSON_DATA_OBJECT) {
+			const key = Buffer.from(seg);
+			const input = this.buffer;
+			outer: for (; child < next; child = tape[child * TAPE_FIELDS + TAPE_NEXT]) {
+				const keyOffset = tape[child * TAPE_FIELDS + TAPE_KEY];
+				if (tape[child * TAPE_FIELDS + TAPE_VALUE] - keyOffset - 1 !== key.length)
+					continue;
+				for (let j = 0; j < key.length; j++) {
+					if (input[keyOffset + j] !== key[j])
+						continue outer;
+				}
+				break;
+			}
+		} else {
+			return -1;
+		}
+		return child < next ? child : -1;
+	}
 }
 
 export class Transcoder {
-	constructor(populateInfo) {
+	/**
+	 * @param {PopulateInfo | FrozenPopulateInfo} [populateInfo]
+	 * @param {{invalidUtf8?: "copy" | "error" | "replace", asciiOnly?: boolean, htmlSafe?: boolean, maxDepth?: number, cacheBytes?: number, stringCache?: number, changeEnvelope?: Record<string, string>, canonical?: boolean, hash?: boolean, arraySlices?: Record<string, {skip?: number, limit?: number, count?: boolean | string}>}} [options]
+	 */
+	constructor(populateInfo, {invalidUtf8 = "copy", asciiOnly = false, htmlSafe = false, maxDepth = 200, cacheBytes = 0, stringCache = 0, changeEnvelope = undefined, canonical = false, hash = false, arraySlices = undefined} = {}) {
+		if (typeof populateInfo === "object" && populateInfo !== null &&
+			!(populateInfo instanceof PopulateInfo) && !(populateInfo instanceof FrozenPopulateInfo))
+			throw new TypeError("Expected a PopulateInfo or FrozenPopulateInfo");
+		if (invalidUtf8 !== "copy" && invalidUtf8 !== "error" && invalidUtf8 !== "replace")
+			throw new TypeError('invalidUtf8 must be "copy", "error" or "replace"');
+		if (!Number.isInteger(maxDepth) || maxDepth < 1 || maxDepth > 0xffffffff)
+			throw new TypeError("maxDepth must be a positive integer");
+		if (!Number.isSafeInteger(cacheBytes) || cacheBytes < 0)
+			throw new TypeError("cacheBytes must be a non-negative integer");
+		if (!Number.isInteger(stringCache) || stringCache < 0 || stringCache > 65536)
+			throw new TypeError("stringCache must be an integer from 0 to 65536");
+		/**
+		 * Fields of the change event output envelope: the JSON-encoded key
+		 * with the colon, and the path in the event.
+		 * @private
+		 * @type {{key: Buffer, path: Buffer[]}[] | null}
+		 */
+		this.envelope = changeEnvelope === undefined ? null : parseEnvelope(changeEnvelope);
+		/**
+		 * Slices of the arrays at each path, or null for none.
+		 * @private
+		 * @type {Map<string, ArraySlice> | null}
+		 */
+		this.arraySlices = arraySlices === undefined ? null : parseArraySlices(arraySlices);
+		/** @private Incremented by setArraySlices(). */
+		this.sliceGeneration = 0;
+		/**
+		 * Key path of the value being transcoded, if arraySlices is set. Array
+		 * elements share the array's path.
+		 * @private
+		 */
+		this.slicePath = "";
+		/**
+		 * Length of the last sliced array, for its count sibling.
+		 * @private
+		 */
+		this.sliceCount = 0;
 		/** @private */
-		this.outIdx = 0;
+		this.cacheBytes = cacheBytes;
+		/**
+		 * Response cache by input hash, least recently used first.
+		 * @private
+		 * @type {Map<number, CacheEntry>}
+		 */
+		this.cache = new Map();
+		/** @private */
+		this.cacheUsed = 0;
+		/** @private */
+		this.cacheHits = 0;
+		/** @private */
+		this.cacheMisses = 0;
+		/**
+		 * populateInfo.version that the cached output was populated with.
+		 * @private
+		 */
+		this.cacheVersion = 0;
+		let slots = stringCache ? 1 : 0;
+		while (slots && slots < stringCache)
+			slots *= 2;
+		/**
+		 * Short string values by hash, each with the raw bytes and the quoted
+		 * and escaped output. The length is a power of two.
+		 * @private
+		 * @type {({raw: Uint8Array, json: Uint8Array} | undefined)[]}
+		 */
+		this.stringCache = new Array(slots);
+		/** @private */
+		this.stringHits = 0;
+		/** @private */
+		this.stringMisses = 0;
+		/** @private For compressStats. */
+		this.compressChunks = 0;
+		/** @private */
+		this.compressPeak = 0;
 		/** @private */
-		this.currentPath = "";
+		this.maxDepth = maxDepth;
+		/** @private */
+		this.invalidUtf8 = invalidUtf8;
+		/** @private */
+		this.asciiOnly = Boolean(asciiOnly);
+		/**
+		 * Whether object keys are written in byte order.
+		 * @private
+		 */
+		this.canonical = Boolean(canonical);
+		/** @private */
+		this.hashing = Boolean(hash);
+		/**
+		 * XXH64 of the last output, if hashing. Cleared at the start of every
+		 * call that outputs, in case it throws.
+		 * @private
+		 * @type {string | undefined}
+		 */
+		this.lastHash = undefined;
+		/**
+		 * Whether strings need fixUtf8(). asciiOnly mode needs valid UTF-8 to
+		 * decode.
+		 * @private
+		 */
+		this.checkUtf8 = invalidUtf8 !== "copy" || this.asciiOnly;
+		/** @private */
+		this.escapeExtra = htmlSafe ?
+			(this.asciiOnly ? HTML_ASCII_ESCAPE_EXTRA : HTML_ESCAPE_EXTRA) :
+			(this.asciiOnly ? ASCII_ESCAPE_EXTRA : ESCAPE_EXTRA);
+		/**
+		 * escapeExtra for populated documents, or null if they're copied as-is.
+		 * @private
+		 */
+		this.populatedExtra = htmlSafe ?
+			(this.asciiOnly ? HTML_ASCII_POPULATED_EXTRA : HTML_POPULATED_EXTRA) :
+			(this.asciiOnly ? ASCII_POPULATED_EXTRA : null);
+		/** @private */
+		this.outIdx = 0;
 		/** @type {Buffer} */
 		// @ts-expect-error
 		this.out = null;
-		/** @type {string} */
-		this.docId = "";
+		/** The top-level `_id` of the last transcoded document. */
+		this.docId = new Uint8Array(12);
+		/**
+		 * Set when docId is written, for PopulateInfo#addItems to check.
+		 * @private
+		 */
+		this.hasDocId = false;
+		/** @type {PopulateInfo | FrozenPopulateInfo | undefined} */
 		this.populateInfo = populateInfo;
 	}
 
@@ -158,12 +1146,22 @@ export class Transcoder {
 	 * Finds missing IDs for paths in the `populateInfo` object. Query for
 	 * them, then call `populateInfo.addItems` with the results, then
 	 * `transcode()` the `input`.
-	 * @param {Uint8Array} input BSON-encoded input.
+	 * @param {Uint8Array | BsonIndex} input BSON-encoded input.
 	 * @param {number} inIdx Internal
 	 * @param {boolean} isArray Internal
-	 * @param {string | null} baseKey Internal
+	 * @param {PathNode | null} [node] Internal
+	 * @param {number} [depth] Internal
 	 */
-	getMissingIds(input, inIdx = 0, isArray = false, baseKey = null) {
+	getMissingIds(input, inIdx = 0, isArray = false, node = this.populateInfo?.root ?? null, depth = 1) {
+		if (this.populateInfo instanceof FrozenPopulateInfo)
+			throw new Error("Can't record missing IDs in a FrozenPopulateInfo");
+		if (input instanceof BsonIndex) {
+			this.getMissingIdsFromIndex(input, node);
+			return;
+		}
+		if (depth > this.maxDepth)
+			throw new Error("Maximum nesting depth exceeded");
+
 		const inLen = input.length;
 		const size = readInt32LE(input, inIdx);
 
@@ -171,6 +1169,8 @@ export class Transcoder {
 			throw new Error("BSON size must be >= 5");
 		if (size + inIdx > inLen)
 			throw new Error("BSON size exceeds input length");
+		if (input[inIdx + size - 1] !== 0)
+			throw new Error("BSON document must end with a null byte");
 
 		inIdx += 4;
 
@@ -180,6 +1180,8 @@ export class Transcoder {
 			const elementType = input[inIdx++];
 			if (elementType === 0) break;
 
+			// Array elements share the array's path.
+			let child = node;
 			if (isArray) {
 				// Skip the number of digits in the key.
 				inIdx += nDigits(arrIdx);
@@ -194,8 +1196,8 @@ export class Transcoder {
 					throw new Error("Bad BSON Document: illegal CString");
 
 				inIdx = nameEnd + 1; // +1 to skip null terminator
-				const key = input.subarray(nameStart, nameEnd);
-				this.currentPath = baseKey ? `${baseKey}.${key}` : `${key}`;
+				if (node)
+					child = findChild(node, input, nameStart, nameEnd);
 			}
 
 			switch (elementType) {
@@ -210,13 +1212,10 @@ export class Transcoder {
 			case BSON_DATA_OID: {
 				if (inIdx + 12 > inLen)
 					throw new Error("Truncated BSON (in ObjectId)");
-				const idMapForPath = this.populateInfo?.paths.get(this.currentPath);
-				if (idMapForPath) {
-					const id = this.readObjectId(input, inIdx);
-					const doc = idMapForPath.get(id);
-					if (!doc) {
-						(this.populateInfo.missingIds[this.currentPath] ??= new Set()).add(id);
-					}
+				const idMapForPath = child?.ids;
+				if (idMapForPath && !idMapForPath.get(input, inIdx)) {
+					const missingIds = /** @type {PopulateInfo} */ (this.populateInfo).missingIds;
+					(missingIds[child.path] ??= new ObjectIdMap()).set(input, inIdx, true);
 				}
 				inIdx += 12;
 				break;
@@ -243,13 +1242,13 @@ export class Transcoder {
 			}
 			case BSON_DATA_OBJECT: {
 				const objectSize = readInt32LE(input, inIdx);
-				this.getMissingIds(input, inIdx, false, this.currentPath);
+				this.getMissingIds(input, inIdx, false, child, depth + 1);
 				inIdx += objectSize;
 				break;
 			}
 			case BSON_DATA_ARRAY: {
 				const objectSize = readInt32LE(input, inIdx);
-				this.getMissingIds(input, inIdx, true, this.currentPath);
+				this.getMissingIds(input, inIdx, true, child, depth + 1);
 				inIdx += objectSize;
 				if (input[inIdx - 1] !== 0)
 					throw new Error("Invalid array terminator byte");
@@ -279,7 +1278,46 @@ export class Transcoder {
 	}
 
 	/**
-	 * @param {Uint8Array} input BSON-encoded input.
+	 * Same as getMissingIds(index.buffer), but reads the index's tape instead
+	 * of parsing.
+	 * @param {BsonIndex} index
+	 * @param {PathNode | null} root
+	 * @private
+	 */
+	getMissingIdsFromIndex(index, root) {
+		if (!root)
+			return;
+		// @ts-expect-error private
+		const {buffer: input, tape} = index;
+		const missingIds = /** @type {PopulateInfo} */ (this.populateInfo).missingIds;
+		/** @type {{next: number, node: PathNode | null, isArray: boolean}[]} */
+		const open = [{next: tape[TAPE_NEXT], node: root, isArray: false}];
+		for (let i = 1; i < index.length; i++) {
+			while (i >= open[open.length - 1].next)
+				open.pop();
+			const base = i * TAPE_FIELDS;
+			const type = tape[base + TAPE_TYPE];
+			const parent = open[open.length - 1];
+			// Array elements share the array's path.
+			let node = parent.node;
+			if (node && !parent.isArray)
+				node = findChild(node, input, tape[base + TAPE_KEY], tape[base + TAPE_VALUE] - 1);
+
+			if (type === BSON_DATA_OBJECT || type === BSON_DATA_ARRAY) {
+				if (open.length === this.maxDepth)
+					throw new Error("Maximum nesting depth exceeded");
+				open.push({next: tape[base + TAPE_NEXT], node, isArray: type === BSON_DATA_ARRAY});
+			} else if (type === BSON_DATA_OID && node?.ids) {
+				const inIdx = tape[base + TAPE_VALUE];
+				if (!node.ids.get(input, inIdx))
+					(missingIds[node.path] ??= new ObjectIdMap()).set(input, inIdx, true);
+			}
+		}
+	}
+
+	/**
+	 * @param {Uint8Array | BsonIndex} input BSON-encoded input, or an index of
+	 * it.
 	 * @param {boolean} [isArray] BSON stores arrays and objects in the same
 	 * format (arrays are objects with numerical keys stored as strings).
 	 * @param {number} [chunkSize] Initial size of the output buffer. Setting to
@@ -287,119 +1325,883 @@ export class Transcoder {
 	 * @public
 	 */
 	transcode(input, isArray = false, chunkSize = 0) {
+		this.lastHash = undefined;
+		if (input instanceof BsonIndex)
+			return this.transcodeEntry(input, 0, this.populateInfo?.root ?? null, "");
 		if (!(input instanceof Uint8Array))
 			throw new Error("Input must be a buffer");
 		if (input.length < 5)
 			throw new Error("Input buffer must have length >= 5");
+
+		const caching = this.cacheBytes > 0 && !isArray;
+		let hash = 0;
+		if (caching) {
+			hash = hashBytes(input);
+			const entry = this.cacheFind(hash, input);
+			if (entry) {
+				this.cacheHits++;
+				this.docId.set(entry.docId);
+				this.hashOutput(entry.output);
+				return entry.output;
+			}
+			this.cacheMisses++;
+		}
+
 		// Estimate outLen at 2.5x inLen. (See C++ for explanation.)
 		chunkSize ||= (input.length * 10) >> 2;
-		this.out = Buffer.alloc(chunkSize);
+		this.out = Buffer.allocUnsafe(chunkSize);
 		this.outIdx = 0;
-		this.transcodeObject(input, 0, isArray);
+		this.slicePath = "";
+		this.transcodeObject(input, 0, isArray, this.populateInfo?.root ?? null, 1);
 		const r = this.out.slice(0, this.outIdx);
 		// @ts-expect-error
 		this.out = null;
 		this.outIdx = 0;
+		this.hashOutput(r);
+
+		if (caching)
+			this.cacheInsert(hash, input, r);
 		return r;
 	}
 
 	/**
-	 * @param {number} n
-	 * @returns {boolean} true if reallocation happened.
+	 * Deserializes the BSON document to the JS values that
+	 * `JSON.parse(transcode(input))` returns. (The C++ version creates them
+	 * directly, without the JSON in between.)
+	 * @param {Uint8Array | BsonIndex} input BSON-encoded input, or an index of
+	 * it.
+	 * @returns {any}
+	 * @public
 	 */
-	ensureSpace(n) {
-		if (this.outIdx + n < this.out.length)
-			return false;
-		
-		const oldOut = this.out;
-		const m = Math.max(n, oldOut.length);
-		const newOut = Buffer.alloc((m * 3) >> 1);
-		oldOut.copy(newOut);
-		this.out = newOut;
-		return true;
+	toObject(input) {
+		const value = JSON.parse(this.transcode(input).toString());
+		// The C++ version doesn't write JSON to hash.
+		this.lastHash = undefined;
+		return value;
 	}
 
 	/**
-	 * Writes the bytes in `str` from `start` to `end` (exclusive) into `out`,
-	 * escaping per ECMA-262 sec 24.5.2.2.
-	 *
-	 * Regarding [well-formed
-	 * stringify](https://github.com/tc39/proposal-well-formed-stringify), the
-	 * js-bson encoder uses Node.js' `buffer.write(value, index, "utf8")`, which
-	 * converts unpaired surrogates to the byte sequence `ef bf bd`, which
-	 * decodes to `0xfffd` (� REPLACEMENT CHARACTER, used to replace an unknown,
-	 * unrecognized or unrepresentable character). Thus there's nothing we can
-	 * do in the decoder to instead emit escape sequences.
-	 *
-	 * @param {Uint8Array} str
-	 * @param {number} start Inclusive.
-	 * @param {number} end Exclusive.
-	 * @private
+	 * Transcodes the BSON document to a JSON string. (The C++ version hands
+	 * pure-ASCII output to V8 without copying or decoding it.)
+	 * @param {Uint8Array | BsonIndex} input BSON-encoded input, or an index of
+	 * it.
+	 * @returns {string}
+	 * @public
 	 */
-	writeStringRange(str, start, end) {
-		for (let i = start; i < end; i++) {
-			const c = str[i];
-			let xc;
-			if (c >= 0x20 /* & 0xe0*/ && c !== 0x22 && c !== 0x5c) { // no escape
-				this.ensureSpace(1);
-				this.out[this.outIdx++] = c;
-			} else if ((xc = ESCAPES[c])) { // single char escape
-				this.ensureSpace(2);
-				const out = this.out;
-				out[this.outIdx++] = BACKSLASH;
-				out[this.outIdx++] = xc;
-			} else { // c < 0x20, control
-				this.ensureSpace(6);
-				const out = this.out;
-				out[this.outIdx++] = BACKSLASH;
-				out[this.outIdx++] = LOWERCASE_U;
-				out[this.outIdx++] = ZERO;
-				out[this.outIdx++] = ZERO;
-				out[this.outIdx++] = (c & 0xF0) ? ONE : ZERO;
-				out[this.outIdx++] = hex(c & 0xF);
-			}
-		}
+	transcodeToString(input) {
+		return this.transcode(input).toString();
 	}
 
 	/**
-	 * Reads an ObjectId as a string.
-	 * @param {Uint8Array} buffer
-	 * @param {Number} start
-	 * @returns {string}
-	 * @private
+	 * Transcodes the BSON document into `target` at `offset`. Returns the
+	 * number of bytes written, or `{needed}` (the exact number of bytes that
+	 * are required) if the JSON doesn't fit, in which case the contents of
+	 * `target` are unspecified. Doesn't use the response cache.
+	 * @param {Uint8Array | BsonIndex} input BSON-encoded input, or an index of
+	 * it.
+	 * @param {Uint8Array | ArrayBuffer} target
+	 * @param {number} [offset]
+	 * @returns {number | {needed: number}}
+	 * @public
 	 */
-	readObjectId(buffer, start) {
-		let str = "";
-		for (let i = start; i < start + 12; i++) {
-			// TODO(perf) optimize
-			const byte = buffer[i];
-			const hi = byte >>> 4;
-			const lo = byte & 0xF;
-			str += String.fromCharCode(hex(hi)) + String.fromCharCode(hex(lo));
+	transcodeInto(input, target, offset = 0) {
+		this.lastHash = undefined;
+		let view;
+		if (target instanceof Uint8Array)
+			view = Buffer.from(target.buffer, target.byteOffset, target.length);
+		else if (target instanceof ArrayBuffer)
+			view = Buffer.from(target);
+		else
+			throw new TypeError("Target must be a Uint8Array or ArrayBuffer");
+		if (!Number.isInteger(offset) || offset < 0 || offset > view.length)
+			throw new RangeError("offset is out of range");
+		view = view.subarray(offset);
+
+		if (input instanceof BsonIndex) {
+			const json = this.transcodeEntry(input, 0, this.populateInfo?.root ?? null, "");
+			if (json.length > view.length)
+				return {needed: json.length};
+			view.set(json);
+			return json.length;
+		}
+		if (!(input instanceof Uint8Array))
+			throw new Error("Input must be a buffer");
+		if (input.length < 5)
+			throw new Error("Input buffer must have length >= 5");
+
+		// ensureSpace() moves to a new Buffer if the target is too small.
+		this.out = view;
+		this.outIdx = 0;
+		this.slicePath = "";
+		let written;
+		try {
+			this.transcodeObject(input, 0, false, this.populateInfo?.root ?? null, 1);
+			written = this.outIdx;
+			this.hashOutput(this.out.subarray(0, written));
+			if (this.out !== view && written <= view.length)
+				view.set(this.out.subarray(0, written));
+		} finally {
+			// @ts-expect-error
+			this.out = null;
+			this.outIdx = 0;
 		}
-		return str;
+		return written <= view.length ? written : {needed: written};
 	}
 
 	/**
-	 * @param {Uint8Array} buffer
-	 * @param {Number} start
-	 * @private
+	 * Returns the response cache's hit and miss counts and size.
+	 * @public
 	 */
-	writeObjectId(buffer, start) {
-		// This is the same speed as a 16B LUT and a 512B LUT, and doesn't
-		// pollute the cache. js-bson is still winning in the ObjectId benchmark
-		// though, despite having extra copying and a call into C++.
-		this.ensureSpace(26);
-		const out = this.out;
-		out[this.outIdx++] = QUOTE;
-		for (let i = start; i < start + 12; i++) {
-			const byte = buffer[i];
-			const hi = byte >>> 4;
-			const lo = byte & 0xF;
-			out[this.outIdx++] = hex(hi);
-			out[this.outIdx++] = hex(lo);
+	cacheStats() {
+		return {hits: this.cacheHits, misses: this.cacheMisses, entries: this.cache.size, bytes: this.cacheUsed};
+	}
+
+	/**
+	 * Returns the XXH64 of the last JSON output as 16 hex digits, or undefined
+	 * if the `hash` option isn't set or nothing was output yet. For
+	 * `transcodeCompressed`, it's the hash of the JSON before compression.
+	 * @returns {string | undefined}
+	 * @public
+	 */
+	outputHash() {
+		return this.lastHash;
+	}
+
+	/**
+	 * @param {Buffer} json
+	 * @private
+	 */
+	hashOutput(json) {
+		if (this.hashing)
+			this.lastHash = xxh64(json);
+	}
+
+	/**
+	 * Replaces the `arraySlices` option, e.g. for the next page. Empties the
+	 * response cache.
+	 * @param {Record<string, {skip?: number, limit?: number, count?: boolean | string}>} slices
+	 * @public
+	 */
+	setArraySlices(slices) {
+		this.arraySlices = parseArraySlices(slices);
+		// So that retranscode() doesn't copy fields sliced differently.
+		this.sliceGeneration = (this.sliceGeneration + 1) >>> 0;
+		this.cache.clear();
+		this.cacheUsed = 0;
+	}
+
+	/**
+	 * Returns the string cache's hit and miss counts. Strings too long to be
+	 * cached aren't counted.
+	 * @public
+	 */
+	stringCacheStats() {
+		return {hits: this.stringHits, misses: this.stringMisses, slots: this.stringCache.length};
+	}
+
+	/**
+	 * Returns the number of pieces the last `transcodeCompressed` call handed
+	 * to the compressor and the size of the largest. This version compresses
+	 * the whole JSON at once.
+	 * @public
+	 */
+	compressStats() {
+		return {chunks: this.compressChunks, peakBytes: this.compressPeak};
+	}
+
+	/**
+	 * Returns the cache entry for `input`, or undefined.
+	 * @param {number} hash
+	 * @param {Uint8Array} input
+	 * @private
+	 */
+	cacheFind(hash, input) {
+		const version = this.populateVersion();
+		if (version !== this.cacheVersion) {
+			// Populated output may have changed.
+			this.cache.clear();
+			this.cacheUsed = 0;
+			this.cacheVersion = version;
+			return undefined;
 		}
-		out[this.outIdx++] = QUOTE;
+		const entry = this.cache.get(hash);
+		if (!entry || Buffer.compare(entry.input, input) !== 0)
+			return undefined;
+		this.cache.delete(hash);
+		this.cache.set(hash, entry);
+		return entry;
+	}
+
+	/**
+	 * @param {number} hash
+	 * @param {Uint8Array} input
+	 * @param {Buffer} output
+	 * @private
+	 */
+	cacheInsert(hash, input, output) {
+		const bytes = input.length + output.length;
+		if (bytes > this.cacheBytes)
+			return;
+
+		// A colliding input replaces the entry with the same hash.
+		this.cacheErase(hash);
+		while (this.cacheUsed + bytes > this.cacheBytes)
+			this.cacheErase(/** @type {number} */ (this.cache.keys().next().value));
+
+		this.cache.set(hash, {input: new Uint8Array(input), output, docId: this.docId.slice(), bytes});
+		this.cacheUsed += bytes;
+	}
+
+	/**
+	 * @param {number} hash
+	 * @private
+	 */
+	cacheErase(hash) {
+		const entry = this.cache.get(hash);
+		if (entry) {
+			this.cacheUsed -= entry.bytes;
+			this.cache.delete(hash);
+		}
+	}
+
+	/**
+	 * Transcodes the BSON document to compressed JSON. (The C++ version
+	 * compresses the JSON as it's written.)
+	 * @param {Uint8Array} input BSON document.
+	 * @param {{format?: "gzip"|"deflate"|"raw"|"br", level?: number|"fast"}} [options]
+	 * @public
+	 */
+	transcodeCompressed(input, {format = "gzip", level = undefined} = {}) {
+		this.lastHash = undefined;
+		if (!(input instanceof Uint8Array))
+			throw new Error("Input must be a buffer");
+		const brotli = format === "br";
+		const compress = format === "gzip" ? zlib.gzipSync :
+			format === "deflate" ? zlib.deflateSync :
+			format === "raw" ? zlib.deflateRawSync :
+			brotli ? zlib.brotliCompressSync : null;
+		if (!compress)
+			throw new TypeError('format must be "gzip", "deflate", "raw" or "br"');
+
+		const [minLevel, maxLevel] = brotli ? [0, 11] : [-1, 9];
+		if (level === "fast")
+			level = 1;
+		else if (level === undefined)
+			level = brotli ? BROTLI_RESPONSE_QUALITY : zlib.constants.Z_DEFAULT_COMPRESSION;
+		else if (!Number.isInteger(level) || level < minLevel || level > maxLevel)
+			throw new TypeError(`level must be "fast" or an integer from ${minLevel} to ${maxLevel}`);
+
+		const json = this.transcode(input);
+		this.compressChunks = 1;
+		this.compressPeak = json.length;
+		if (brotli) {
+			return zlib.brotliCompressSync(json, {params: {
+				[zlib.constants.BROTLI_PARAM_QUALITY]: level,
+				[zlib.constants.BROTLI_PARAM_MODE]: zlib.constants.BROTLI_MODE_TEXT,
+				[zlib.constants.BROTLI_PARAM_SIZE_HINT]: json.length
+			}});
+		}
+		return compress(json, {level});
+	}
+
+	/**
+	 * Transcodes one element of an indexed document.
+	 * @param {BsonIndex} index
+	 * @param {string} path Dotted path to the element, e.g. "a.0.b". "" is the
+	 * whole document.
+	 * @returns {Buffer | undefined} undefined if there's no element at path.
+	 * @public
+	 */
+	transcodePath(index, path) {
+		this.lastHash = undefined;
+		if (!(index instanceof BsonIndex))
+			throw new TypeError("Expected a BsonIndex");
+		if (typeof path !== "string")
+			throw new TypeError("Path must be a string");
+
+		// @ts-expect-error private
+		const {buffer: input, tape} = index;
+		let entry = 0;
+		let node = this.populateInfo?.root ?? null;
+		/** @type {string[]} */
+		const keyPath = [];
+		if (path) {
+			for (const seg of path.split(".")) {
+				const parentType = tape[entry * TAPE_FIELDS + TAPE_TYPE];
+				// @ts-expect-error private
+				entry = index.child(entry, seg);
+				if (entry < 0)
+					return undefined;
+				// Array elements share the array's path.
+				if (parentType === BSON_DATA_OBJECT) {
+					keyPath.push(seg);
+					if (node) {
+						const base = entry * TAPE_FIELDS;
+						node = findChild(node, input, tape[base + TAPE_KEY], tape[base + TAPE_VALUE] - 1);
+					}
+				}
+			}
+		}
+		// JSON.stringify(undefined) is undefined too.
+		if (tape[entry * TAPE_FIELDS + TAPE_TYPE] === BSON_DATA_UNDEFINED)
+			return undefined;
+		return this.transcodeEntry(index, entry, node, keyPath.join("."));
+	}
+
+	/**
+	 * Transcodes a change stream event into the envelope set by the
+	 * `changeEnvelope` option. An array of events is written as NDJSON.
+	 * @param {Uint8Array | Uint8Array[]} input BSON event, or an array of them.
+	 * @public
+	 */
+	transcodeChangeEvents(input) {
+		this.lastHash = undefined;
+		const ndjson = Array.isArray(input);
+		const events = ndjson ? input : [input];
+		let total = 0;
+		for (const event of events) {
+			if (!(event instanceof Uint8Array))
+				throw new Error("Input must be a buffer");
+			total += event.length;
+		}
+
+		this.out = Buffer.allocUnsafe(Math.max((total * 10) >> 2, MAX_SCALAR_LEN + 1));
+		this.outIdx = 0;
+		for (const event of events) {
+			if (event.length < 5)
+				throw new Error("Input buffer must have length >= 5");
+			this.transcodeChangeEvent(event);
+			if (ndjson) {
+				this.ensureSpace(1);
+				this.out[this.outIdx++] = 0x0a;
+			}
+		}
+		const r = this.out.slice(0, this.outIdx);
+		// @ts-expect-error
+		this.out = null;
+		this.outIdx = 0;
+		this.hashOutput(r);
+		return r;
+	}
+
+	/**
+	 * Writes the envelope for one change event. Paths that aren't in the
+	 * event are left out. Populate paths are relative to each value, so
+	 * fullDocument is populated like a top-level document.
+	 * @param {Uint8Array} input
+	 * @private
+	 */
+	transcodeChangeEvent(input) {
+		const root = this.populateInfo?.root ?? null;
+		this.ensureSpace(1);
+		this.out[this.outIdx++] = OPENCURL;
+		let first = true;
+		for (const {key, path} of this.envelope ?? DEFAULT_ENVELOPE) {
+			let inIdx = 0;
+			let type = BSON_DATA_OBJECT;
+			for (const seg of path) {
+				if (type !== BSON_DATA_OBJECT && type !== BSON_DATA_ARRAY) {
+					inIdx = -1;
+					break;
+				}
+				inIdx = findElement(input, inIdx, seg);
+				if (inIdx < 0)
+					break;
+				type = input[inIdx];
+				// Skip the type and key.
+				inIdx += 1 + seg.length + 1;
+			}
+			// JSON.stringify leaves undefined values out too.
+			if (inIdx < 0 || type === BSON_DATA_UNDEFINED)
+				continue;
+
+			this.ensureSpace(1 + key.length + MAX_SCALAR_LEN);
+			if (!first)
+				this.out[this.outIdx++] = COMMA;
+			first = false;
+			this.addVal(key);
+
+			this.slicePath = "";
+			if (type === BSON_DATA_OBJECT || type === BSON_DATA_ARRAY)
+				this.transcodeObject(input, inIdx, type === BSON_DATA_ARRAY, root, 1);
+			else
+				this.transcodeValue(input, inIdx, type, root, false, 0);
+		}
+		this.ensureSpace(1);
+		this.out[this.outIdx++] = CLOSECURL;
+	}
+
+	/**
+	 * Transcodes `input` and locates each top-level field in the input and
+	 * output, for `retranscode()`.
+	 * @param {Uint8Array} input BSON-encoded input.
+	 * @returns {{json: Buffer, fields: Uint32Array}}
+	 * @public
+	 */
+	transcodeFields(input) {
+		this.lastHash = undefined;
+		if (!(input instanceof Uint8Array))
+			throw new Error("Input must be a buffer");
+		if (input.length < 5)
+			throw new Error("Input buffer must have length >= 5");
+		return this.transcodeFieldsFrom(input, null);
+	}
+
+	/**
+	 * Transcodes a new version of a document, copying the JSON of top-level
+	 * fields that are byte-for-byte unchanged from the previous version.
+	 * @param {Uint8Array} prevBson
+	 * @param {Uint8Array} prevJson `json` from transcodeFields or retranscode.
+	 * @param {Uint32Array} prevFields `fields` from the same call.
+	 * @param {Uint8Array} input BSON-encoded new version.
+	 * @returns {{json: Buffer, fields: Uint32Array}}
+	 * @public
+	 */
+	retranscode(prevBson, prevJson, prevFields, input) {
+		this.lastHash = undefined;
+		if (!(prevBson instanceof Uint8Array) || !(prevJson instanceof Uint8Array) ||
+			!(prevFields instanceof Uint32Array))
+			throw new TypeError("Expected the previous BSON, JSON and fields");
+		if (prevFields.length % 4 !== FIELDS_HEADER)
+			throw new Error("Invalid fields");
+		for (let i = FIELDS_HEADER; i < prevFields.length; i += 4) {
+			if (prevFields[i] >= prevFields[i + 1] || prevFields[i + 1] > prevBson.length ||
+				prevFields[i + 2] > prevFields[i + 3] || prevFields[i + 3] > prevJson.length)
+				throw new Error("Invalid fields");
+		}
+		if (!(input instanceof Uint8Array))
+			throw new Error("Input must be a buffer");
+		if (input.length < 5)
+			throw new Error("Input buffer must have length >= 5");
+		// Populated output or array slices may have changed.
+		const reuse = prevFields[0] === this.populateVersion() && prevFields[1] === this.sliceGeneration;
+		return this.transcodeFieldsFrom(input, reuse ? {bson: prevBson, json: prevJson, fields: prevFields} : null);
+	}
+
+	/** @private */
+	populateVersion() {
+		return this.populateInfo instanceof PopulateInfo ?
+			// @ts-expect-error private
+			this.populateInfo.version >>> 0 : 0;
+	}
+
+	/**
+	 * Like transcode(), but also returns the input and output span of each
+	 * top-level field: `fields` is populateVersion() and sliceGeneration, then
+	 * the input start and end and output start and end of each field. Fields whose input is
+	 * unchanged from `prev` are copied from its output.
+	 * @param {Uint8Array} input
+	 * @param {{bson: Uint8Array, json: Uint8Array, fields: Uint32Array} | null} prev
+	 * @private
+	 */
+	transcodeFieldsFrom(input, prev) {
+		const inLen = input.length;
+		const size = readInt32LE(input, 0);
+		if (size < 5)
+			throw new Error("BSON size must be >= 5");
+		if (size > inLen)
+			throw new Error("BSON size exceeds input length");
+		if (input[size - 1] !== 0)
+			throw new Error("BSON document must end with a null byte");
+
+		const root = this.populateInfo?.root ?? null;
+		const fields = [this.populateVersion(), this.sliceGeneration];
+		this.out = Buffer.allocUnsafe(Math.max((inLen * 10) >> 2, MAX_SCALAR_LEN + 1));
+		this.outIdx = 0;
+		this.out[this.outIdx++] = OPENCURL;
+
+		let inIdx = 4;
+		let next = 0;
+		const order = this.canonical ? sortedElements(input, inIdx, size - 1, this.countNames(input, "")) : null;
+		let sortedIdx = 0;
+		while (true) {
+			if (order) {
+				// A count sibling's input span is its array's type byte, which
+				// no element matches, so it's rewritten every time.
+				while (sortedIdx < order.length && order[sortedIdx] < 0) {
+					const offset = ~order[sortedIdx++];
+					this.ensureSpace(1);
+					if (fields.length > FIELDS_HEADER)
+						this.out[this.outIdx++] = COMMA;
+					const jsonStart = this.outIdx;
+					this.writeSortedCount(input, offset, "", false);
+					const f = FIELDS_HEADER + next * 4;
+					if (prev && f < prev.fields.length && prev.fields[f + 1] - prev.fields[f] === 1)
+						next++;
+					fields.push(offset, offset + 1, jsonStart, this.outIdx);
+				}
+				inIdx = sortedIdx < order.length ? order[sortedIdx++] : size - 1;
+			}
+			const start = inIdx;
+			const elementType = input[inIdx++];
+			if (elementType === 0)
+				break;
+
+			const comma = fields.length > FIELDS_HEADER;
+			// The document's terminator bounds the key.
+			const nameEnd = input.indexOf(0, inIdx);
+			const valueStart = nameEnd + 1;
+			if (valueStart >= size)
+				throw new Error("Truncated BSON (in key)");
+			const isId = isIdKey(input, inIdx, nameEnd);
+
+			const same = prev ?
+				this.findField(prev, next, input, start, valueStart + valueSize(input, elementType, valueStart, size - 1 - valueStart) - start, nameEnd - inIdx) :
+				-1;
+			let jsonStart;
+			if (same >= 0) {
+				next = same + 1;
+				const f = FIELDS_HEADER + same * 4;
+				this.ensureSpace(1 + prev.fields[f + 3] - prev.fields[f + 2]);
+				if (comma)
+					this.out[this.outIdx++] = COMMA;
+				jsonStart = this.outIdx;
+				this.writeBuffer(prev.json.subarray(prev.fields[f + 2], prev.fields[f + 3]));
+				if (isId && elementType === BSON_DATA_OID) {
+					this.docId.set(input.subarray(valueStart, valueStart + 12));
+					this.hasDocId = true;
+				}
+				inIdx = start + prev.fields[f + 1] - prev.fields[f];
+			} else {
+				if (prev)
+					next = -same - 1;
+				// writeKey writes the comma.
+				jsonStart = this.outIdx + (comma ? 1 : 0);
+				this.writeKey(input, inIdx, nameEnd, comma);
+				const child = root && findChild(root, input, inIdx, nameEnd);
+				if (this.arraySlices)
+					this.slicePath = keyString(input, inIdx, nameEnd);
+				inIdx = this.transcodeValue(input, valueStart, elementType, child, isId, 1);
+				if (this.arraySlices && elementType === BSON_DATA_ARRAY && !order)
+					this.writeSliceCount();
+			}
+			fields.push(start, inIdx, jsonStart, this.outIdx);
+		}
+		if (inIdx !== size)
+			throw new Error("BSON size doesn't match document");
+
+		this.ensureSpace(1);
+		this.out[this.outIdx++] = CLOSECURL;
+		const json = this.out.slice(0, this.outIdx);
+		// @ts-expect-error
+		this.out = null;
+		this.outIdx = 0;
+		this.hashOutput(json);
+		return {json, fields: Uint32Array.from(fields)};
+	}
+
+	/**
+	 * Returns the index of the field in `prev` whose input is
+	 * `input[start, start + len)`. Otherwise returns -1 - the field to check
+	 * first for the next element.
+	 * @param {{bson: Uint8Array, json: Uint8Array, fields: Uint32Array}} prev
+	 * @param {number} next The field expected to come next, which is checked
+	 * first.
+	 * @param {Uint8Array} input
+	 * @param {number} start
+	 * @param {number} len
+	 * @param {number} keyLen
+	 * @private
+	 */
+	findField(prev, next, input, start, len, keyLen) {
+		const {bson, fields} = prev;
+		const n = (fields.length - FIELDS_HEADER) / 4;
+		const elem = input.subarray(start, start + len);
+		const equals = (/** @type {number} */ i) => {
+			const f = FIELDS_HEADER + i * 4;
+			return fields[f + 1] - fields[f] === len &&
+				Buffer.compare(bson.subarray(fields[f], fields[f + 1]), elem) === 0;
+		};
+		if (next < n) {
+			if (equals(next))
+				return next;
+			// Same key, so this field changed.
+			const f = FIELDS_HEADER + next * 4;
+			if (fields[f + 1] - fields[f] > keyLen + 1 &&
+				Buffer.compare(bson.subarray(fields[f] + 1, fields[f] + keyLen + 2), elem.subarray(1, keyLen + 2)) === 0)
+				return -1 - (next + 1);
+		}
+		// Fields were added, removed or reordered.
+		for (let i = 0; i < n; i++) {
+			if (equals(i))
+				return i;
+		}
+		return -1 - next;
+	}
+
+	/**
+	 * @param {BsonIndex} index
+	 * @param {number} entry
+	 * @param {PathNode | null} node Populate path node for the entry, if any.
+	 * @param {string} path Key path of the entry, without array indexes.
+	 * @private
+	 */
+	transcodeEntry(index, entry, node, path) {
+		// @ts-expect-error private
+		const {buffer: input, tape} = index;
+		const base = entry * TAPE_FIELDS;
+		const type = tape[base + TAPE_TYPE];
+		const inIdx = tape[base + TAPE_VALUE];
+		this.out = Buffer.allocUnsafe(Math.max((tape[base + TAPE_SIZE] * 10) >> 2, MAX_SCALAR_LEN + 1));
+		this.outIdx = 0;
+		this.slicePath = path;
+		if (type === BSON_DATA_OBJECT)
+			this.transcodeObject(input, inIdx, false, node, 1);
+		else if (type === BSON_DATA_ARRAY)
+			this.transcodeObject(input, inIdx, true, node, 1, this.arraySlices?.get(path));
+		else
+			this.transcodeValue(input, inIdx, type, node, false, 0);
+		const r = this.out.slice(0, this.outIdx);
+		// @ts-expect-error
+		this.out = null;
+		this.outIdx = 0;
+		this.hashOutput(r);
+		return r;
+	}
+
+	/**
+	 * @param {number} n
+	 * @returns {boolean} true if reallocation happened.
+	 */
+	ensureSpace(n) {
+		if (this.outIdx + n < this.out.length)
+			return false;
+		
+		const oldOut = this.out;
+		const m = Math.max(this.outIdx + n, oldOut.length);
+		const newOut = Buffer.allocUnsafe(m + (m >>> 1));
+		oldOut.copy(newOut, 0, 0, this.outIdx);
+		this.out = newOut;
+		return true;
+	}
+
+	/**
+	 * Returns null if `str` from `start` to `end` (exclusive) is valid UTF-8.
+	 * Otherwise throws or returns a copy of that range with invalid sequences
+	 * replaced with U+FFFD, depending on `invalidUtf8`.
+	 * @param {Uint8Array} str
+	 * @param {number} start Inclusive.
+	 * @param {number} end Exclusive.
+	 * @private
+	 */
+	fixUtf8(str, start, end) {
+		const range = str.subarray(start, end);
+		if (isUtf8(range))
+			return null;
+		if (this.invalidUtf8 === "error")
+			throw new Error("Invalid UTF-8");
+		// Buffer#toString replaces the same way the C++ version does.
+		return Buffer.from(Buffer.from(range.buffer, range.byteOffset, range.length).toString());
+	}
+
+	/**
+	 * Writes the string value in `in_` from `start` to `end` (exclusive),
+	 * quoted.
+	 * @param {Uint8Array} in_
+	 * @param {number} start Inclusive.
+	 * @param {number} end Exclusive.
+	 * @private
+	 */
+	writeString(in_, start, end) {
+		let str = in_;
+		const fixedStr = this.checkUtf8 ? this.fixUtf8(in_, start, end) : null;
+		if (fixedStr) {
+			str = fixedStr;
+			start = 0;
+			end = fixedStr.length;
+		}
+
+		const len = this.escapedLength(str, start, end);
+		this.ensureSpace(len + 2);
+		this.out[this.outIdx++] = QUOTE;
+		this.writeStringRange(str, start, end, len);
+		this.out[this.outIdx++] = QUOTE;
+	}
+
+	/**
+	 * Like `writeString`, for 1 to `STRING_CACHE_MAX` bytes. Copies the
+	 * output from `stringCache` if the string is there, or else writes it and
+	 * caches it.
+	 * @param {Uint8Array} in_
+	 * @param {number} start Inclusive.
+	 * @param {number} end Exclusive.
+	 * @private
+	 */
+	writeCachedString(in_, start, end) {
+		let h = end - start;
+		for (let i = start; i < end; i++)
+			h = Math.imul(h ^ in_[i], 0x01000193);
+		const slot = (h ^ (h >>> 15)) & (this.stringCache.length - 1);
+		const entry = this.stringCache[slot];
+		if (entry && entry.raw.length === end - start) {
+			const raw = entry.raw;
+			let i = 0;
+			while (i < raw.length && raw[i] === in_[start + i])
+				i++;
+			if (i === raw.length) {
+				this.stringHits++;
+				this.ensureSpace(entry.json.length);
+				this.outIdx = copyRange(this.out, this.outIdx, entry.json, 0, entry.json.length);
+				return;
+			}
+		}
+
+		this.stringMisses++;
+		const outStart = this.outIdx;
+		this.writeString(in_, start, end);
+		if (this.outIdx - outStart <= STRING_CACHE_MAX_ESCAPED) {
+			// Copies; Buffer#slice would return views.
+			this.stringCache[slot] = {
+				raw: Uint8Array.prototype.slice.call(in_, start, end),
+				json: Uint8Array.prototype.slice.call(this.out, outStart, this.outIdx)
+			};
+		}
+	}
+
+	/**
+	 * Returns the number of bytes `writeStringRange` will write for the bytes
+	 * in `str` from `start` to `end` (exclusive).
+	 * @param {Uint8Array} str
+	 * @param {number} start Inclusive.
+	 * @param {number} end Exclusive.
+	 * @param {Int8Array} [extra]
+	 * @private
+	 */
+	escapedLength(str, start, end, extra = this.escapeExtra) {
+		let len = end - start;
+		for (let i = start; i < end; i++)
+			len += extra[str[i]];
+		return len;
+	}
+
+	/**
+	 * Writes the bytes in `str` from `start` to `end` (exclusive) into `out`,
+	 * escaping per ECMA-262 sec 24.5.2.2. The caller must have ensured space
+	 * for `len` bytes, as returned by `escapedLength`. Runs of bytes that
+	 * don't need escaping are copied in bulk.
+	 *
+	 * Regarding [well-formed
+	 * stringify](https://github.com/tc39/proposal-well-formed-stringify), the
+	 * js-bson encoder uses Node.js' `buffer.write(value, index, "utf8")`, which
+	 * converts unpaired surrogates to the byte sequence `ef bf bd`, which
+	 * decodes to `0xfffd` (� REPLACEMENT CHARACTER, used to replace an unknown,
+	 * unrecognized or unrepresentable character). Thus there's nothing we can
+	 * do in the decoder to instead emit escape sequences.
+	 *
+	 * @param {Uint8Array} str
+	 * @param {number} start Inclusive.
+	 * @param {number} end Exclusive.
+	 * @param {number} len Escaped length.
+	 * @param {Int8Array} [extra]
+	 * @private
+	 */
+	writeStringRange(str, start, end, len, extra = this.escapeExtra) {
+		const out = this.out;
+		let outIdx = this.outIdx;
+
+		if (len === end - start) { // No escapes.
+			this.outIdx = copyRange(out, outIdx, str, start, end);
+			return;
+		}
+
+		let runStart = start;
+		for (let i = start; i < end; i++) {
+			const c = str[i];
+			if (extra[c] === 0)
+				continue;
+
+			if (c === 0xe2 && !this.asciiOnly) { // htmlSafe mode
+				if (i + 2 < end && str[i + 1] === 0x80 && (str[i + 2] & 0xfe) === 0xa8) {
+					outIdx = copyRange(out, outIdx, str, runStart, i);
+					outIdx = writeUnicodeEscape(out, outIdx, 0x2000 | (str[i + 2] - 0x80));
+					i += 2;
+					runStart = i + 1;
+				}
+				continue;
+			}
+
+			outIdx = copyRange(out, outIdx, str, runStart, i);
+
+			if (c >= 0x80) { // asciiOnly mode; the sequence is valid.
+				let cp;
+				if (c < 0xe0) {
+					cp = (c & 0x1f) << 6 | (str[i + 1] & 0x3f);
+					i += 1;
+				} else if (c < 0xf0) {
+					cp = (c & 0x0f) << 12 | (str[i + 1] & 0x3f) << 6 | (str[i + 2] & 0x3f);
+					i += 2;
+				} else {
+					cp = (c & 0x07) << 18 | (str[i + 1] & 0x3f) << 12 |
+						(str[i + 2] & 0x3f) << 6 | (str[i + 3] & 0x3f);
+					i += 3;
+				}
+				if (cp >= 0x10000) {
+					cp -= 0x10000;
+					outIdx = writeUnicodeEscape(out, outIdx, 0xd800 | (cp >> 10));
+					cp = 0xdc00 | (cp & 0x3ff);
+				}
+				outIdx = writeUnicodeEscape(out, outIdx, cp);
+				runStart = i + 1;
+				continue;
+			}
+			runStart = i + 1;
+
+			const xc = ESCAPES[c];
+			if (xc) { // single char escape
+				out[outIdx++] = BACKSLASH;
+				out[outIdx++] = xc;
+			} else if (c < 0x20) { // control
+				out[outIdx++] = BACKSLASH;
+				out[outIdx++] = LOWERCASE_U;
+				out[outIdx++] = ZERO;
+				out[outIdx++] = ZERO;
+				out[outIdx++] = (c & 0xF0) ? ONE : ZERO;
+				out[outIdx++] = hex(c & 0xF);
+			} else { // htmlSafe mode, <>&
+				outIdx = writeUnicodeEscape(out, outIdx, c);
+			}
+		}
+		this.outIdx = copyRange(out, outIdx, str, runStart, end);
+	}
+
+	/**
+	 * @param {Uint8Array} buffer
+	 * @param {Number} start
+	 * @private
+	 */
+	writeObjectId(buffer, start) {
+		// This is the same speed as a 16B LUT and a 512B LUT, and doesn't
+		// pollute the cache. js-bson is still winning in the ObjectId benchmark
+		// though, despite having extra copying and a call into C++.
+		const out = this.out;
+		let outIdx = this.outIdx;
+		out[outIdx++] = QUOTE;
+		for (let i = start; i < start + 12; i++) {
+			const pair = buffer[i] << 1;
+			out[outIdx++] = HEX_PAIRS[pair];
+			out[outIdx++] = HEX_PAIRS[pair + 1];
+		}
+		out[outIdx++] = QUOTE;
+		this.outIdx = outIdx;
+	}
+
+	/**
+	 * Writes a populated document's JSON. PopulateInfo#addItems transcodes
+	 * items without asciiOnly or htmlSafe, so this escapes them; only strings can hold
+	 * characters that need it, so the JSON's structure is left alone.
+	 * @param {Uint8Array} doc
+	 * @private
+	 */
+	writePopulated(doc) {
+		const extra = this.populatedExtra;
+		if (!extra) {
+			this.writeBuffer(doc);
+			return;
+		}
+		const str = (this.checkUtf8 ? this.fixUtf8(doc, 0, doc.length) : null) ?? doc;
+		const len = this.escapedLength(str, 0, str.length, extra);
+		this.ensureSpace(len);
+		this.writeStringRange(str, 0, str.length, len, extra);
 	}
 
 	/**
@@ -413,24 +2215,22 @@ export class Transcoder {
 	}
 
 	/**
-	 * @param {Uint8Array} val
+	 * Writes an ASCII string. The caller must have ensured space.
+	 * @param {string} val
 	 * @private
 	 */
-	addQuotedVal(val) {
-		this.ensureSpace(val.length + 2);
+	addAsciiVal(val) {
 		const out = this.out;
-		out[this.outIdx++] = QUOTE;
 		for (let i = 0; i < val.length; i++)
-			out[this.outIdx++] = val[i];
-		out[this.outIdx++] = QUOTE;
+			out[this.outIdx++] = val.charCodeAt(i);
 	}
 
 	/**
+	 * The caller must have ensured space.
 	 * @param {Uint8Array} val
 	 * @private
 	 */
 	addVal(val) {
-		this.ensureSpace(val.length);
 		const out = this.out;
 		for (let i = 0; i < val.length; i++)
 			out[this.outIdx++] = val[i];
@@ -440,10 +2240,14 @@ export class Transcoder {
 	 * @param {Uint8Array} in_
 	 * @param {number} inIdx
 	 * @param {boolean} isArray
-	 * @param {string} [baseKey]
+	 * @param {PathNode | null} node Populate path node for this object, if any.
+	 * @param {number} depth 1 for the top-level document.
+	 * @param {ArraySlice} [slice] Elements to write, if it's a sliced array.
 	 * @private
 	 */
-	transcodeObject(in_, inIdx, isArray, baseKey) {
+	transcodeObject(in_, inIdx, isArray, node, depth, slice) {
+		if (depth > this.maxDepth)
+			throw new Error("Maximum nesting depth exceeded");
 		const inLen = in_.length;
 		const size = readInt32LE(in_, inIdx);
 
@@ -451,24 +2255,59 @@ export class Transcoder {
 			throw new Error("BSON size must be >= 5");
 		if (size + inIdx > inLen)
 			throw new Error("BSON size exceeds input length");
+		if (in_[inIdx + size - 1] !== 0)
+			throw new Error("BSON document must end with a null byte");
 
 		inIdx += 4;
 
 		let arrIdx = 0;
+		const last = inIdx + size - 5; // the terminator
+		const path = this.slicePath;
+		const order = this.canonical && !isArray ? sortedElements(in_, inIdx, last, this.countNames(in_, path)) : null;
+
+		// Skips the element at inIdx by its size; array keys are the index.
+		const skipElement = () => {
+			const valueStart = inIdx + nDigits(arrIdx) + 1;
+			if (valueStart > last)
+				throw new Error("Truncated BSON");
+			inIdx = valueStart + valueSize(in_, in_[inIdx], valueStart, last - valueStart);
+			arrIdx++;
+		};
+		let first = 0;
+		if (slice) {
+			while (arrIdx < slice.skip && in_[inIdx] !== 0)
+				skipElement();
+			first = arrIdx;
+		}
 
 		this.ensureSpace(1);
 		this.out[this.outIdx++] = isArray? OPENSQ : OPENCURL;
 
 		while (true) {
+			if (order) {
+				while (arrIdx < order.length && order[arrIdx] < 0) {
+					this.writeSortedCount(in_, ~order[arrIdx], path, arrIdx > 0);
+					arrIdx++;
+				}
+				inIdx = arrIdx < order.length ? order[arrIdx] : last;
+			}
+			if (slice && arrIdx - first === slice.limit) {
+				if (!slice.countKey)
+					inIdx = last;
+				// Counts the rest for the count sibling.
+				while (in_[inIdx] !== 0)
+					skipElement();
+			}
 			const elementType = in_[inIdx++];
 			if (elementType === 0) break;
 
-			if (arrIdx) {
-				this.ensureSpace(1);
-				this.out[this.outIdx++] = COMMA;
-			}
-
+			// Array elements share the array's path.
+			let child = node;
+			let isId = false;
 			if (isArray) {
+				this.ensureSpace(MAX_SCALAR_LEN);
+				if (arrIdx !== first)
+					this.out[this.outIdx++] = COMMA;
 				// Skip the number of digits in the key.
 				inIdx += nDigits(arrIdx);
 			} else {
@@ -482,156 +2321,405 @@ export class Transcoder {
 				if (nameEnd >= inLen)
 					throw new Error("Bad BSON Document: illegal CString");
 
-				this.ensureSpace(1);
-				this.out[this.outIdx++] = QUOTE;
-				this.writeStringRange(in_, nameStart, nameEnd);
+				this.writeKey(in_, nameStart, nameEnd, arrIdx > 0);
 				inIdx = nameEnd + 1; // +1 to skip null terminator
-				this.ensureSpace(2);
-				this.out[this.outIdx++] = QUOTE;
-				this.out[this.outIdx++] = COLON;
-				const key = in_.subarray(nameStart, nameEnd);
-				this.currentPath = baseKey ? `${baseKey}.${key}` : `${key}`;
+				if (node)
+					child = findChild(node, in_, nameStart, nameEnd);
+				isId = depth === 1 && isIdKey(in_, nameStart, nameEnd);
+				if (this.arraySlices && (elementType === BSON_DATA_OBJECT || elementType === BSON_DATA_ARRAY)) {
+					const key = keyString(in_, nameStart, nameEnd);
+					this.slicePath = path ? path + "." + key : key;
+				}
 			}
 
-			switch (elementType) {
-			case BSON_DATA_STRING: {
-				const size = readInt32LE(in_, inIdx);
-				inIdx += 4;
-				if (size <= 0 || size > inLen - inIdx)
-					throw new Error("Bad string length");
+			inIdx = this.transcodeValue(in_, inIdx, elementType, child, isId, depth, isArray);
+			if (this.arraySlices && !isArray && elementType === BSON_DATA_ARRAY && !order)
+				this.writeSliceCount();
+			this.slicePath = path;
 
-				this.ensureSpace(1 + size);
-				this.out[this.outIdx++] = QUOTE;
-				this.writeStringRange(in_, inIdx, inIdx + size - 1);
-				inIdx += size;
-				this.ensureSpace(1);
-				this.out[this.outIdx++] = QUOTE;
-				break;
-			}
-			case BSON_DATA_OID: {
-				if (inIdx + 12 > inLen)
-					throw new Error("Truncated BSON (in ObjectId)");
+			arrIdx++;
+		}
 
-				if (!baseKey && this.currentPath === "_id") {
-					this.docId = this.readObjectId(in_, inIdx);
-				}
+		this.ensureSpace(1);
+		this.out[this.outIdx++] = isArray ? CLOSESQ : CLOSECURL;
+		if (slice)
+			this.sliceCount = arrIdx;
+	}
 
-				const idMapForPath = this.populateInfo?.paths.get(this.currentPath);
-				if (idMapForPath) {
-					const id = this.readObjectId(in_, inIdx);
-					const doc = idMapForPath.get(id);
-					if (doc) {
-						this.writeBuffer(doc);
-					} else {
-						// doc missing, write ObjectId as fallback
-						this.writeObjectId(in_, inIdx);
-					}
+	/**
+	 * Returns the function sortedElements() takes to find the count siblings
+	 * of the arrays in the object at path, or null if nothing is sliced.
+	 * @param {Uint8Array} input
+	 * @param {string} path
+	 * @private
+	 */
+	countNames(input, path) {
+		const slices = this.arraySlices;
+		if (!slices)
+			return null;
+		return (/** @type {number} */ keyStart, /** @type {number} */ keyEnd) => {
+			const key = keyString(input, keyStart, keyEnd);
+			return slices.get(path ? path + "." + key : key)?.countName ?? null;
+		};
+	}
+
+	/**
+	 * Writes the count sibling of the sliced array at offset in a sorted
+	 * object at its sorted position, which may come before the array. The
+	 * count is the array's length, so its elements are counted by their
+	 * sizes.
+	 * @param {Uint8Array} input
+	 * @param {number} offset Of the array's type byte.
+	 * @param {string} path Of the object.
+	 * @param {boolean} comma
+	 * @private
+	 */
+	writeSortedCount(input, offset, path, comma) {
+		const keyEnd = input.indexOf(0, offset + 1);
+		const key = keyString(input, offset + 1, keyEnd);
+		const countKey = /** @type {Buffer} */ (this.arraySlices?.get(path ? path + "." + key : key)?.countKey);
+		const count = String(arrayLength(input, keyEnd + 1));
+		this.ensureSpace(1 + countKey.length + count.length);
+		if (comma)
+			this.out[this.outIdx++] = COMMA;
+		this.addVal(countKey);
+		this.addAsciiVal(count);
+	}
+
+	/**
+	 * Writes the count sibling of the array at slicePath that was just
+	 * transcoded, if it was sliced with a count. Only object members get one,
+	 * and sorted objects write it in key order (see writeSortedCount()).
+	 * @private
+	 */
+	writeSliceCount() {
+		const countKey = this.arraySlices?.get(this.slicePath)?.countKey;
+		if (!countKey)
+			return;
+		const count = String(this.sliceCount);
+		this.ensureSpace(1 + countKey.length + count.length);
+		this.out[this.outIdx++] = COMMA;
+		this.addVal(countKey);
+		this.addAsciiVal(count);
+	}
+
+	/**
+	 * Writes `, "key":`, ensuring MAX_SCALAR_LEN bytes of space after it.
+	 * @param {Uint8Array} in_
+	 * @param {number} nameStart
+	 * @param {number} nameEnd
+	 * @param {boolean} comma
+	 * @private
+	 */
+	writeKey(in_, nameStart, nameEnd, comma) {
+		let key = in_, keyStart = nameStart, keyEnd = nameEnd;
+		const fixedKey = this.checkUtf8 ? this.fixUtf8(in_, nameStart, nameEnd) : null;
+		if (fixedKey) {
+			key = fixedKey;
+			keyStart = 0;
+			keyEnd = fixedKey.length;
+		}
+
+		const keyLen = this.escapedLength(key, keyStart, keyEnd);
+		// , " key " : value
+		this.ensureSpace(2 + keyLen + MAX_SCALAR_LEN);
+		const out = this.out;
+		if (comma)
+			out[this.outIdx++] = COMMA;
+		out[this.outIdx++] = QUOTE;
+		this.writeStringRange(key, keyStart, keyEnd, keyLen);
+		out[this.outIdx++] = QUOTE;
+		out[this.outIdx++] = COLON;
+	}
+
+	/**
+	 * Writes the value of type `elementType` at `inIdx`. The caller must have
+	 * ensured MAX_SCALAR_LEN bytes of space.
+	 * @param {Uint8Array} in_
+	 * @param {number} inIdx
+	 * @param {number} elementType
+	 * @param {PathNode | null} node Populate path node for this value, if any.
+	 * @param {boolean} isId Whether this is the top-level `_id`.
+	 * @param {number} depth Depth of the enclosing document.
+	 * @param {boolean} [inArray] Whether it's an array element. Those share
+	 *   the array's path, but only the outermost array is sliced.
+	 * @returns {number} inIdx after the value.
+	 * @private
+	 */
+	transcodeValue(in_, inIdx, elementType, node, isId, depth, inArray = false) {
+		const inLen = in_.length;
+		switch (elementType) {
+		case BSON_DATA_STRING: {
+			const size = readInt32LE(in_, inIdx);
+			inIdx += 4;
+			if (size <= 0 || size > inLen - inIdx)
+				throw new Error("Bad string length");
+
+			if (this.stringCache.length && size > 1 && size - 1 <= STRING_CACHE_MAX)
+				this.writeCachedString(in_, inIdx, inIdx + size - 1);
+			else
+				this.writeString(in_, inIdx, inIdx + size - 1);
+			inIdx += size;
+			break;
+		}
+		case BSON_DATA_OID: {
+			if (inIdx + 12 > inLen)
+				throw new Error("Truncated BSON (in ObjectId)");
+
+			if (isId) {
+				for (let i = 0; i < 12; i++)
+					this.docId[i] = in_[inIdx + i];
+				this.hasDocId = true;
+			}
+
+			const idMapForPath = node?.ids;
+			if (idMapForPath) {
+				const doc = idMapForPath.get(in_, inIdx);
+				if (doc) {
+					this.writePopulated(doc);
 				} else {
+					// doc missing, write ObjectId as fallback
 					this.writeObjectId(in_, inIdx);
 				}
-				inIdx += 12;
-				break;
+			} else {
+				this.writeObjectId(in_, inIdx);
 			}
-			case BSON_DATA_INT: {
-				if (4 + inIdx > inLen)
-					throw new Error("Truncated BSON (in Int)");
-				const value = readInt32LE(in_, inIdx);
-				inIdx += 4;
-				// JS impl of fast_itoa is slower than this.
-				this.addVal(Buffer.from(value.toString()));
-				break;
+			inIdx += 12;
+			break;
+		}
+		case BSON_DATA_INT: {
+			if (4 + inIdx > inLen)
+				throw new Error("Truncated BSON (in Int)");
+			const value = readInt32LE(in_, inIdx);
+			inIdx += 4;
+			// JS impl of fast_itoa is slower than this.
+			this.addAsciiVal(value.toString());
+			break;
+		}
+		case BSON_DATA_NUMBER: {
+			if (8 + inIdx > inLen)
+				throw new Error("Truncated BSON (in Int)");
+			// const value = in_.readDoubleLE(inIdx); // not sure which is faster TODO (perf)
+			const value = readDoubleLE(in_, inIdx);
+			inIdx += 8;
+			if (Number.isFinite(value)) {
+				this.addAsciiVal(value.toString());
+			} else {
+				this.addVal(NULL);
 			}
-			case BSON_DATA_NUMBER: {
-				if (8 + inIdx > inLen)
-					throw new Error("Truncated BSON (in Int)");
-				// const value = in_.readDoubleLE(inIdx); // not sure which is faster TODO (perf)
-				const value = readDoubleLE(in_, inIdx);
-				inIdx += 8;
-				if (Number.isFinite(value)) {
-					this.addVal(Buffer.from(value.toString()));
+			break;
+		}
+		case BSON_DATA_DATE: {
+			if (8 + inIdx > inLen)
+				throw new Error("Truncated BSON (in Date)");
+			const lowBits = readInt32LE(in_, inIdx);
+			inIdx += 4;
+			const highBits = readInt32LE(in_, inIdx);
+			inIdx += 4;
+			const ms = Number(bigInt64FromHalves(lowBits, highBits));
+			this.out[this.outIdx++] = QUOTE;
+			this.addAsciiVal(new Date(ms).toISOString());
+			this.out[this.outIdx++] = QUOTE;
+			break;
+		}
+		case BSON_DATA_BOOLEAN: {
+			if (1 + inIdx > inLen)
+				throw new Error("Truncated BSON (in Boolean)");
+			const value = in_[inIdx++] === 1;
+			this.addVal(value ? TRUE : FALSE);
+			break;
+		}
+		case BSON_DATA_OBJECT: {
+			const objectSize = readInt32LE(in_, inIdx);
+			this.transcodeObject(in_, inIdx, false, node, depth + 1);
+			inIdx += objectSize;
+			break;
+		}
+		case BSON_DATA_ARRAY: {
+			const objectSize = readInt32LE(in_, inIdx);
+			const slice = inArray ? undefined : this.arraySlices?.get(this.slicePath);
+			this.transcodeObject(in_, inIdx, true, node, depth + 1, slice);
+			inIdx += objectSize;
+			if (in_[inIdx - 1] !== 0)
+				throw new Error("Invalid array terminator byte");
+			break;
+		}
+		case BSON_DATA_NULL: {
+			this.addVal(NULL);
+			break;
+		}
+		case BSON_DATA_LONG: {
+			if (8 + inIdx > inLen)
+				throw new Error("Truncated BSON (in Long)");
+			const lowBits = readInt32LE(in_, inIdx);
+			inIdx += 4;
+			const highBits = readInt32LE(in_, inIdx);
+			inIdx += 4;
+			let vx;
+			if (highBits === 0) {
+				vx = lowBits;
+			} else {
+				vx = bigInt64FromHalves(lowBits, highBits);
+			}
+			this.addAsciiVal(vx.toString());
+			break;
+		}
+		case BSON_DATA_UNDEFINED:
+			// noop
+			break;
+		case BSON_DATA_DECIMAL128:
+		case BSON_DATA_BINARY:
+		case BSON_DATA_REGEXP:
+		case BSON_DATA_SYMBOL:
+		case BSON_DATA_TIMESTAMP:
+		case BSON_DATA_MIN_KEY:
+		case BSON_DATA_MAX_KEY:
+		case BSON_DATA_CODE:
+		case BSON_DATA_CODE_W_SCOPE:
+		case BSON_DATA_DBPOINTER:
+			throw new Error("BSON type incompatible with JSON");
+		default:
+			throw new Error("Unknown BSON type " + elementType);
+		}
+		return inIdx;
+	}
+}
+
+const OBJECT_ID_RE = /^[0-9a-fA-F]{24}$/;
+
+/**
+ * Encodes JSON text as BSON, as `BSON.serialize(JSON.parse(text))` would:
+ * numbers that are int32s become Int, others Number. Strings at the paths in
+ * `objectIds` (elements of arrays share the array's path) that are 24 hex
+ * digits become ObjectIds. Unlike `JSON.parse`, invalid UTF-8 and duplicate
+ * keys are errors. (The C++ version parses the JSON directly into BSON.)
+ * @param {Uint8Array} input UTF-8 JSON text of an object.
+ * @param {{objectIds?: string[], maxDepth?: number}} [options]
+ * @returns {Buffer}
+ */
+export function jsonToBson(input, {objectIds = [], maxDepth = 200} = {}) {
+	if (!(input instanceof Uint8Array))
+		throw new Error("Input must be a buffer");
+	if (!Array.isArray(objectIds) || !objectIds.every(p => typeof p === "string"))
+		throw new TypeError("objectIds must be an array of paths");
+	if (!Number.isInteger(maxDepth) || maxDepth < 1 || maxDepth > 0xffffffff)
+		throw new TypeError("maxDepth must be a positive integer");
+
+	// Buffer#toString would replace invalid UTF-8, and JSON.parse keeps the
+	// last of duplicate keys, which writeDocument counts.
+	if (!isUtf8(input))
+		throw new Error("Invalid UTF-8 in string");
+	const value = JSON.parse(Buffer.from(input.buffer, input.byteOffset, input.length).toString());
+	if (value === null || typeof value !== "object" || Array.isArray(value))
+		throw new Error("JSON must be an object");
+	let keyCount = 0;
+
+	const paths = new Set(objectIds);
+	let out = Buffer.allocUnsafe(Math.max(input.length + 64, 256));
+	let outIdx = 0;
+	const ensureSpace = n => {
+		if (outIdx + n <= out.length)
+			return;
+		const grown = Buffer.allocUnsafe(Math.max(outIdx + n, out.length) * 3 >>> 1);
+		out.copy(grown, 0, 0, outIdx);
+		out = grown;
+	};
+	const writeCString = s => {
+		const len = Buffer.byteLength(s);
+		ensureSpace(len + 1);
+		out.write(s, outIdx);
+		if (out.subarray(outIdx, outIdx + len).includes(0))
+			throw new Error("Keys can't contain null characters");
+		outIdx += len;
+		out[outIdx++] = 0;
+	};
+
+	/**
+	 * @param {any} doc
+	 * @param {string} path
+	 * @param {number} depth
+	 */
+	const writeDocument = (doc, path, depth) => {
+		if (depth > maxDepth)
+			throw new Error("Maximum nesting depth exceeded");
+		const isArray = Array.isArray(doc);
+		ensureSpace(4);
+		const start = outIdx;
+		outIdx += 4;
+		const keys = isArray ? doc.keys() : Object.keys(doc);
+		if (!isArray)
+			keyCount += /** @type {string[]} */ (keys).length;
+		for (const k of keys) {
+			const v = doc[k];
+			const vPath = isArray ? path : path ? `${path}.${k}` : String(k);
+			const typeIdx = outIdx;
+			ensureSpace(1);
+			outIdx++;
+			writeCString(String(k));
+			if (v === null) {
+				out[typeIdx] = BSON_DATA_NULL;
+			} else if (typeof v === "boolean") {
+				out[typeIdx] = BSON_DATA_BOOLEAN;
+				ensureSpace(1);
+				out[outIdx++] = v ? 1 : 0;
+			} else if (typeof v === "number") {
+				ensureSpace(8);
+				if ((v | 0) === v && !Object.is(v, -0)) {
+					out[typeIdx] = BSON_DATA_INT;
+					outIdx = out.writeInt32LE(v, outIdx);
 				} else {
-					this.addVal(NULL);
+					out[typeIdx] = BSON_DATA_NUMBER;
+					outIdx = out.writeDoubleLE(v, outIdx);
 				}
-				break;
-			}
-			case BSON_DATA_DATE: {
-				if (8 + inIdx > inLen)
-					throw new Error("Truncated BSON (in Date)");
-				const lowBits = readInt32LE(in_, inIdx);
-				inIdx += 4;
-				const highBits = readInt32LE(in_, inIdx);
-				inIdx += 4;
-				const ms = Number(bigInt64FromHalves(lowBits, highBits));
-				const value = Buffer.from(new Date(ms).toISOString());
-				this.addQuotedVal(value);
-				break;
-			}
-			case BSON_DATA_BOOLEAN: {
-				if (1 + inIdx > inLen)
-					throw new Error("Truncated BSON (in Boolean)");
-				const value = in_[inIdx++] === 1;
-				this.addVal(value ? TRUE : FALSE);
-				break;
-			}
-			case BSON_DATA_OBJECT: {
-				const objectSize = readInt32LE(in_, inIdx);
-				this.transcodeObject(in_, inIdx, false, this.currentPath);
-				inIdx += objectSize;
-				break;
-			}
-			case BSON_DATA_ARRAY: {
-				const objectSize = readInt32LE(in_, inIdx);
-				this.transcodeObject(in_, inIdx, true, this.currentPath);
-				inIdx += objectSize;
-				if (in_[inIdx - 1] !== 0)
-					throw new Error("Invalid array terminator byte");
-				break;
-			}
-			case BSON_DATA_NULL: {
-				this.addVal(NULL);
-				break;
-			}
-			case BSON_DATA_LONG: {
-				if (8 + inIdx > inLen)
-					throw new Error("Truncated BSON (in Long)");
-				const lowBits = readInt32LE(in_, inIdx);
-				inIdx += 4;
-				const highBits = readInt32LE(in_, inIdx);
-				inIdx += 4;
-				let vx;
-				if (highBits === 0) {
-					vx = lowBits;
+			} else if (typeof v === "string") {
+				if (paths.has(vPath) && OBJECT_ID_RE.test(v)) {
+					out[typeIdx] = BSON_DATA_OID;
+					ensureSpace(12);
+					outIdx += out.write(v, outIdx, "hex");
 				} else {
-					vx = bigInt64FromHalves(lowBits, highBits);
+					out[typeIdx] = BSON_DATA_STRING;
+					const len = Buffer.byteLength(v);
+					ensureSpace(4 + len + 1);
+					outIdx = out.writeInt32LE(len + 1, outIdx);
+					outIdx += out.write(v, outIdx);
+					out[outIdx++] = 0;
 				}
-				const value = Buffer.from(vx.toString());
-				this.addVal(value);
-				break;
-			}
-			case BSON_DATA_UNDEFINED:
-				// noop
-				break;
-			case BSON_DATA_DECIMAL128:
-			case BSON_DATA_BINARY:
-			case BSON_DATA_REGEXP:
-			case BSON_DATA_SYMBOL:
-			case BSON_DATA_TIMESTAMP:
-			case BSON_DATA_MIN_KEY:
-			case BSON_DATA_MAX_KEY:
-			case BSON_DATA_CODE:
-			case BSON_DATA_CODE_W_SCOPE:
-			case BSON_DATA_DBPOINTER:
-				throw new Error("BSON type incompatible with JSON");
-			default:
-				throw new Error("Unknown BSON type " + elementType);
+			} else {
+				out[typeIdx] = Array.isArray(v) ? BSON_DATA_ARRAY : BSON_DATA_OBJECT;
+				writeDocument(v, vPath, depth + 1);
 			}
-
-			arrIdx++;
 		}
+		ensureSpace(1);
+		out[outIdx++] = 0;
+		out.writeInt32LE(outIdx - start, start);
+	};
+	writeDocument(value, "", 1);
+	if (keyCount !== countJsonKeys(input))
+		throw new Error("Duplicate key");
+	return out.subarray(0, outIdx);
+}
 
-		this.ensureSpace(1);
-		this.out[this.outIdx++] = isArray ? CLOSESQ : CLOSECURL;
+/**
+ * Returns the number of object keys in `json`, which `JSON.parse` accepted.
+ * @param {Uint8Array} json
+ */
+function countJsonKeys(json) {
+	let n = 0;
+	for (let i = 0; i < json.length; i++) {
+		if (json[i] !== QUOTE)
+			continue;
+		i++;
+		while (json[i] !== QUOTE)
+			i += json[i] === BACKSLASH ? 2 : 1;
+		let j = i + 1;
+		while (json[j] === 0x20 || json[j] === 0x0a || json[j] === 0x0d || json[j] === 0x09)
+			j++;
+		if (json[j] === COLON)
+			n++;
 	}
+	return n;
 }
 
 export const ISE = "JavaScript";
+// Only meaningful for the C++ version; see README.md.
+export const INPUT_PADDING = 64;
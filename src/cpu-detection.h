@@ -13,12 +13,19 @@ enum ISA {
 	AVX512F,
 	AVX512VL,
 	BMI1,
-	BMI2
+	BMI2,
+	WASM_SIMD128
 };
 
 template<ISA isa> bool supports() { return false; }
 template<> bool supports<ISA::BASELINE>() { return true; }
 
+#ifdef __wasm_simd128__
+// WebAssembly has no runtime feature detection; the engine validates the whole
+// module, so SIMD is available iff the module was compiled with -msimd128.
+template<> bool supports<ISA::WASM_SIMD128>() { return true; }
+#endif
+
 #if defined(__x86_64__) || defined(_M_X64)
 
 #ifdef _MSC_VER
@@ -0,0 +1,15 @@
+import {createRequire} from "node:module";
+
+const require = createRequire(import.meta.url);
+
+/**
+ * Instantiates the WebAssembly build of the C++ transcoder (see `npm run
+ * build:wasm`). Rejects if it hasn't been built or if `@emnapi/runtime` isn't
+ * installed.
+ */
+export default async function loadWasm() {
+	const {getDefaultContext} = require("@emnapi/runtime");
+	const factory = require("../wasm/bsonToJson.js");
+	const Module = await factory();
+	return Module.emnapiInit({context: getDefaultContext()});
+}
@@ -0,0 +1,30 @@
+//@ts-check
+
+// Worker side of TranscoderPool.
+
+import {parentPort, workerData} from "node:worker_threads";
+import {Transcoder, FrozenPopulateInfo} from "../index.mjs";
+
+const {populateHandle, options} = workerData;
+const t = new Transcoder(
+	populateHandle === undefined ? undefined : new FrozenPopulateInfo(populateHandle),
+	options);
+
+/** @param {{id: number, slab: SharedArrayBuffer, len: number}} msg */
+function onMessage({id, slab, len}) {
+	let json;
+	try {
+		json = t.transcode(new Uint8Array(slab, 0, len));
+	} catch (err) {
+		parentPort?.postMessage({id, slab, len: 0, error: /** @type {Error} */ (err).message});
+		return;
+	}
+	if (json.length > slab.byteLength)
+		slab = new SharedArrayBuffer(json.length);
+	new Uint8Array(slab).set(json);
+	parentPort?.postMessage({id, slab, len: json.length});
+}
+
+parentPort?.on("message", onMessage);
+// The Transcoder was created, so the pool can replace this worker if it dies.
+parentPort?.postMessage({ready: true});
@@ -0,0 +1,236 @@
+//@ts-check
+
+import {Worker} from "node:worker_threads";
+import {availableParallelism} from "node:os";
+
+const WORKER_URL = new URL("./pool-worker.mjs", import.meta.url);
+
+/**
+ * @typedef {object} Job
+ * @property {Uint8Array} bson
+ * @property {(json: Buffer) => void} resolve
+ * @property {(err: Error) => void} reject
+ */
+
+/**
+ * A pool of worker threads, each with its own Transcoder.
+ *
+ * Documents are handed to workers through a free list of SharedArrayBuffer
+ * slabs instead of `postMessage`ing them, so neither the BSON nor the JSON goes
+ * through structured clone. The BSON is copied into a free slab, the worker
+ * transcodes it from there and copies the JSON into the same slab, and the
+ * JSON is copied out of the slab into a new Buffer when the Promise resolves,
+ * after which the slab is free again. Slabs grow to fit the largest document
+ * or JSON they've carried. There are two slabs per worker so each worker can
+ * have one job queued while it works on another.
+ *
+ * A worker that dies is replaced, after its jobs are rejected. One that dies
+ * before it's ready (e.g. because its Transcoder options are invalid) isn't,
+ * and once none are left, jobs are rejected with its error.
+ */
+export class TranscoderPool {
+	/**
+	 * @param {object} [options]
+	 * @param {number} [options.size] Number of workers. Defaults to
+	 * `os.availableParallelism()`.
+	 * @param {number} [options.slabSize] Initial size of each slab in bytes.
+	 * @param {{handle: unknown}} [options.populateInfo] FrozenPopulateInfo for
+	 * the workers' Transcoders to populate paths from.
+	 * @param {object} [options.transcoder] Options for the workers' Transcoders.
+	 */
+	constructor({size = availableParallelism(), slabSize = 1 << 20, populateInfo, transcoder} = {}) {
+		/**
+		 * Null once a worker that failed to start is dropped.
+		 * @private @type {(Worker | null)[]}
+		 */
+		this.workers = [];
+		/** @private Number of jobs in flight per worker. */
+		this.inFlight = new Uint32Array(size);
+		/** @private Whether each worker has started. */
+		this.ready = new Array(size).fill(false);
+		/** @private @type {SharedArrayBuffer[]} */
+		this.freeSlabs = [];
+		/** @private @type {Job[]} */
+		this.queue = [];
+		/** @private @type {Map<number, Job & {worker: number, slab: SharedArrayBuffer}>} */
+		this.jobs = new Map();
+		/** @private */
+		this.nextId = 0;
+		/** @private */
+		this.closed = false;
+		/**
+		 * Set once every worker has failed to start.
+		 * @private @type {Error | null}
+		 */
+		this.failure = null;
+		/**
+		 * Workers only get its handle, so keep it alive until close() for them
+		 * (including replacements) to reconstruct it from.
+		 * @private
+		 */
+		this.populateInfo = populateInfo;
+		/** @private */
+		this.workerData = {populateHandle: populateInfo?.handle, options: transcoder};
+
+		for (let i = 0; i < size; i++) {
+			this.workers.push(this.startWorker(i));
+			this.freeSlabs.push(new SharedArrayBuffer(slabSize), new SharedArrayBuffer(slabSize));
+		}
+	}
+
+	/**
+	 * Transcodes the BSON buffer `bson` into a JSON string stored in a Buffer
+	 * on the least-busy worker.
+	 * @param {Uint8Array} bson
+	 * @returns {Promise<Buffer>}
+	 */
+	transcode(bson) {
+		if (this.closed)
+			return Promise.reject(new Error("TranscoderPool closed"));
+		if (this.failure)
+			return Promise.reject(this.failure);
+		if (!(bson instanceof Uint8Array))
+			return Promise.reject(new Error("Input must be a buffer"));
+		return new Promise((resolve, reject) => {
+			this.queue.push({bson, resolve, reject});
+			this.dispatch();
+		});
+	}
+
+	/**
+	 * Terminates the workers. Pending transcodes are rejected.
+	 */
+	async close() {
+		if (this.closed)
+			return;
+		this.closed = true;
+		this.rejectAll(new Error("TranscoderPool closed"));
+		await Promise.all(this.workers.map(w => w?.terminate()));
+		this.populateInfo = undefined;
+	}
+
+	/**
+	 * @param {number} i
+	 * @private
+	 */
+	startWorker(i) {
+		const worker = new Worker(WORKER_URL, {workerData: this.workerData});
+		/** @type {Error | undefined} */
+		let error;
+		worker.on("message", msg => this.onMessage(i, msg));
+		worker.on("error", err => { error = err; });
+		// Also follows "error".
+		worker.on("exit", code => this.onExit(i, worker, error ?? new Error(`Worker exited with code ${code}`)));
+		// Don't hold the process open while idle.
+		worker.unref();
+		return worker;
+	}
+
+	/**
+	 * Rejects every queued and in-flight job, returning their slabs.
+	 * @param {Error} err
+	 * @private
+	 */
+	rejectAll(err) {
+		for (const job of this.queue)
+			job.reject(err);
+		for (const job of this.jobs.values()) {
+			this.freeSlabs.push(job.slab);
+			job.reject(err);
+		}
+		this.queue.length = 0;
+		this.jobs.clear();
+		this.inFlight.fill(0);
+	}
+
+	/** @private */
+	dispatch() {
+		while (this.queue.length && this.freeSlabs.length) {
+			let worker = -1;
+			for (let i = 0; i < this.workers.length; i++) {
+				if (this.workers[i] && (worker < 0 || this.inFlight[i] < this.inFlight[worker]))
+					worker = i;
+			}
+			if (worker < 0)
+				return;
+
+			const job = /** @type {Job} */ (this.queue.shift());
+			let slab = /** @type {SharedArrayBuffer} */ (this.freeSlabs.pop());
+			if (slab.byteLength < job.bson.length)
+				slab = new SharedArrayBuffer(job.bson.length);
+			new Uint8Array(slab).set(job.bson);
+
+			const w = /** @type {Worker} */ (this.workers[worker]);
+			if (++this.inFlight[worker] === 1)
+				w.ref();
+
+			const id = this.nextId++;
+			this.jobs.set(id, {...job, worker, slab});
+			w.postMessage({id, slab, len: job.bson.length});
+		}
+	}
+
+	/**
+	 * @param {number} worker
+	 * @param {{id: number, slab: SharedArrayBuffer, len: number, error?: string} | {ready: true}} msg
+	 * @private
+	 */
+	onMessage(worker, msg) {
+		if ("ready" in msg) {
+			this.ready[worker] = true;
+			return;
+		}
+		const {id, slab, len, error} = msg;
+		const job = this.jobs.get(id);
+		this.jobs.delete(id);
+		if (--this.inFlight[worker] === 0)
+			this.workers[worker]?.unref();
+
+		// Already rejected, and its slab reclaimed, by close().
+		if (!job)
+			return;
+		if (error === undefined)
+			job.resolve(Buffer.from(new Uint8Array(slab, 0, len)));
+		else
+			job.reject(new Error(error));
+
+		// The worker may have replaced the slab with a larger one.
+		this.freeSlabs.push(slab);
+		this.dispatch();
+	}
+
+	/**
+	 * Rejects the jobs of a worker that died and reclaims their slabs, then
+	 * replaces the worker if it had started.
+	 * @param {number} i
+	 * @param {Worker} worker
+	 * @param {Error} err
+	 * @private
+	 */
+	onExit(i, worker, err) {
+		// Terminated by close(), or already replaced.
+		if (this.closed || this.workers[i] !== worker)
+			return;
+		for (const [id, job] of this.jobs) {
+			if (job.worker === i) {
+				this.jobs.delete(id);
+				this.freeSlabs.push(job.slab);
+				job.reject(err);
+			}
+		}
+		this.inFlight[i] = 0;
+
+		if (this.ready[i]) {
+			this.ready[i] = false;
+			this.workers[i] = this.startWorker(i);
+		} else {
+			this.workers[i] = null;
+			if (this.workers.every(w => w === null)) {
+				this.failure = err;
+				this.rejectAll(err);
+				return;
+			}
+		}
+		this.dispatch();
+	}
+}
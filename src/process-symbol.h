@@ -0,0 +1,21 @@
+#pragma once
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+// Returns the address of a function exported by the host process (node or
+// node.exe), or nullptr, for APIs that not every Node.js version exports.
+// Looking them up instead of linking against them lets the addon load on
+// versions that lack them.
+inline void* findProcessSymbol(const char* name) {
+#ifdef _WIN32
+	return reinterpret_cast<void*>(GetProcAddress(GetModuleHandleW(nullptr), name));
+#else
+	return dlsym(RTLD_DEFAULT, name);
+#endif
+}
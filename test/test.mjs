@@ -4,6 +4,9 @@
 import assert from "node:assert";
 import * as bson from "bson";
 import {createRequire} from "node:module";
+import {existsSync} from "node:fs";
+import * as zlib from "node:zlib";
+import loadWasm from "../src/load-wasm.mjs";
 const require = createRequire(import.meta.url);
 
 // Exercises all JSON types and nuances of JSON serialization.
@@ -36,8 +39,16 @@ const doc1 = {
 global.describe = global.describe || function describe(label, fn) { fn(); };
 global.it = global.it || function it(label, fn) { fn(); };
 
-for (const [name, loc] of [["JS", "../src/bson-to-json.mjs"], ["C++", "../build/Release/bsonToJson.node"]]) {
-	const {Transcoder, PopulateInfo} = name === "JS" ? await import(loc) : require(loc);
+const impls = [
+	["JS", () => import("../src/bson-to-json.mjs")],
+	["C++", () => require("../build/Release/bsonToJson.node")]
+];
+// The WebAssembly build needs Emscripten, so it's only tested if it was built.
+if (existsSync(new URL("../wasm/bsonToJson.js", import.meta.url)))
+	impls.push(["WASM", loadWasm]);
+
+for (const [name, load] of impls) {
+	const {Transcoder, PopulateInfo, FrozenPopulateInfo, BsonIndex, INPUT_PADDING, jsonToBson} = await load();
 
 	describe(`bson2json - ${name}`, function () {
 
@@ -57,6 +68,77 @@ for (const [name, loc] of [["JS", "../src/bson-to-json.mjs"], ["C++", "../build/
 			);
 		});
 
+		it("deserializes to JS values", function () {
+			const bsonBuffer = bson.serialize({...doc1, nested: {arr: [[], {}, {k: "é"}], "": [null]}, repeated: [{a: 1}, {a: 2}]});
+			const t = new Transcoder();
+			const obj = t.toObject(bsonBuffer);
+			assert.deepStrictEqual(obj, JSON.parse(t.transcode(bsonBuffer).toString()));
+			assert.deepStrictEqual(t.toObject(new BsonIndex(bsonBuffer)), obj);
+
+			const ref = {_id: new bson.ObjectId(), name: "ref"};
+			const populateInfo = new PopulateInfo();
+			populateInfo.addItems("r", [bson.serialize(ref)]);
+			const populating = new Transcoder(populateInfo);
+			assert.deepStrictEqual(populating.toObject(bson.serialize({r: ref._id})),
+				{r: {_id: ref._id.toHexString(), name: "ref"}});
+
+			const strict = new Transcoder(undefined, {invalidUtf8: "error"});
+			const invalid = bson.serialize({s: "ab"});
+			invalid[invalid.indexOf(0x62)] = 0xff;
+			assert.throws(() => strict.toObject(invalid), new Error("Invalid UTF-8"));
+			assert.throws(() => t.toObject(bson.serialize({b: new bson.Binary(Buffer.from([1]))})),
+				new Error("BSON type incompatible with JSON"));
+		});
+
+		it("transcodes to strings", function () {
+			const t = new Transcoder();
+			for (const doc of [
+				{a: "ascii"},
+				{a: "é😀", b: "ascii"},
+				{items: Array.from({length: 5000}, (_, i) => ({i, s: "item"}))},
+				{items: Array.from({length: 5000}, (_, i) => ({i, s: "ité"}))}
+			]) {
+				const bsonBuffer = bson.serialize(doc);
+				const str = t.transcodeToString(bsonBuffer);
+				assert.strictEqual(str, t.transcode(bsonBuffer).toString());
+				assert.strictEqual(t.transcodeToString(new BsonIndex(bsonBuffer)), str);
+			}
+			// The output memory of an external string isn't reused.
+			const big = bson.serialize({items: Array.from({length: 5000}, (_, i) => ({i}))});
+			const first = t.transcodeToString(big);
+			t.transcodeToString(bson.serialize({items: Array.from({length: 5000}, () => ({i: "x"}))}));
+			assert.deepStrictEqual(JSON.parse(first).items[4999], {i: 4999});
+			assert.throws(() => t.transcodeToString(Buffer.alloc(2)),
+				new Error("Input buffer must have length >= 5"));
+		});
+
+		it("encodes JSON as BSON", function () {
+			const obj = {
+				s: "string\tdata\n\"\\/é😀", "": "", int: -2345718, big: 2147483648,
+				number: Math.PI, exp: 1e300, neg0: -0, t: true, f: false, n: null,
+				nested: {arr: [[], {}, {k: "v"}, 1.5]}, _id: "5f0c8e1b2a3d4e5f6a7b8c9d"
+			};
+			const json = Buffer.from(JSON.stringify(obj, null, "\t"));
+			assert.deepStrictEqual(jsonToBson(json), bson.serialize(obj));
+
+			const ids = {_id: new bson.ObjectId(), refs: [new bson.ObjectId(), "x"], notId: "5f0c8e1b2a3d4e5f6a7b8c9d"};
+			assert.deepStrictEqual(
+				jsonToBson(Buffer.from(JSON.stringify(ids)), {objectIds: ["_id", "refs"]}),
+				bson.serialize({...ids, refs: [ids.refs[0], "x"]}));
+
+			assert.throws(() => jsonToBson(Buffer.from('{"a":}')));
+			assert.throws(() => jsonToBson(Buffer.from("[1]")));
+			assert.throws(() => jsonToBson(Buffer.from('{"a\\u0000":1}')), /Keys can't contain null characters/);
+			assert.throws(() => jsonToBson(Buffer.from('{"a":1,"b":{"a":2},"a":3}')), /Duplicate key/);
+			assert.deepStrictEqual(jsonToBson(Buffer.from('{"a":{"a":1},"b":[{"a":2},{"a":"\\":"}]}')),
+				bson.serialize({a: {a: 1}, b: [{a: 2}, {a: "\":"}]}));
+			assert.throws(() => jsonToBson(Buffer.from([...Buffer.from('{"a":"'), 0xc3, 0x28, ...Buffer.from('"}')])),
+				/Invalid UTF-8 in string/);
+			assert.throws(() => jsonToBson(Buffer.from('{"a":[[1]]}'), {maxDepth: 2}), /Maximum nesting depth exceeded/);
+			assert.throws(() => jsonToBson(Buffer.from("{}"), {objectIds: "_id"}),
+				new TypeError("objectIds must be an array of paths"));
+		});
+
 		it("escapes strings properly", function () {
 			const str = Buffer.allocUnsafe(0x7e);
 			for (let i = 0; i < 0x7e; i++) str[i] = i;
@@ -70,6 +152,31 @@ for (const [name, loc] of [["JS", "../src/bson-to-json.mjs"], ["C++", "../build/
 			assert.equal(jsonBuffer.toString(), JSON.stringify(bson.deserialize(bsonBuffer)));
 		});
 
+		it("grows the output for heavily escaped strings", function () {
+			// 1 B in -> 6 B out, well past the initial 2.5x estimate. Mixes in
+			// long runs of plain characters too.
+			const esc = "\x01".repeat(1000);
+			const obj = {[esc]: esc, mixed: `${esc}${"a".repeat(100)}"${"b".repeat(7)}\\`};
+
+			const bsonBuffer = bson.serialize(obj);
+			const t = new Transcoder();
+			const jsonBuffer = t.transcode(bsonBuffer);
+
+			assert.equal(jsonBuffer.toString(), JSON.stringify(obj));
+		});
+
+		it("returns independent Buffers for small and large outputs", function () {
+			const t = new Transcoder();
+			const small = bson.serialize({a: "x"});
+			const large = bson.serialize({a: "y".repeat(40000)});
+			const out1 = t.transcode(small);
+			const out2 = t.transcode(large);
+			const out3 = t.transcode(bson.serialize({a: "z"}));
+			assert.equal(out1.toString(), '{"a":"x"}');
+			assert.equal(out2.toString(), JSON.stringify({a: "y".repeat(40000)}));
+			assert.equal(out3.toString(), '{"a":"z"}');
+		});
+
 		it("writes multi-byte characters properly", function () {
 			const s1 = "𝌆"; // three bytes
 			const s2 = "\uD834\udf06"; // same as s1
@@ -158,6 +265,525 @@ for (const [name, loc] of [["JS", "../src/bson-to-json.mjs"], ["C++", "../build/
 			);
 		});
 
+		it("populates paths in arrays of objects", function () {
+			const ref1 = {_id: new bson.ObjectId(), prop1: "hello"};
+			const ref2 = {_id: new bson.ObjectId(), prop1: "world"};
+			const missing = new bson.ObjectId();
+			const doc1 = {
+				arr: [{k: ref1._id}, {k: ref2._id}, "x", {k: missing}],
+				ids: [ref2._id, ref1._id]
+			};
+
+			const populateInfo = new PopulateInfo();
+			populateInfo.addItems("arr.k", [bson.serialize(ref1), bson.serialize(ref2)]);
+			populateInfo.repeatPath("arr.k", "ids");
+
+			const bsonBuffer = bson.serialize(doc1);
+			const t = new Transcoder(populateInfo);
+			t.getMissingIds(bsonBuffer);
+			assert.deepStrictEqual(populateInfo.getMissingIdsForPath("arr.k"), [missing.buffer]);
+			const jsonBuffer = t.transcode(bsonBuffer);
+			assert.deepStrictEqual(JSON.parse(jsonBuffer.toString()), {
+				arr: [{k: {_id: `${ref1._id}`, prop1: "hello"}}, {k: {_id: `${ref2._id}`, prop1: "world"}}, "x", {k: `${missing}`}],
+				ids: [{_id: `${ref2._id}`, prop1: "world"}, {_id: `${ref1._id}`, prop1: "hello"}]
+			});
+		});
+
+		it("files populate items by their own _id", function () {
+			const ref1 = {_id: new bson.ObjectId(), prop1: "hello"};
+			const populateInfo = new PopulateInfo();
+			assert.throws(() => populateInfo.addItems("a", [bson.serialize(ref1), bson.serialize({prop1: "no id"})]),
+				new Error("Populate items must have an ObjectId _id"));
+			assert.throws(() => populateInfo.addItems("a", [bson.serialize({_id: "string", prop1: "x"})]),
+				new Error("Populate items must have an ObjectId _id"));
+			// ref1 wasn't overwritten by the item without an _id.
+			const t = new Transcoder(populateInfo);
+			assert.deepStrictEqual(JSON.parse(t.transcode(bson.serialize({a: ref1._id})).toString()),
+				{a: {_id: `${ref1._id}`, prop1: "hello"}});
+		});
+
+		it("populates from a FrozenPopulateInfo", function () {
+			const ref1 = {_id: new bson.ObjectId(), prop1: "hello"};
+			const doc1 = {a: ref1._id, b: ref1._id, c: new bson.ObjectId()};
+
+			const populateInfo = new PopulateInfo();
+			populateInfo.addItems("a", [bson.serialize(ref1)]);
+			populateInfo.repeatPath("a", "b");
+			const frozen = new FrozenPopulateInfo(populateInfo);
+			// Later changes aren't visible in the snapshot.
+			populateInfo.addItems("c", [bson.serialize({_id: doc1.c})]);
+
+			const t = new Transcoder(new FrozenPopulateInfo(frozen.handle));
+			const bsonBuffer = bson.serialize(doc1);
+			assert.deepStrictEqual(JSON.parse(t.transcode(bsonBuffer).toString()), {
+				a: {_id: `${ref1._id}`, prop1: "hello"},
+				b: {_id: `${ref1._id}`, prop1: "hello"},
+				c: `${doc1.c}`
+			});
+			assert.throws(() => t.getMissingIds(bsonBuffer),
+				new Error("Can't record missing IDs in a FrozenPopulateInfo"));
+		});
+
+		it("rejects objects that aren't a PopulateInfo", function () {
+			for (const obj of [{}, new Transcoder()]) {
+				assert.throws(() => new FrozenPopulateInfo(obj),
+					new TypeError("Expected a PopulateInfo or FrozenPopulateInfo"));
+				assert.throws(() => new Transcoder(obj),
+					new TypeError("Expected a PopulateInfo or FrozenPopulateInfo"));
+			}
+		});
+
+		it("transcodes paths of an indexed document", function () {
+			const ref1 = {_id: new bson.ObjectId(), prop1: "hello"};
+			const missing = new bson.ObjectId();
+			const doc = {k: "x\"y", arr: [1, {r: ref1._id}, {r: missing}], o: {n: 2.5, d: new Date(0)}};
+			const bsonBuffer = bson.serialize(doc);
+			const index = new BsonIndex(bsonBuffer);
+			assert.equal(index.length, 11);
+
+			const populateInfo = new PopulateInfo();
+			populateInfo.addItems("arr.r", [bson.serialize(ref1)]);
+			const t = new Transcoder(populateInfo);
+			t.getMissingIds(index);
+			assert.deepStrictEqual(populateInfo.getMissingIdsForPath("arr.r"), [missing.buffer]);
+
+			assert.equal(t.transcode(index).toString(), t.transcode(bsonBuffer).toString());
+			assert.equal(t.transcodePath(index, "").toString(), t.transcode(bsonBuffer).toString());
+			assert.equal(t.transcodePath(index, "k").toString(), JSON.stringify(doc.k));
+			assert.equal(t.transcodePath(index, "arr.0").toString(), "1");
+			assert.equal(t.transcodePath(index, "arr.1").toString(), `{"r":{"_id":"${ref1._id}","prop1":"hello"}}`);
+			assert.equal(t.transcodePath(index, "arr.2.r").toString(), `"${missing}"`);
+			assert.equal(t.transcodePath(index, "o").toString(), JSON.stringify(doc.o));
+			assert.equal(t.transcodePath(index, "o.d").toString(), JSON.stringify(doc.o.d));
+			for (const absent of ["z", "arr.3", "arr.01", "arr.r", "k.0", "o.n.x"])
+				assert.equal(t.transcodePath(index, absent), undefined);
+
+			assert.throws(() => new BsonIndex(Buffer.from([6, 0, 0, 0, 0, 0])),
+				new Error("BSON size doesn't match document"));
+		});
+
+		it("transcodes into caller memory", function () {
+			const t = new Transcoder();
+			const doc = bson.serialize({s: "x".repeat(200), n: 1});
+			const json = t.transcode(doc);
+			const target = Buffer.alloc(json.length + 10, 0x2a);
+			assert.equal(t.transcodeInto(doc, target, 4), json.length);
+			assert.deepStrictEqual(target.subarray(4, 4 + json.length), json);
+			assert.equal(target[3], 0x2a);
+			assert.equal(target[4 + json.length], 0x2a);
+			// Exactly the needed size, including the part within the padding.
+			const exact = new ArrayBuffer(json.length);
+			assert.equal(t.transcodeInto(doc, exact), json.length);
+			assert.deepStrictEqual(Buffer.from(exact), json);
+			assert.equal(t.transcodeInto(new BsonIndex(doc), new Uint8Array(json.length)), json.length);
+
+			assert.deepStrictEqual(t.transcodeInto(doc, target, 11), {needed: json.length});
+			assert.deepStrictEqual(t.transcodeInto(doc, new Uint8Array(0)), {needed: json.length});
+			assert.throws(() => t.transcodeInto(doc, target, target.length + 1),
+				new RangeError("offset is out of range"));
+			assert.throws(() => t.transcodeInto(doc, [1, 2]),
+				new TypeError("Target must be a Uint8Array or ArrayBuffer"));
+		});
+
+		it("caches responses if asked", function () {
+			const doc1 = bson.serialize({a: 1, s: "x"});
+			const doc2 = bson.serialize({b: [true]});
+			const json1 = '{"a":1,"s":"x"}';
+			const t = new Transcoder(undefined, {cacheBytes: doc1.length + json1.length});
+			const out = t.transcode(doc1);
+			assert.equal(out.toString(), json1);
+			// Hits are found by content and return the same Buffer.
+			assert.strictEqual(t.transcode(Buffer.from(doc1)), out);
+			assert.deepStrictEqual(t.cacheStats(),
+				{hits: 1, misses: 1, entries: 1, bytes: doc1.length + json1.length});
+			// Evicts doc1 to make room.
+			assert.equal(t.transcode(doc2).toString(), '{"b":[true]}');
+			assert.notStrictEqual(t.transcode(doc1), out);
+			assert.deepStrictEqual(t.cacheStats(),
+				{hits: 1, misses: 3, entries: 1, bytes: doc1.length + json1.length});
+
+			// Adding items to the PopulateInfo drops populated output.
+			const ref = {_id: new bson.ObjectId(), x: 1};
+			const populateInfo = new PopulateInfo();
+			populateInfo.addItems("r", []);
+			const populating = new Transcoder(populateInfo, {cacheBytes: 1 << 20});
+			const doc3 = bson.serialize({r: ref._id});
+			assert.equal(populating.transcode(doc3).toString(), `{"r":"${ref._id}"}`);
+			populateInfo.addItems("r", [bson.serialize(ref)]);
+			assert.equal(populating.transcode(doc3).toString(), `{"r":{"_id":"${ref._id}","x":1}}`);
+
+			assert.throws(() => new Transcoder(undefined, {cacheBytes: -1}),
+				new TypeError("cacheBytes must be a non-negative integer"));
+		});
+
+		it("writes keys in canonical order and hashes the output if asked", function () {
+			const sortKeys = v => Array.isArray(v) ? v.map(sortKeys) :
+				v && typeof v === "object" ? Object.fromEntries(Object.keys(v).sort().map(k => [k, sortKeys(v[k])])) : v;
+			const many = Object.fromEntries(Array.from({length: 40}, (_, i) => [`k${(i * 7) % 40}`, i]));
+			const doc = {b: 1, a: {d: true, c: null}, "": [{z: 1, y: 2}], aa: 3, many};
+			const bsonBuffer = bson.serialize(doc);
+			const t = new Transcoder(undefined, {canonical: true, hash: true});
+			assert.strictEqual(t.outputHash(), undefined);
+			const json = t.transcode(bsonBuffer).toString();
+			assert.strictEqual(json, JSON.stringify(sortKeys(doc)));
+			assert.strictEqual(t.transcodeFields(bsonBuffer).json.toString(), json);
+			assert.strictEqual(t.transcode(new BsonIndex(bsonBuffer)).toString(), json);
+
+			// Published XXH64 of the output, the same for every implementation.
+			t.transcode(bson.serialize({b: 1, a: {d: true, c: null}, "": [{z: 1, y: 2}], aa: 3}));
+			assert.strictEqual(t.outputHash(), "b78c9132248be293");
+			assert.strictEqual(new Transcoder(undefined, {hash: true}).outputHash(), undefined);
+			assert.strictEqual(new Transcoder().outputHash(), undefined);
+
+			// Hashed a chunk at a time while compressing.
+			const big = bson.serialize({items: Array.from({length: 5000}, (_, i) => ({z: i, a: "item"}))});
+			const bigJson = t.transcode(big);
+			const bigHash = t.outputHash();
+			t.transcodeCompressed(big);
+			assert.strictEqual(t.outputHash(), bigHash);
+			t.transcodeToString(bsonBuffer);
+			t.transcodeInto(big, Buffer.alloc(bigJson.length + 64));
+			assert.strictEqual(t.outputHash(), bigHash);
+
+			// Not an earlier call's hash.
+			t.toObject(big);
+			assert.strictEqual(t.outputHash(), undefined);
+			t.transcode(big);
+			assert.throws(() => t.transcode(big.subarray(0, 100)));
+			assert.strictEqual(t.outputHash(), undefined);
+		});
+
+		it("slices arrays if asked", function () {
+			const doc = {
+				a: [1, "two", {three: 3}, [4], 5.5, null],
+				o: {list: [[1, 2, 3], [4, 5, 6, 7]], x: "x"},
+				e: [],
+				deep: [{list: [9, 8, 7]}]
+			};
+			const bsonBuffer = bson.serialize(doc);
+			const t = new Transcoder(undefined, {arraySlices: {
+				a: {skip: 1, limit: 3, count: true},
+				"o.list": {limit: 1},
+				e: {skip: 3, count: "n"},
+				"deep.list": {skip: 5, count: true}
+			}});
+			const expected = {
+				// Only the outermost array at the path is sliced.
+				a: ["two", {three: 3}, [4]],
+				aCount: 6,
+				o: {list: [[1, 2, 3]], x: "x"},
+				e: [],
+				n: 0,
+				deep: [{list: [], listCount: 3}]
+			};
+			const json = t.transcode(bsonBuffer).toString();
+			assert.strictEqual(json, JSON.stringify(expected));
+			assert.deepStrictEqual(t.toObject(bsonBuffer), expected);
+			assert.strictEqual(t.transcodeFields(bsonBuffer).json.toString(), json);
+			const index = new BsonIndex(bsonBuffer);
+			assert.strictEqual(t.transcode(index).toString(), json);
+			// No sibling for a top-level value.
+			assert.strictEqual(t.transcodePath(index, "a").toString(), JSON.stringify(expected.a));
+
+			// Count siblings are sorted with the other keys if canonical.
+			const sorted = new Transcoder(undefined, {canonical: true, arraySlices: {
+				items: {limit: 1, count: "count"},
+				a: {limit: 1, count: true},
+				"o.a": {skip: 1, count: true}
+			}});
+			const sortedDoc = bson.serialize({items: [1, 2, 3], aB: 6, a: [4, 5], o: {b: 1, a: [7, 8]}});
+			const sortedJson = '{"a":[4],"aB":6,"aCount":2,"count":3,"items":[1],"o":{"a":[8],"aCount":2,"b":1}}';
+			assert.strictEqual(sorted.transcode(sortedDoc).toString(), sortedJson);
+			const sortedFields = sorted.transcodeFields(sortedDoc);
+			assert.strictEqual(sortedFields.json.toString(), sortedJson);
+			const sortedDoc2 = bson.serialize({items: [1, 2, 3, 4], aB: 6, a: [4, 5], o: {b: 1, a: [7, 8]}});
+			assert.strictEqual(sorted.retranscode(sortedDoc, sortedFields.json, sortedFields.fields, sortedDoc2).json.toString(),
+				sortedJson.replace('"count":3', '"count":4'));
+
+			// The next page, and the response cache is emptied.
+			const page = bson.serialize({a: [1, 2, 3, 4, 5]});
+			const cached = new Transcoder(undefined, {cacheBytes: 1 << 20, arraySlices: {a: {limit: 2}}});
+			assert.strictEqual(cached.transcode(page).toString(), '{"a":[1,2]}');
+			cached.setArraySlices({a: {skip: 2, limit: 2}});
+			assert.strictEqual(cached.transcode(page).toString(), '{"a":[3,4]}');
+			cached.setArraySlices({});
+			assert.strictEqual(cached.transcode(page).toString(), '{"a":[1,2,3,4,5]}');
+
+			// Fields sliced differently aren't copied.
+			const paged = new Transcoder(undefined, {arraySlices: {a: {limit: 2}}});
+			const pageFields = paged.transcodeFields(page);
+			paged.setArraySlices({a: {skip: 2, limit: 2}});
+			assert.strictEqual(paged.retranscode(page, pageFields.json, pageFields.fields, page).json.toString(), '{"a":[3,4]}');
+
+			for (const slices of [[], {a: 1}, {a: {skip: -1}}, {a: {limit: 1.5}}, {a: {count: 3}}]) {
+				assert.throws(() => new Transcoder(undefined, {arraySlices: slices}),
+					new TypeError("arraySlices must map paths to {skip, limit, count}"));
+			}
+		});
+
+		it("caches short strings if asked", function () {
+			const doc = bson.serialize({a: "on", b: "on", c: 'q"\n', d: ['q"\n', "x".repeat(33)], e: "on"});
+			const json = '{"a":"on","b":"on","c":"q\\"\\n","d":["q\\"\\n","' + "x".repeat(33) + '"],"e":"on"}';
+			// With one slot, "on" and 'q"\n' evict each other.
+			const t = new Transcoder(undefined, {stringCache: 1});
+			assert.equal(t.transcode(doc).toString(), json);
+			assert.deepStrictEqual(t.stringCacheStats(), {hits: 2, misses: 3, slots: 1});
+			const ascii = new Transcoder(undefined, {stringCache: 100, asciiOnly: true});
+			const doc2 = bson.serialize({a: "é", b: "é"});
+			assert.equal(ascii.transcode(doc2).toString(), '{"a":"\\u00e9","b":"\\u00e9"}');
+			assert.deepStrictEqual(ascii.stringCacheStats(), {hits: 1, misses: 1, slots: 128});
+
+			assert.throws(() => new Transcoder(undefined, {stringCache: 1.5}),
+				new TypeError("stringCache must be an integer from 0 to 65536"));
+		});
+
+		it("re-transcodes only changed top-level fields", function () {
+			const v1 = {_id: new bson.ObjectId(), s: "hello", o: {a: [1, 2]}, n: 5};
+			const b1 = bson.serialize(v1);
+			const t = new Transcoder();
+			const r1 = t.transcodeFields(b1);
+			assert.equal(r1.json.toString(), JSON.stringify(v1));
+			assert.equal(r1.fields.length, 2 + 4 * 4);
+
+			// Unchanged fields are copied from the previous JSON.
+			const prevJson = Buffer.from(r1.json.toString().replace("hello", "HELLO"));
+			for (const v2 of [{...v1, n: 6}, {...v1, o: {}}, {z: null, ...v1}, {n: 5, s: "hello"}]) {
+				const b2 = bson.serialize(v2);
+				const r2 = t.retranscode(b1, prevJson, r1.fields, b2);
+				assert.equal(r2.json.toString(), JSON.stringify(v2).replace("hello", "HELLO"));
+				assert.deepStrictEqual(r2.fields, t.transcodeFields(b2).fields);
+			}
+
+			assert.throws(() => t.retranscode(b1, r1.json, r1.fields.subarray(1), b1),
+				new Error("Invalid fields"));
+		});
+
+		it("compresses the output if asked", function () {
+			const t = new Transcoder();
+			const small = bson.serialize(doc1);
+			const json = t.transcode(small).toString();
+			assert.equal(zlib.gunzipSync(t.transcodeCompressed(small)).toString(), json);
+			assert.equal(zlib.inflateSync(t.transcodeCompressed(small, {format: "deflate", level: "fast"})).toString(), json);
+			assert.equal(zlib.inflateRawSync(t.transcodeCompressed(small, {format: "raw", level: 9})).toString(), json);
+			assert.equal(zlib.brotliDecompressSync(t.transcodeCompressed(small, {format: "br"})).toString(), json);
+
+			// Spans many chunks, including strings larger than a chunk.
+			const items = [];
+			for (let i = 0; i < 2000; i++)
+				items.push({i, s: "x".repeat(i * 37 % 300), id: new bson.ObjectId()});
+			const big = bson.serialize({items, long: "\t".repeat(50000)});
+			const bigJson = t.transcode(big).toString();
+			assert.equal(zlib.gunzipSync(t.transcodeCompressed(big, {level: "fast"})).toString(), bigJson);
+			assert.equal(zlib.brotliDecompressSync(t.transcodeCompressed(big, {format: "br", level: 5})).toString(), bigJson);
+
+			// The JSON is flushed in pieces even when it's all in one
+			// top-level field.
+			const nested = bson.serialize({items});
+			const nestedJson = t.transcode(nested).toString();
+			assert.equal(zlib.gunzipSync(t.transcodeCompressed(nested)).toString(), nestedJson);
+			const {chunks, peakBytes} = t.compressStats();
+			if (name !== "JS") {
+				assert.ok(chunks > 1);
+				assert.ok(peakBytes < nestedJson.length / 4);
+			} else {
+				assert.deepStrictEqual(t.compressStats(), {chunks: 1, peakBytes: nestedJson.length});
+			}
+
+			assert.throws(() => t.transcodeCompressed(small, {format: "zip"}),
+				new TypeError('format must be "gzip", "deflate", "raw" or "br"'));
+			assert.throws(() => t.transcodeCompressed(small, {level: 10}),
+				new TypeError('level must be "fast" or an integer from -1 to 9'));
+			assert.throws(() => t.transcodeCompressed(small, {format: "br", level: -1}),
+				new TypeError('level must be "fast" or an integer from 0 to 11'));
+			assert.throws(() => t.transcodeCompressed(Buffer.from([6, 0, 0, 0, 2, 0])));
+		});
+
+		it("transcodes change events into an envelope", function () {
+			const id = new bson.ObjectId();
+			// Like real events, these have fields before the envelope's paths
+			// that can't be written as JSON (clusterTime is a Timestamp).
+			const update = {
+				_id: {_data: "8263"}, operationType: "update",
+				clusterTime: new bson.Timestamp({t: 1700000000, i: 1}), wallTime: new Date(1700000000000),
+				lsid: {id: new bson.Binary(Buffer.alloc(16, 1), 4)}, txnNumber: bson.Long.fromNumber(1),
+				ns: {db: "d", coll: "c"}, documentKey: {_id: id},
+				fullDocument: {_id: id, name: "x", n: [1, 2]},
+				updateDescription: {updatedFields: {name: "x"}, removedFields: []}
+			};
+			const del = {
+				_id: {_data: "8264"}, operationType: "delete",
+				clusterTime: new bson.Timestamp({t: 1700000001, i: 1}), wallTime: new Date(1700000001000),
+				ns: {db: "d", coll: "c"}, documentKey: {_id: id}
+			};
+			const expected = ({operationType, documentKey, fullDocument, updateDescription}) =>
+				JSON.stringify({operationType, documentKey, fullDocument, updateDescription});
+
+			const t = new Transcoder();
+			assert.equal(t.transcodeChangeEvents(bson.serialize(update)).toString(), expected(update));
+			assert.equal(t.transcodeChangeEvents([bson.serialize(update), bson.serialize(del)]).toString(),
+				expected(update) + "\n" + expected(del) + "\n");
+
+			const custom = new Transcoder(undefined, {
+				changeEnvelope: {op: "operationType", id: "documentKey._id", doc: "fullDocument", first: "fullDocument.n.0"}
+			});
+			assert.equal(custom.transcodeChangeEvents(bson.serialize(update)).toString(),
+				JSON.stringify({op: "update", id, doc: update.fullDocument, first: 1}));
+			assert.equal(custom.transcodeChangeEvents(bson.serialize(del)).toString(),
+				JSON.stringify({op: "delete", id}));
+
+			assert.throws(() => new Transcoder(undefined, {changeEnvelope: {op: 1}}),
+				new TypeError("changeEnvelope must map output keys to event paths"));
+		});
+
+		it("validates UTF-8 if asked", function () {
+			// Returns a document with one string element.
+			const stringDoc = (key, value) => {
+				const size = 4 + 1 + key.length + 1 + 4 + value.length + 1 + 1;
+				const b = Buffer.alloc(size);
+				let i = b.writeInt32LE(size, 0);
+				b[i++] = 2;
+				i += key.copy(b, i) + 1;
+				i = b.writeInt32LE(value.length + 1, i);
+				value.copy(b, i);
+				return b;
+			};
+			const valid = ["héllo \"wörld\"\n €𝄞", "é"];
+			const invalid = [
+				[0xff], [0x80], [0xc3], [0xe2, 0x82], [0xf0, 0x9f, 0x98], [0xc0, 0xaf],
+				[0xed, 0xa0, 0x80], [0xf4, 0x90, 0x80, 0x80], [0xe2, 0x41, 0x82, 0xac]
+			];
+			const cases = [];
+			for (const pad of [0, 15, 16, 31, 32, 40]) {
+				const prefix = Buffer.from("a".repeat(pad) + "\t");
+				for (const v of valid)
+					cases.push([Buffer.concat([prefix, Buffer.from(v), prefix]), true]);
+				for (const bytes of invalid) {
+					cases.push([Buffer.concat([prefix, Buffer.from(bytes)]), false]);
+					cases.push([Buffer.concat([prefix, Buffer.from(bytes), Buffer.from("éz\"")]), false]);
+				}
+			}
+
+			const copy = new Transcoder();
+			const error = new Transcoder(undefined, {invalidUtf8: "error"});
+			const replace = new Transcoder(undefined, {invalidUtf8: "replace"});
+			for (const [bytes, isValid] of cases) {
+				const expected = bytes.toString();
+				for (const doc of [stringDoc(Buffer.from("k"), bytes), stringDoc(bytes, Buffer.from("v"))]) {
+					const parse = t => JSON.parse(t.transcode(doc).toString());
+					const fromReplace = parse(replace);
+					assert.deepStrictEqual(fromReplace, "k" in fromReplace ? {k: expected} : {[expected]: "v"});
+					if (isValid) {
+						assert.deepStrictEqual(parse(error), fromReplace);
+						assert.deepStrictEqual(parse(copy), fromReplace);
+					} else {
+						assert.throws(() => error.transcode(doc), new Error("Invalid UTF-8"));
+					}
+				}
+			}
+
+			assert.throws(() => new Transcoder(undefined, {invalidUtf8: "ignore"}),
+				new TypeError('invalidUtf8 must be "copy", "error" or "replace"'));
+		});
+
+		it("writes ASCII-only output if asked", function () {
+			const doc = {
+				"kéy": "héllo \"wörld\"\n € 𝄞 中文 ".repeat(5),
+				ascii: "a".repeat(40),
+				arr: ["\u00ff", "\u0100\u07ff\u0800\uffff\u{10000}\u{10ffff}"]
+			};
+			const t = new Transcoder(undefined, {asciiOnly: true});
+			const json = t.transcode(bson.serialize(doc));
+			assert.ok(json.every(c => c < 0x80));
+			const expected = JSON.stringify(doc)
+				.replace(/[\u0080-\uffff]/g, c => `\\u${c.charCodeAt(0).toString(16).padStart(4, "0")}`);
+			assert.equal(json.toString(), expected);
+
+			const invalid = bson.serialize({s: "xéx"});
+			invalid[invalid.indexOf(0xc3)] = 0xff;
+			assert.equal(t.transcode(invalid).toString(), '{"s":"x\\ufffd\\ufffdx"}');
+			const strict = new Transcoder(undefined, {asciiOnly: true, invalidUtf8: "error"});
+			assert.throws(() => strict.transcode(invalid), new Error("Invalid UTF-8"));
+
+			const ref = {_id: new bson.ObjectId(), s: "é \"𝄞\""};
+			const populateInfo = new PopulateInfo();
+			populateInfo.addItems("r", [bson.serialize(ref)]);
+			const populating = new Transcoder(populateInfo, {asciiOnly: true});
+			assert.equal(populating.transcode(bson.serialize({r: ref._id})).toString(),
+				`{"r":{"_id":"${ref._id}","s":"\\u00e9 \\"\\ud834\\udd1e\\""}}`);
+		});
+
+		it("writes HTML-safe output if asked", function () {
+			const doc = {
+				"<k&y>": "</script><!-- a & b \u2028\u2029 \u2027\u202a é ".repeat(5),
+				ascii: "a".repeat(40),
+				arr: ["<", ">", "&", "\u2028", "x\u2029"]
+			};
+			const expected = JSON.stringify(doc)
+				.replace(/[<>&\u2028\u2029]/g, c => `\\u${c.charCodeAt(0).toString(16).padStart(4, "0")}`);
+			const t = new Transcoder(undefined, {htmlSafe: true});
+			const json = t.transcode(bson.serialize(doc)).toString();
+			assert.equal(json, expected);
+			assert.deepEqual(JSON.parse(json), doc);
+
+			const ascii = new Transcoder(undefined, {htmlSafe: true, asciiOnly: true});
+			assert.equal(ascii.transcode(bson.serialize(doc)).toString(),
+				expected.replace(/[\u0080-\uffff]/g, c => `\\u${c.charCodeAt(0).toString(16).padStart(4, "0")}`));
+
+			const invalid = bson.serialize({s: "x\u2028x"});
+			invalid[invalid.indexOf(0xe2) + 2] = 0xff;
+			assert.deepEqual([...t.transcode(invalid)], [...Buffer.from('{"s":"x\xe2\x80\xffx"}', "latin1")]);
+			const replacing = new Transcoder(undefined, {htmlSafe: true, invalidUtf8: "replace"});
+			assert.equal(replacing.transcode(invalid).toString(), '{"s":"x\ufffd\ufffdx"}');
+
+			const ref = {_id: new bson.ObjectId(), s: "</script><script>alert(1)</script> & \u2028é"};
+			const populateInfo = new PopulateInfo();
+			populateInfo.addItems("r", [bson.serialize(ref)]);
+			const populating = new Transcoder(populateInfo, {htmlSafe: true});
+			const populated = populating.transcode(bson.serialize({r: ref._id})).toString();
+			assert.equal(populated, JSON.stringify({r: {...ref, _id: `${ref._id}`}})
+				.replace(/[<>&\u2028\u2029]/g, c => `\\u${c.charCodeAt(0).toString(16).padStart(4, "0")}`));
+			assert.ok(!populated.includes("</script>"));
+		});
+
+		it("ignores bytes past the end of the input", function () {
+			const obj = {s: "a\"b\\c".repeat(7), k: ["x", "y"]};
+			const doc = bson.serialize(obj);
+			const t = new Transcoder();
+			for (const pad of [0, 3, INPUT_PADDING]) {
+				const padded = Buffer.alloc(doc.length + pad, "\"\\\u0001\u00e9");
+				doc.copy(padded);
+				assert.equal(t.transcode(padded.subarray(0, doc.length)).toString(), JSON.stringify(obj));
+			}
+		});
+
+		it("limits nesting depth", function () {
+			// {a: {a: ... {} ...}} with `depth` levels, counting the outer one.
+			const nested = depth => {
+				const buf = Buffer.alloc(depth * 8 - 3);
+				for (let i = 0; i < depth; i++) {
+					const start = i * 7;
+					buf.writeInt32LE(buf.length - i * 8, start);
+					if (i < depth - 1)
+						buf.set([3, "a".charCodeAt(0), 0], start + 4);
+				}
+				return buf;
+			};
+			const json = depth => "{\"a\":".repeat(depth - 1) + "{}" + "}".repeat(depth - 1);
+
+			const t = new Transcoder();
+			assert.equal(t.transcode(nested(200)).toString(), json(200));
+			assert.throws(() => t.transcode(nested(201)), new Error("Maximum nesting depth exceeded"));
+			assert.throws(() => t.getMissingIds(nested(201)), new Error("Maximum nesting depth exceeded"));
+			if (name !== "JS") {
+				// Would overflow a recursive walker.
+				assert.throws(() => t.transcode(nested(1e5)), new Error("Maximum nesting depth exceeded"));
+				const deep = new Transcoder(undefined, {maxDepth: 1e5});
+				assert.equal(deep.transcode(nested(1e5)).toString(), json(1e5));
+			}
+			assert.throws(() => new Transcoder(undefined, {maxDepth: 0}),
+				new TypeError("maxDepth must be a positive integer"));
+		});
+
 		it("handles non-buffer inputs", function () {
 			const t = new Transcoder();
 			assert.throws(() => t.transcode(undefined),
@@ -184,6 +810,19 @@ for (const [name, loc] of [["JS", "../src/bson-to-json.mjs"], ["C++", "../build/
 				new Error("Bad string length"));
 		});
 
+		it("handles unterminated documents", function () {
+			const inv = Buffer.from([
+				10, 0, 0, 0, // 10 B document
+				2, // string
+				"a".charCodeAt(0), "b".charCodeAt(0), "c".charCodeAt(0),
+				"d".charCodeAt(0), "e".charCodeAt(0) // unterminated key
+			]);
+
+			const t = new Transcoder();
+			assert.throws(() => t.transcode(inv),
+				new Error("BSON document must end with a null byte"));
+		});
+
 		it("handles buffers too short for ObjectId", function () {
 			const inv = Buffer.from([
 				12, 0, 0, 0, // 12 B document
@@ -240,6 +879,82 @@ for (const [name, loc] of [["JS", "../src/bson-to-json.mjs"], ["C++", "../build/
 	});
 }
 
+describe("canonical toObject", function () {
+	it("has the same key order in every implementation", async function () {
+		const doc = bson.serialize({b: 1, a: {d: true, c: null}, list: [{z: 1, y: 2}], aa: 3});
+		const options = {canonical: true, arraySlices: {list: {limit: 1, count: "count"}}};
+		const expected = ["a", "aa", "b", "count", "list"];
+		for (const [name, load] of impls) {
+			const {Transcoder} = await load();
+			const obj = new Transcoder(undefined, options).toObject(doc);
+			assert.deepStrictEqual(Object.keys(obj), expected, name);
+			assert.deepStrictEqual(Object.keys(obj.a), ["c", "d"], name);
+			assert.deepStrictEqual(Object.keys(obj.list[0]), ["y", "z"], name);
+		}
+	});
+});
+
+const {TranscoderPool} = await import("../src/pool.mjs");
+describe("TranscoderPool", function () {
+	const {Transcoder} = require("../build/Release/bsonToJson.node");
+
+	it("transcodes concurrently, including documents larger than a slab", async function () {
+		const pool = new TranscoderPool({size: 2, slabSize: 64});
+		try {
+			const docs = [];
+			for (let i = 0; i < 20; i++)
+				docs.push(bson.serialize({i, s: "x".repeat(i * 10), doc1}));
+			const t = new Transcoder();
+			const results = await Promise.all(docs.map(d => pool.transcode(d)));
+			for (let i = 0; i < docs.length; i++)
+				assert.equal(results[i].toString(), t.transcode(docs[i]).toString());
+		} finally {
+			await pool.close();
+		}
+	});
+
+	it("populates paths in the workers", async function () {
+		const {PopulateInfo, FrozenPopulateInfo} = require("../build/Release/bsonToJson.node");
+		const ref = {_id: new bson.ObjectId(), x: 1};
+		const populateInfo = new PopulateInfo();
+		populateInfo.addItems("r", [bson.serialize(ref)]);
+		const pool = new TranscoderPool({size: 2, populateInfo: new FrozenPopulateInfo(populateInfo)});
+		try {
+			const json = await pool.transcode(bson.serialize({r: ref._id}));
+			assert.deepStrictEqual(JSON.parse(json.toString()), {r: {_id: `${ref._id}`, x: 1}});
+		} finally {
+			await pool.close();
+		}
+	});
+
+	it("rejects with the transcoder's errors", async function () {
+		const pool = new TranscoderPool({size: 1});
+		try {
+			await assert.rejects(pool.transcode(new Uint8Array([100, 0, 0, 0, 0])),
+				new Error("BSON size exceeds input length"));
+			await assert.rejects(pool.transcode(/** @type {any} */ ("x")),
+				new Error("Input must be a buffer"));
+		} finally {
+			await pool.close();
+		}
+	});
+
+	it("replaces workers that die and rejects jobs after close", async function () {
+		const pool = new TranscoderPool({size: 1});
+		const doc = bson.serialize({a: 1});
+		try {
+			assert.equal((await pool.transcode(doc)).toString(), '{"a":1}');
+			const pending = pool.transcode(doc);
+			await /** @type {any} */ (pool).workers[0].terminate();
+			await assert.rejects(pending, /Worker exited/);
+			assert.equal((await pool.transcode(doc)).toString(), '{"a":1}');
+		} finally {
+			await pool.close();
+		}
+		await assert.rejects(pool.transcode(doc), new Error("TranscoderPool closed"));
+	});
+});
+
 
 // TODO setup mongodb in CI
 if (!process.env.GITHUB_ACTIONS)